@@ -20,7 +20,16 @@
 	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
+#ifndef __MINGW32__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include "sim_avr.h"
 #include "sim_time.h"
 #include "ac_input.h"
@@ -28,8 +37,22 @@
 #define USECS_PER_SECOND (1000 * 1000)
 #define HZ (50)
 
+/*
+ * Cycle of crossing 'i' of pass 'pass', from the start of the waveform
+ * so the rounding doesn't accumulate
+ */
 static avr_cycle_count_t
-switch_auto(
+ac_input_when(
+		ac_input_t * b,
+		uint32_t pass,
+		uint32_t i)
+{
+	return b->start + (avr_cycle_count_t)(
+			(pass * b->period + b->at[i]) * b->avr->frequency + 0.5);
+}
+
+static avr_cycle_count_t
+ac_input_cross(
 		struct avr_t * avr,
         avr_cycle_count_t when,
         void * param)
@@ -37,18 +60,211 @@ switch_auto(
 	ac_input_t * b = (ac_input_t *) param;
 	b->value = !b->value;
 	avr_raise_irq(b->irq + IRQ_AC_OUT, b->value);
-	return when + avr_usec_to_cycles(avr, USECS_PER_SECOND / HZ);
+
+	if (++b->next >= b->count) {
+		if (!b->loop)
+			return 0;
+		b->next = 0;
+		b->pass++;
+	}
+	avr_cycle_count_t next = ac_input_when(b, b->pass, b->next);
+	// crossings closer than a cycle still each toggle
+	return next > when ? next : when + 1;
+}
+
+/*
+ * Start the waveform in 'at' from now
+ */
+static void
+ac_input_start(
+		ac_input_t * b)
+{
+	avr_t * avr = b->avr;
+
+	avr_cycle_timer_cancel(avr, ac_input_cross, b);
+	b->value = b->start_value;
+	avr_raise_irq(b->irq + IRQ_AC_OUT, b->value);
+	b->next = b->pass = 0;
+	b->start = avr->cycle;
+	if (!b->count)
+		return;
+	avr_cycle_timer_register(avr, ac_input_when(b, 0, 0) - avr->cycle,
+			ac_input_cross, b);
+}
+
+static void
+ac_input_set(
+		ac_input_t * b,
+		double * at,
+		uint32_t count,
+		uint8_t start_value,
+		double period,
+		uint8_t loop)
+{
+	free(b->at);
+	b->at = at;
+	b->count = count;
+	b->start_value = start_value;
+	b->period = period;
+	b->loop = loop && period > 0;
+	ac_input_start(b);
+}
+
+void
+ac_input_sine(
+		ac_input_t * b,
+		float hz,
+		int16_t amplitude,
+		int16_t offset,
+		int16_t threshold,
+		uint16_t hysteresis)
+{
+	double hi = (threshold + hysteresis / 2.0 - offset) / amplitude;
+	double lo = (threshold - hysteresis / 2.0 - offset) / amplitude;
+	double period = 1.0 / hz;
+
+	// never crosses, it stays where it starts
+	if (!amplitude || hi >= 1 || lo <= -1) {
+		ac_input_set(b, NULL, 0, offset > threshold, period, 0);
+		return;
+	}
+	double * at = malloc(2 * sizeof(double));
+	// the rising crossing is in the first quarter, or the last one
+	double rise = asin(hi) / (2 * M_PI) * period;
+	double fall = (0.5 - asin(lo) / (2 * M_PI)) * period;
+	if (rise < 0)
+		rise += period;
+	uint8_t first_rise = rise < fall;
+	at[0] = first_rise ? rise : fall;
+	at[1] = first_rise ? fall : rise;
+	ac_input_set(b, at, 2, !first_rise, period, 1);
+}
+
+/*
+ * Walk the samples once, with the hysteresis, and keep where each
+ * crossing happens, interpolated between the two samples around it.
+ * When it 'loop's, a pass that ends on the other level has one more
+ * at its end, back to where the next one starts
+ */
+static uint32_t
+ac_input_scan(
+		const int16_t * s,
+		uint32_t n,
+		uint32_t rate,
+		int16_t threshold,
+		uint16_t hysteresis,
+		int loop,
+		double ** at)
+{
+	double hi = threshold + hysteresis / 2.0;
+	double lo = threshold - hysteresis / 2.0;
+	uint32_t count = 0, size = 0;
+	uint8_t state = s[0] > threshold;
+
+	*at = NULL;
+	for (uint32_t i = 1; i < n; i++) {
+		double v = s[i], p = s[i - 1];
+		double level;
+		if (!state && v > hi)
+			level = hi;
+		else if (state && v < lo)
+			level = lo;
+		else
+			continue;
+		state = !state;
+		if (count == size) {
+			size = size ? size * 2 : 64;
+			*at = realloc(*at, size * sizeof(double));
+		}
+		double frac = v != p ? (level - p) / (v - p) : 0;
+		if (frac < 0)	// the previous sample was inside the hysteresis
+			frac = 0;
+		(*at)[count++] = (i - 1 + frac) / rate;
+	}
+	if (loop && state != (s[0] > threshold)) {
+		*at = realloc(*at, (count + 1) * sizeof(double));
+		(*at)[count++] = (double)n / rate;
+	}
+	return count;
+}
+
+int
+ac_input_load(
+		ac_input_t * b,
+		const char * filename,
+		uint32_t rate,
+		int16_t threshold,
+		uint16_t hysteresis,
+		int loop)
+{
+	avr_t * avr = b->avr;
+	const int16_t * s = NULL;
+	uint32_t n = 0;
+#ifndef __MINGW32__
+	struct stat st;
+	int fd = open(filename, O_RDONLY);
+	if (fd != -1 && !fstat(fd, &st) && st.st_size >= sizeof(int16_t)) {
+		s = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (s == MAP_FAILED)
+			s = NULL;
+		n = st.st_size / sizeof(int16_t);
+	}
+	if (fd != -1)
+		close(fd);
+#else
+	FILE * f = fopen(filename, "rb");
+	if (f) {
+		fseek(f, 0, SEEK_END);
+		n = ftell(f) / sizeof(int16_t);
+		fseek(f, 0, SEEK_SET);
+		s = malloc(n * sizeof(int16_t));
+		if (fread((void *)s, sizeof(int16_t), n, f) != n)
+			n = 0;
+		fclose(f);
+	}
+#endif
+	if (!s || !n || !rate) {
+		AVR_LOG(avr, LOG_ERROR, "AC_INPUT: %s: can't read samples from '%s'\n",
+				__func__, filename);
+		return -1;
+	}
+	double * at;
+	uint32_t count = ac_input_scan(s, n, rate, threshold, hysteresis, loop, &at);
+	uint8_t start_value = s[0] > threshold;
+#ifndef __MINGW32__
+	munmap((void *)s, st.st_size);
+#else
+	free((void *)s);
+#endif
+	printf("ac_input_load %s: %u samples, %u crossings\n", filename, n, count);
+	ac_input_set(b, at, count, start_value, (double)n / rate, loop);
+	return 0;
 }
 
 static const char * name = ">ac_input";
 
 void ac_input_init(avr_t *avr, ac_input_t *b)
 {
+	memset(b, 0, sizeof(*b));
 	b->irq = avr_alloc_irq(&avr->irq_pool, 0, IRQ_AC_COUNT, &name);
 	b->avr = avr;
-	b->value = 0;
-	avr_cycle_timer_register_usec(avr, USECS_PER_SECOND / HZ, switch_auto, b);
+
+	// toggles every USECS_PER_SECOND / HZ
+	double * at = malloc(2 * sizeof(double));
+	at[0] = 1.0 / HZ;
+	at[1] = 2.0 / HZ;
+	ac_input_set(b, at, 2, 0, 2.0 / HZ, 1);
 	printf("ac_input_init period %duS or %d cycles\n",
 			USECS_PER_SECOND / HZ,
 			(int)avr_usec_to_cycles(avr, USECS_PER_SECOND / HZ));
 }
+
+void
+ac_input_dispose(
+		ac_input_t * b)
+{
+	avr_cycle_timer_cancel(b->avr, ac_input_cross, b);
+	free(b->at);
+	b->at = NULL;
+	b->count = 0;
+}
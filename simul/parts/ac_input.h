@@ -21,7 +21,14 @@
  */
 
 /*
- * Simulates a 50hz changing signal
+ * Simulates the output of a comparator fed with an analog signal. By
+ * default it's a square wave toggling every 20ms; ac_input_sine() and
+ * ac_input_load() replace it with a sine generator or a recorded
+ * waveform, compared against a threshold with some hysteresis.
+ *
+ * The crossings of the threshold are all computed when the waveform is
+ * set, the timer then only fires once per crossing, whatever the
+ * sample rate, so a mains zero crossing detector runs at full speed.
  */
 
 #ifndef __AC_INPUT_H__
@@ -39,6 +46,18 @@ typedef struct ac_input_t {
     avr_irq_t * irq;
     struct avr_t * avr;
     uint8_t value;
+
+    // crossings of one pass of the waveform, in seconds from its start;
+    // they alternate, the first one goes away from 'start_value'
+    double * at;
+    uint32_t count;
+    uint8_t start_value;
+    double period;			// length of a pass
+    uint8_t loop;			// repeat the waveform
+
+    uint32_t next;			// next crossing
+    uint32_t pass;
+    avr_cycle_count_t start;
 } ac_input_t;
 
 void
@@ -46,4 +65,35 @@ ac_input_init(
 			struct avr_t * avr,
 			ac_input_t * b);
 
+/*
+ * A sine wave of 'hz', around 'offset'. The output goes high above
+ * threshold + hysteresis / 2, low under threshold - hysteresis / 2.
+ */
+void
+ac_input_sine(
+			ac_input_t * b,
+			float hz,
+			int16_t amplitude,
+			int16_t offset,
+			int16_t threshold,
+			uint16_t hysteresis);
+
+/*
+ * A recorded waveform, raw signed 16 bits little endian samples at
+ * 'rate' per second; 'loop' to replay it forever. Returns 0, or -1
+ * if the file can't be read.
+ */
+int
+ac_input_load(
+			ac_input_t * b,
+			const char * filename,
+			uint32_t rate,
+			int16_t threshold,
+			uint16_t hysteresis,
+			int loop);
+
+void
+ac_input_dispose(
+			ac_input_t * b);
+
 #endif
@@ -0,0 +1,227 @@
+/*
+	button_ladder.c
+
+	Copyright 2016, Fernando Vicente <fvicente@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "sim_avr.h"
+#include "sim_time.h"
+#include "button_ladder.h"
+
+uint32_t
+button_ladder_level(
+		button_ladder_t * b,
+		uint8_t pressed)
+{
+	// the pressed buttons are in parallel, against the pullup
+	double g = 0;
+	for (int i = 0; i < b->count; i++) {
+		if (!(pressed & (1 << i)))
+			continue;
+		if (!b->r[i])
+			return 0;	// dead short
+		g += 1.0 / b->r[i];
+	}
+	return (uint32_t)(b->vcc / (1.0 + b->pullup * g) + 0.5);
+}
+
+/*
+ * Replays the bounce waveform; odd steps are the contacts opening again,
+ * the last step is always even, and leaves the settled value
+ */
+static avr_cycle_count_t
+button_ladder_bounce(
+		avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	button_ladder_t * b = (button_ladder_t *)param;
+
+	b->bounce_step++;
+	avr_raise_irq(b->irq + IRQ_LADDER_OUT,
+			(b->bounce_step & 1) ? b->prev : b->value);
+	if (b->bounce_step >= b->bounce_count)
+		return 0;
+	return b->bounce_start + b->bounce[b->bounce_step];
+}
+
+static void
+button_ladder_set(
+		button_ladder_t * b,
+		uint8_t pressed,
+		avr_cycle_count_t when)
+{
+	avr_t * avr = b->avr;
+
+	if (pressed == b->pressed)
+		return;
+	b->pressed = pressed;
+	// what the node shows now, it could be in the middle of a bounce
+	b->prev = b->irq[IRQ_LADDER_OUT].value;
+	b->value = button_ladder_level(b, pressed);
+	avr_raise_irq(b->irq + IRQ_LADDER_OUT, b->value);
+
+	if (!b->bounce_count)
+		return;
+	b->bounce_step = 0;
+	b->bounce_start = when;
+	avr_cycle_count_t next = when + b->bounce[0];
+	avr_cycle_timer_register(avr,
+			next > avr->cycle ? next - avr->cycle : 0,
+			button_ladder_bounce, b);
+}
+
+static avr_cycle_count_t
+button_ladder_event(
+		avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	button_ladder_t * b = (button_ladder_t *)param;
+
+	while (b->head < b->tail && b->events[b->head].when <= when) {
+		button_ladder_event_t * e = &b->events[b->head++];
+		uint8_t mask = 1 << e->button;
+		button_ladder_set(b,
+				e->pressed ? (b->pressed | mask) : (b->pressed & ~mask),
+				when);
+	}
+	if (b->head == b->tail) {
+		b->head = b->tail = 0;
+		return 0;
+	}
+	return b->events[b->head].when;
+}
+
+void
+button_ladder_script(
+		button_ladder_t * b,
+		const button_ladder_event_t * events,
+		uint32_t count)
+{
+	avr_t * avr = b->avr;
+
+	// make room, compacting what was already consumed
+	if (b->head) {
+		memmove(b->events, b->events + b->head,
+				(b->tail - b->head) * sizeof(b->events[0]));
+		b->tail -= b->head;
+		b->head = 0;
+	}
+	if (b->tail + count > b->size) {
+		b->size = (b->tail + count + 15) & ~15;
+		b->events = realloc(b->events, b->size * sizeof(b->events[0]));
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		if (events[i].button >= b->count) {
+			AVR_LOG(avr, LOG_WARNING, "LADDER: %s: invalid button %d\n",
+					__func__, events[i].button);
+			continue;
+		}
+		// insert sorted, after any event at the same cycle
+		uint32_t lo = 0, hi = b->tail;
+		while (lo < hi) {
+			uint32_t mid = (lo + hi) / 2;
+			if (b->events[mid].when <= events[i].when)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		memmove(b->events + lo + 1, b->events + lo,
+				(b->tail - lo) * sizeof(b->events[0]));
+		b->events[lo] = events[i];
+		b->tail++;
+	}
+	if (b->head == b->tail)
+		return;
+	avr_cycle_count_t next = b->events[b->head].when;
+	avr_cycle_timer_register(avr,
+			next > avr->cycle ? next - avr->cycle : 0,
+			button_ladder_event, b);
+}
+
+void
+button_ladder_press(
+		button_ladder_t * b,
+		uint8_t button,
+		uint32_t duration_usec)
+{
+	avr_t * avr = b->avr;
+	button_ladder_event_t e[2] = {
+		{ .when = avr->cycle, .button = button, .pressed = 1 },
+		{ .when = avr->cycle + avr_usec_to_cycles(avr, duration_usec),
+				.button = button, .pressed = 0 },
+	};
+	button_ladder_script(b, e, 2);
+}
+
+void
+button_ladder_init(
+		avr_t * avr,
+		button_ladder_t * b,
+		const char * name,
+		uint32_t vcc,
+		uint32_t pullup,
+		const uint32_t * r,
+		uint8_t count,
+		uint32_t bounce_usec)
+{
+	memset(b, 0, sizeof(*b));
+	b->irq = avr_alloc_irq(&avr->irq_pool, 0, IRQ_LADDER_COUNT, &name);
+	b->avr = avr;
+	b->vcc = vcc;
+	b->pullup = pullup;
+	b->count = count > BUTTON_LADDER_MAX ? BUTTON_LADDER_MAX : count;
+	memcpy(b->r, r, b->count * sizeof(b->r[0]));
+	b->value = b->prev = button_ladder_level(b, 0);
+
+	/*
+	 * Bounce waveform: each gap is about half the previous one, with
+	 * some jitter from a fixed seed so runs are reproducible
+	 */
+	avr_cycle_count_t total = avr_usec_to_cycles(avr, bounce_usec);
+	avr_cycle_count_t at = 0;
+	uint32_t seed = 0x2545f491;
+	for (int i = 0; i < BUTTON_LADDER_BOUNCE && total; i++) {
+		seed = seed * 1103515245 + 12345;
+		total /= 2;
+		at += total / 2 + (seed >> 16) % (total + 1);
+		b->bounce[i] = at;
+	}
+	// even number of edges, so it ends on the new value
+	b->bounce_count = total ? BUTTON_LADDER_BOUNCE & ~1 : 0;
+	if (!total && bounce_usec)
+		AVR_LOG(avr, LOG_WARNING, "LADDER: %s: bounce too short for %d edges\n",
+				__func__, BUTTON_LADDER_BOUNCE);
+
+	avr_raise_irq(b->irq + IRQ_LADDER_OUT, b->value);
+}
+
+void
+button_ladder_dispose(
+		button_ladder_t * b)
+{
+	avr_cycle_timer_cancel(b->avr, button_ladder_event, b);
+	avr_cycle_timer_cancel(b->avr, button_ladder_bounce, b);
+	free(b->events);
+	b->events = NULL;
+	b->head = b->tail = b->size = 0;
+}
@@ -0,0 +1,122 @@
+/*
+	button_ladder.h
+
+	Copyright 2016, Fernando Vicente <fvicente@gmail.com>
+
+	Several push buttons sharing one ADC input through a resistor
+	divider. The node is pulled up to VCC, each button pulls it down
+	through its own resistor, so every combination of pressed buttons
+	gives a different voltage.
+
+	Connect IRQ_LADDER_OUT to one of the ADC_IRQ_ADC* IRQs of the ADC,
+	the value is in millivolts, as the ADC expects. Like the plain
+	button, raise 'value' once connected so the ADC has the idle level.
+
+	Presses can be done "live" with button_ladder_press(), or scripted
+	in advance with button_ladder_script(); scripted events are stamped
+	in cycles and fired from a single cycle timer, so a whole user
+	session runs at full simulation speed.
+
+	Contact bounce is modelled with a waveform computed once at init
+	time, replayed on each press and release.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BUTTON_LADDER_H__
+#define __BUTTON_LADDER_H__
+
+#include "sim_irq.h"
+#include "sim_cycle_timers.h"
+
+enum {
+	IRQ_LADDER_OUT = 0,		// millivolts on the node
+	IRQ_LADDER_COUNT
+};
+
+#define BUTTON_LADDER_MAX		8
+#define BUTTON_LADDER_BOUNCE	8	// max number of bounce edges
+
+typedef struct button_ladder_event_t {
+	avr_cycle_count_t	when;		// absolute cycle
+	uint8_t				button;
+	uint8_t				pressed;
+} button_ladder_event_t;
+
+typedef struct button_ladder_t {
+	avr_irq_t * irq;	// output irq
+	struct avr_t * avr;
+
+	uint32_t	vcc;			// millivolts
+	uint32_t	pullup;			// ohms
+	uint32_t	r[BUTTON_LADDER_MAX];	// ohms, per button
+	uint8_t		count;
+
+	uint8_t		pressed;		// bitmask of buttons currently down
+	uint32_t	value;			// settled millivolts for 'pressed'
+	uint32_t	prev;			// value before the last transition
+
+	// bounce waveform: cycles since the transition for each edge
+	avr_cycle_count_t	bounce[BUTTON_LADDER_BOUNCE];
+	uint8_t		bounce_count;
+	uint8_t		bounce_step;
+	avr_cycle_count_t	bounce_start;
+
+	// pending events, sorted by 'when', consumed from 'head'
+	button_ladder_event_t * events;
+	uint32_t	head, tail, size;
+} button_ladder_t;
+
+/*
+ * 'r' holds the resistor of each of the 'count' buttons, 'bounce_usec'
+ * is how long the contacts bounce for, zero for clean edges
+ */
+void
+button_ladder_init(
+		struct avr_t * avr,
+		button_ladder_t * b,
+		const char * name,
+		uint32_t vcc,
+		uint32_t pullup,
+		const uint32_t * r,
+		uint8_t count,
+		uint32_t bounce_usec);
+
+// press 'button' now, and release it after 'duration_usec'
+void
+button_ladder_press(
+		button_ladder_t * b,
+		uint8_t button,
+		uint32_t duration_usec);
+
+// queue events, they don't need to be sorted
+void
+button_ladder_script(
+		button_ladder_t * b,
+		const button_ladder_event_t * events,
+		uint32_t count);
+
+// voltage on the node for a set of pressed buttons
+uint32_t
+button_ladder_level(
+		button_ladder_t * b,
+		uint8_t pressed);
+
+void
+button_ladder_dispose(
+		button_ladder_t * b);
+
+#endif /* __BUTTON_LADDER_H__*/
@@ -0,0 +1,262 @@
+/*
+	charlieplex.c
+
+	Copyright 2016, Fernando Vicente <fvicente@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "sim_avr.h"
+#include "sim_time.h"
+#include "avr_ioport.h"
+#include "charlieplex.h"
+
+static void
+charlieplex_set_lit(
+		charlieplex_t * p,
+		uint32_t lit)
+{
+	avr_cycle_count_t now = p->avr->cycle;
+	uint32_t changed = p->lit ^ lit;
+
+	while (changed) {
+		int i = __builtin_ctz(changed);
+		changed &= changed - 1;
+		if (p->lit & (1u << i)) {
+			p->on[i] += now - p->since[i];
+		} else {
+			if (p->seen & (1u << i)) {
+				avr_cycle_count_t gap = now - p->since[i];
+				if (!p->min_gap[i] || gap < p->min_gap[i])
+					p->min_gap[i] = gap;
+				if (gap > p->max_gap[i])
+					p->max_gap[i] = gap;
+			}
+			p->edges[i]++;
+		}
+		p->since[i] = now;
+	}
+	p->seen |= lit;
+	p->lit = lit;
+	avr_raise_irq(p->irq + IRQ_CHARLIEPLEX_LIT, lit);
+}
+
+static void
+charlieplex_update(
+		charlieplex_t * p)
+{
+	// input pins don't drive anything, even with the pullup on
+	uint32_t key = p->squash[p->ddr] |
+			(p->squash[p->port & p->ddr] << p->pin_count);
+	if (p->lut[key] != p->lit)
+		charlieplex_set_lit(p, p->lut[key]);
+}
+
+static void
+charlieplex_ddr_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	charlieplex_t * p = (charlieplex_t *)param;
+	p->ddr = value;
+	charlieplex_update(p);
+}
+
+static void
+charlieplex_port_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	charlieplex_t * p = (charlieplex_t *)param;
+	p->port = value;
+	charlieplex_update(p);
+}
+
+uint32_t
+charlieplex_get_stats(
+		charlieplex_t * p,
+		charlieplex_stats_t * stats)
+{
+	avr_t * avr = p->avr;
+	avr_cycle_count_t now = avr->cycle;
+	avr_cycle_count_t len = now - p->start;
+	avr_cycle_count_t limit = p->flicker_hz ?
+			avr->frequency / p->flicker_hz : 0;
+	uint32_t flicker = 0;
+
+	for (int i = 0; i < p->count; i++) {
+		charlieplex_stats_t * s = stats + i;
+		if (p->lit & (1u << i)) {
+			p->on[i] += now - p->since[i];
+			p->since[i] = now;
+		} else if (!p->on[i] && !p->edges[i]) {
+			/*
+			 * Dark for the whole window, it's switched off rather than
+			 * refreshed. Gaps only count when it's lit again, so the
+			 * next one starts afresh
+			 */
+			p->seen &= ~(1u << i);
+		}
+		s->on = p->on[i];
+		s->duty = len ? (float)p->on[i] / len : 0;
+		s->refresh = len ? (float)p->edges[i] * avr->frequency / len : 0;
+		s->min_gap = p->min_gap[i];
+		s->max_gap = p->max_gap[i];
+		// only LEDs being multiplexed can flicker
+		if (limit && s->on && s->on < len && s->max_gap > limit)
+			flicker |= 1u << i;
+
+		p->on[i] = p->min_gap[i] = p->max_gap[i] = 0;
+		p->edges[i] = 0;
+	}
+	p->start = now;
+	return flicker;
+}
+
+static avr_cycle_count_t
+charlieplex_window(
+		avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	charlieplex_t * p = (charlieplex_t *)param;
+
+	uint32_t flicker = charlieplex_get_stats(p, p->stats);
+	p->windows++;
+	if (flicker & ~p->flickering)
+		AVR_LOG(avr, LOG_WARNING,
+				"CHARLIEPLEX: LEDs %08x dark for more than 1/%dth of a second\n",
+				flicker & ~p->flickering, p->flicker_hz);
+	p->flickering = flicker;
+	while (flicker) {
+		int i = __builtin_ctz(flicker);
+		flicker &= flicker - 1;
+		avr_raise_irq(p->irq + IRQ_CHARLIEPLEX_FLICKER, i);
+	}
+	return when + p->window;
+}
+
+void
+charlieplex_set_window(
+		charlieplex_t * p,
+		uint32_t window_usec,
+		uint32_t flicker_hz)
+{
+	avr_cycle_timer_cancel(p->avr, charlieplex_window, p);
+	p->window = avr_usec_to_cycles(p->avr, window_usec);
+	p->flicker_hz = flicker_hz;
+	p->flickering = 0;
+	if (!p->window)
+		return;
+	charlieplex_get_stats(p, p->stats);	// start afresh
+	avr_cycle_timer_register(p->avr, p->window, charlieplex_window, p);
+}
+
+static const char * irq_names[IRQ_CHARLIEPLEX_COUNT] = {
+	[IRQ_CHARLIEPLEX_DDR_IN] = "8<charlieplex.ddr",
+	[IRQ_CHARLIEPLEX_PORT_IN] = "8<charlieplex.port",
+	[IRQ_CHARLIEPLEX_LIT] = "32>charlieplex.lit",
+	[IRQ_CHARLIEPLEX_FLICKER] = "8>charlieplex.flicker",
+};
+
+void
+charlieplex_init(
+		struct avr_t * avr,
+		charlieplex_t * p,
+		const char * name,
+		const uint8_t * pins,
+		uint8_t pin_count,
+		const charlieplex_led_t * leds,
+		uint8_t count)
+{
+	memset(p, 0, sizeof(*p));
+	p->avr = avr;
+	p->irq = avr_alloc_irq(&avr->irq_pool, 0, IRQ_CHARLIEPLEX_COUNT, irq_names);
+	avr_irq_register_notify(p->irq + IRQ_CHARLIEPLEX_DDR_IN, charlieplex_ddr_hook, p);
+	avr_irq_register_notify(p->irq + IRQ_CHARLIEPLEX_PORT_IN, charlieplex_port_hook, p);
+
+	if (pin_count > CHARLIEPLEX_MAX_PINS)
+		pin_count = CHARLIEPLEX_MAX_PINS;
+	if (count > CHARLIEPLEX_MAX_LEDS)
+		count = CHARLIEPLEX_MAX_LEDS;
+	p->pin_count = pin_count;
+	p->count = count;
+	memcpy(p->led, leds, count * sizeof(p->led[0]));
+
+	// pin number -> bit in the table index, other pins are dropped
+	int8_t index[8];
+	memset(index, -1, sizeof(index));
+	for (int i = 0; i < pin_count; i++)
+		index[pins[i] & 7] = i;
+	for (int v = 0; v < 256; v++)
+		for (int b = 0; b < 8; b++)
+			if ((v & (1u << b)) && index[b] >= 0)
+				p->squash[v] |= 1u << index[b];
+
+	/*
+	 * The table, indexed by the direction of the pins and the level
+	 * of those driven
+	 */
+	uint32_t size = 1u << (2 * pin_count);
+	p->lut = calloc(size, sizeof(p->lut[0]));
+	for (int l = 0; l < count; l++) {
+		const charlieplex_led_t * led = &p->led[l];
+		int a = led->anode == CHARLIEPLEX_VCC ? -1 : index[led->anode & 7];
+		int c = led->cathode == CHARLIEPLEX_GND ? -1 : index[led->cathode & 7];
+		if ((led->anode != CHARLIEPLEX_VCC && (led->anode > 7 || a < 0)) ||
+				(led->cathode != CHARLIEPLEX_GND && (led->cathode > 7 || c < 0))) {
+			AVR_LOG(avr, LOG_WARNING, "CHARLIEPLEX: %s: %s LED %d isn't on the pins\n",
+					__func__, name, l);
+			continue;
+		}
+		for (uint32_t key = 0; key < size; key++) {
+			uint32_t ddr = key & ((1u << pin_count) - 1);
+			uint32_t port = key >> pin_count;
+			if (a >= 0 && !((ddr & port) & (1u << a)))
+				continue;
+			if (c >= 0 && !((ddr & ~port) & (1u << c)))
+				continue;
+			p->lut[key] |= 1u << l;
+		}
+	}
+}
+
+void
+charlieplex_connect(
+		charlieplex_t * p,
+		char port)
+{
+	avr_connect_irq(
+		avr_io_getirq(p->avr, AVR_IOCTL_IOPORT_GETIRQ(port), IOPORT_IRQ_DIRECTION_ALL),
+		p->irq + IRQ_CHARLIEPLEX_DDR_IN);
+	avr_connect_irq(
+		avr_io_getirq(p->avr, AVR_IOCTL_IOPORT_GETIRQ(port), IOPORT_IRQ_REG_PORT),
+		p->irq + IRQ_CHARLIEPLEX_PORT_IN);
+}
+
+void
+charlieplex_dispose(
+		charlieplex_t * p)
+{
+	avr_cycle_timer_cancel(p->avr, charlieplex_window, p);
+	free(p->lut);
+	p->lut = NULL;
+}
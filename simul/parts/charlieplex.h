@@ -0,0 +1,148 @@
+/*
+	charlieplex.h
+
+	Copyright 2016, Fernando Vicente <fvicente@gmail.com>
+
+	LEDs charlieplexed on a few tri-state pins of one port. Each LED
+	has an anode and a cathode pin, it is lit when the anode is an
+	output driven high and the cathode an output driven low. Either
+	side can also be tied to VCC or GND, for a LED driven by one pin.
+
+	The lit set is looked up from the (DDR, PORT) state of the pins in
+	a table built at init time, and the time each LED is on is
+	accumulated in cycles. Over a window, the part gives per LED the
+	duty cycle, how many times a second it is lit and the shortest and
+	longest dark gaps; when a LED that is being multiplexed stays dark
+	longer than a period of 'flicker_hz', IRQ_CHARLIEPLEX_FLICKER is
+	raised with its number. A gap counts once the LED is lit again, and
+	a LED dark for a whole window is switched off, not refreshed.
+
+	Connect with charlieplex_connect(), or feed the port direction and
+	output to IRQ_CHARLIEPLEX_DDR_IN and IRQ_CHARLIEPLEX_PORT_IN.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CHARLIEPLEX_H__
+#define __CHARLIEPLEX_H__
+
+#include "sim_irq.h"
+#include "sim_cycle_timers.h"
+
+enum {
+	IRQ_CHARLIEPLEX_DDR_IN = 0,	// 8 bits, port direction
+	IRQ_CHARLIEPLEX_PORT_IN,	// 8 bits, port output
+	IRQ_CHARLIEPLEX_LIT,		// 32 bits, mask of the LEDs lit now
+	IRQ_CHARLIEPLEX_FLICKER,	// number of a LED flickering in a window
+	IRQ_CHARLIEPLEX_COUNT
+};
+
+#define CHARLIEPLEX_MAX_PINS	8
+#define CHARLIEPLEX_MAX_LEDS	32
+
+// pseudo pins for LEDs with only one side on the port
+#define CHARLIEPLEX_VCC		0xfe
+#define CHARLIEPLEX_GND		0xff
+
+typedef struct charlieplex_led_t {
+	uint8_t anode, cathode;		// port pin number, or VCC/GND
+} charlieplex_led_t;
+
+typedef struct charlieplex_stats_t {
+	float		duty;			// fraction of the window lit
+	float		refresh;		// times lit per second
+	avr_cycle_count_t	on;			// cycles lit
+	avr_cycle_count_t	min_gap;	// shortest dark gap, cycles
+	avr_cycle_count_t	max_gap;	// longest dark gap, cycles
+} charlieplex_stats_t;
+
+typedef struct charlieplex_t {
+	avr_irq_t * irq;
+	struct avr_t * avr;
+
+	uint8_t		pin_count;
+	uint8_t		count;				// LEDs
+	charlieplex_led_t	led[CHARLIEPLEX_MAX_LEDS];
+	uint8_t		squash[256];		// port bits -> pin_count bits
+	uint32_t *	lut;				// (ddr, port) of the pins -> lit mask
+
+	uint8_t		ddr, port;
+	uint32_t	lit;
+	uint32_t	seen;				// LEDs lit at least once, gaps are valid
+
+	// current window
+	avr_cycle_count_t	start;
+	avr_cycle_count_t	since[CHARLIEPLEX_MAX_LEDS];	// last change
+	avr_cycle_count_t	on[CHARLIEPLEX_MAX_LEDS];
+	avr_cycle_count_t	min_gap[CHARLIEPLEX_MAX_LEDS];
+	avr_cycle_count_t	max_gap[CHARLIEPLEX_MAX_LEDS];
+	uint32_t	edges[CHARLIEPLEX_MAX_LEDS];
+
+	// periodic windows, see charlieplex_set_window()
+	avr_cycle_count_t	window;
+	uint32_t	flicker_hz;
+	uint32_t	flickering;			// LEDs flickering in the last window
+	uint32_t	windows;			// windows completed
+	charlieplex_stats_t	stats[CHARLIEPLEX_MAX_LEDS];	// the last one
+} charlieplex_t;
+
+/*
+ * 'pins' are the port pins used, 'leds' refer to them by port pin
+ * number (or VCC/GND)
+ */
+void
+charlieplex_init(
+		struct avr_t * avr,
+		charlieplex_t * p,
+		const char * name,
+		const uint8_t * pins,
+		uint8_t pin_count,
+		const charlieplex_led_t * leds,
+		uint8_t count);
+
+/*
+ * Connect to the DDR and PORT registers of 'port'. The registers rather
+ * than the pin IRQs, so a write never shows a half updated state
+ */
+void
+charlieplex_connect(
+		charlieplex_t * p,
+		char port);
+
+/*
+ * Close a window every 'window_usec', its results go in p->stats and
+ * the flicker check is done against 'flicker_hz'. Zero stops it.
+ */
+void
+charlieplex_set_window(
+		charlieplex_t * p,
+		uint32_t window_usec,
+		uint32_t flicker_hz);
+
+/*
+ * Close the current window now, 'stats' gets one entry per LED;
+ * returns a mask of the LEDs that flickered in it.
+ */
+uint32_t
+charlieplex_get_stats(
+		charlieplex_t * p,
+		charlieplex_stats_t * stats);
+
+void
+charlieplex_dispose(
+		charlieplex_t * p);
+
+#endif /* __CHARLIEPLEX_H__*/
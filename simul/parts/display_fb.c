@@ -0,0 +1,81 @@
+/*
+	display_fb.c
+
+	Copyright 2016, Fernando Vicente <fvicente@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "display_fb.h"
+
+uint32_t
+display_fb_size(
+		display_fb_t * fb)
+{
+	fb->stride = fb->bpp == 1 ? (fb->w + 7) / 8 : fb->w;
+	return fb->stride * fb->h;
+}
+
+int
+display_fb_add_rect(
+		display_rect_t * rects,
+		int count,
+		int max,
+		display_rect_t r)
+{
+	if (!r.w || !r.h || !max)
+		return count;
+	if (count < max) {
+		rects[count] = r;
+		return count + 1;
+	}
+	display_rect_t * l = &rects[max - 1];
+	uint16_t x2 = l->x + l->w > r.x + r.w ? l->x + l->w : r.x + r.w;
+	uint16_t y2 = l->y + l->h > r.y + r.h ? l->y + l->h : r.y + r.h;
+	if (r.x < l->x)
+		l->x = r.x;
+	if (r.y < l->y)
+		l->y = r.y;
+	l->w = x2 - l->x;
+	l->h = y2 - l->y;
+	return count;
+}
+
+int
+display_fb_write_pgm(
+		const display_fb_t * fb,
+		const char * filename)
+{
+	FILE * f = fopen(filename, "wb");
+	if (!f)
+		return -1;
+	fprintf(f, "P5\n%d %d\n255\n", fb->w, fb->h);
+	uint8_t * line = malloc(fb->w);
+	for (int y = 0; y < fb->h; y++) {
+		const uint8_t * src = fb->pixels + y * fb->stride;
+		if (fb->bpp == 1) {
+			for (int x = 0; x < fb->w; x++)
+				line[x] = (src[x >> 3] & (0x80 >> (x & 7))) ? 255 : 0;
+		} else
+			for (int x = 0; x < fb->w; x++)
+				line[x] = src[x];
+		fwrite(line, 1, fb->w, f);
+	}
+	free(line);
+	return fclose(f);
+}
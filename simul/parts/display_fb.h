@@ -0,0 +1,73 @@
+/*
+	display_fb.h
+
+	Copyright 2016, Fernando Vicente <fvicente@gmail.com>
+
+	Renderer independent view of what a display part shows: a frame
+	buffer the part fills in on demand, and the rectangles that changed
+	since it was last asked, so a GUI can redraw just those, and a test
+	can look at the screen without any GL around.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DISPLAY_FB_H__
+#define __DISPLAY_FB_H__
+
+#include <stdint.h>
+
+typedef struct display_rect_t {
+	uint16_t	x, y, w, h;
+} display_rect_t;
+
+/*
+ * 'bpp' is 1, bits packed msb first, set when lit; or 8, one grey level
+ * per byte. The caller provides 'pixels', 'stride' * 'h' bytes; the
+ * display_fb_size() helper tells how much that is.
+ */
+typedef struct display_fb_t {
+	uint16_t	w, h;
+	uint8_t		bpp;
+	uint32_t	stride;		// bytes per line
+	uint8_t *	pixels;
+} display_fb_t;
+
+// sets 'stride' for 'w' and 'bpp', and returns the size of 'pixels'
+uint32_t
+display_fb_size(
+		display_fb_t * fb);
+
+/*
+ * Appends 'r' to 'rects', holding 'count' of at most 'max'. When full,
+ * the last one grows to cover 'r' too. Returns the new count.
+ */
+int
+display_fb_add_rect(
+		display_rect_t * rects,
+		int count,
+		int max,
+		display_rect_t r);
+
+/*
+ * Writes the frame as a binary PGM (P5), a 1 bpp frame as 0/255.
+ * Returns 0, or -1 with errno set.
+ */
+int
+display_fb_write_pgm(
+		const display_fb_t * fb,
+		const char * filename);
+
+#endif /* __DISPLAY_FB_H__ */
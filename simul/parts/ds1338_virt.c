@@ -27,6 +27,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <sys/time.h>
 
 #include "avr_twi.h"
 #include "ds1338_virt.h"
@@ -81,9 +83,9 @@ ds1338_virt_update(const ds1338_virt_t * const p)
 static uint8_t
 ds1338_virt_days_in_month(uint8_t month, uint16_t year) {
 
-	uint8_t is_leap_year = 1;
+	uint8_t is_leap_year = 0;
 	if ((year & 3) == 0 && ((year % 25) != 0 || (year & 15) == 0))
-		is_leap_year = 0;
+		is_leap_year = 1;
 
 	uint8_t days;
 	if (month == 2)
@@ -95,148 +97,101 @@ ds1338_virt_days_in_month(uint8_t month, uint16_t year) {
 }
 
 /*
- * Ticks a BCD register according to the specified constraints.
+ * Moves the time registers 'secs' seconds forward, in one go rather
+ * than a second at a time. See table 3, p10 of the DS1338 datasheet.
  */
-static uint8_t
-ds1338_virt_tick_bcd_reg(bcd_reg_t * bcd_reg)
+static void
+ds1338_virt_advance(ds1338_virt_t *p, uint64_t secs)
 {
-	// Unpack BCD
-	uint8_t x = (*bcd_reg->reg & 0x0F) +
-			10*((*bcd_reg->reg & bcd_reg->tens_mask) >> 4);
-
-	// Tick
-	uint8_t cascade = 0;
-	if (++x > bcd_reg->max_val) {
-		x = bcd_reg->min_val;
-		cascade = 1;
-	}
-
-	// Set the BCD part of the register
-	*bcd_reg->reg &= ~(0x0F | bcd_reg->tens_mask);
-	*bcd_reg->reg |= (x / 10 << 4) + x % 10;
+	uint8_t * r = p->nvram;
+	uint8_t h12 = ds1338_get_flag(r[DS1338_VIRT_HOURS], DS1338_VIRT_12_24_HR);
 
-	return cascade;
-}
-
-/*
- * Ticks the time registers. See table 3, p10 of the DS1338 datasheet.
- */
-static void
-ds1338_virt_tick_time(ds1338_virt_t *p) {
+	uint32_t hours;
+	if (h12)
+		hours = UNPACK_BCD(r[DS1338_VIRT_HOURS] & 0b00011111) % 12 +
+			(ds1338_get_flag(r[DS1338_VIRT_HOURS], DS1338_VIRT_AM_PM) ? 12 : 0);
+	else
+		hours = UNPACK_BCD(r[DS1338_VIRT_HOURS] & 0b00111111);
+	uint64_t t = secs + UNPACK_BCD(r[DS1338_VIRT_SECONDS] & 0b01111111) +
+			UNPACK_BCD(r[DS1338_VIRT_MINUTES] & 0b01111111) * 60 +
+			hours * 3600;
+	uint64_t days = t / 86400;
+	t %= 86400;
 
 	/*
-	 * Seconds
+	 * Time of day
 	 */
-	bcd_reg_t reg = {
-		.reg = &p->nvram[DS1338_VIRT_SECONDS],
-		.min_val = 0,
-		.max_val = 59,
-		.tens_mask = 0b01110000
-	};
-	uint8_t cascade = ds1338_virt_tick_bcd_reg(&reg);
-	if (!cascade)
+	hours = t / 3600;
+	r[DS1338_VIRT_SECONDS] = (r[DS1338_VIRT_SECONDS] & (1 << DS1338_VIRT_CH)) |
+			PACK_BCD(t % 60);
+	r[DS1338_VIRT_MINUTES] = PACK_BCD(t / 60 % 60);
+	if (h12)
+		r[DS1338_VIRT_HOURS] = (1 << DS1338_VIRT_12_24_HR) |
+				(hours >= 12 ? (1 << DS1338_VIRT_AM_PM) : 0) |
+				PACK_BCD(hours % 12 ? hours % 12 : 12);
+	else
+		r[DS1338_VIRT_HOURS] = PACK_BCD(hours);
+	if (!days)
 		return;
 
 	/*
-	 * Minutes
+	 * Day, strangely it runs from 1-7
 	 */
-	reg.reg = &p->nvram[DS1338_VIRT_MINUTES];
-	cascade = ds1338_virt_tick_bcd_reg(&reg);
-	if (!cascade)
-		return;
+	uint8_t day = r[DS1338_VIRT_DAY] & 0b00000111;
+	if (day < 1)
+		day = 1;
+	r[DS1338_VIRT_DAY] = (day - 1 + days % 7) % 7 + 1;
 
 	/*
-	 * Hours
+	 * Date, month and year, a month at a time. Insert a y2.1k bug like
+	 * they do in the original part
 	 */
-	reg.reg = &p->nvram[DS1338_VIRT_HOURS];
-	if (ds1338_get_flag(p->nvram[DS1338_VIRT_HOURS], DS1338_VIRT_12_24_HR)) {
-		// 12 hour mode
-		reg.min_val = 1;
-		reg.max_val = 12;
-		reg.tens_mask = 0b00010000;
-		uint8_t pm = ds1338_get_flag(p->nvram[DS1338_VIRT_HOURS], DS1338_VIRT_AM_PM);
-		cascade = ds1338_virt_tick_bcd_reg(&reg);
-		if (cascade) {
-			if (pm) {
-				// Switch to AM
-				p->nvram[DS1338_VIRT_HOURS] &= !(1 << DS1338_VIRT_AM_PM);
-			} else {
-				// Switch to PM and catch the cascade
-				p->nvram[DS1338_VIRT_HOURS] |= (1 << DS1338_VIRT_AM_PM);
-				cascade = 0;
-			}
+	uint8_t date = UNPACK_BCD(r[DS1338_VIRT_DATE] & 0b00111111);
+	uint8_t month = UNPACK_BCD(r[DS1338_VIRT_MONTH] & 0b00011111);
+	uint8_t year = UNPACK_BCD(r[DS1338_VIRT_YEAR]);
+	if (month < 1 || month > 12)
+		month = 1;
+	if (date < 1)
+		date = 1;
+	while (days) {
+		uint8_t dim = ds1338_virt_days_in_month(month, 2000 + year);
+		if (date > dim)
+			date = dim;
+		if (date + days <= dim) {
+			date += days;
+			break;
+		}
+		days -= dim - date + 1;
+		date = 1;
+		if (++month > 12) {
+			month = 1;
+			year = (year + 1) % 100;
 		}
-	} else {
-		// 24 hour mode
-		reg.min_val = 0;
-		reg.max_val = 23;
-		reg.tens_mask = 0b00110000;
-		cascade = ds1338_virt_tick_bcd_reg(&reg);
 	}
-	if (!cascade)
-		return;
-
-	/*
-	 * Day
-	 */
-	reg.reg = &p->nvram[DS1338_VIRT_DAY];
-	reg.min_val = 1;
-	reg.max_val = 7;
-	reg.tens_mask = 0;
-	ds1338_virt_tick_bcd_reg(&reg);
-
-	/*
-	 * Date
-	 */
-	reg.reg = &p->nvram[DS1338_VIRT_DATE];
-	// Insert a y2.1k bug like they do in the original part
-	uint16_t year = 2000 + UNPACK_BCD(p->nvram[DS1338_VIRT_YEAR]);
-	reg.max_val = ds1338_virt_days_in_month(
-	               UNPACK_BCD(p->nvram[DS1338_VIRT_MONTH]),
-	               year);
-	reg.tens_mask = 0b00110000;
-	cascade = ds1338_virt_tick_bcd_reg(&reg);
-	if (!cascade)
-		return;
-
-	/*
-	 * Month
-	 */
-	reg.reg = &p->nvram[DS1338_VIRT_MONTH];
-	reg.max_val = 12;
-	reg.tens_mask = 0b00010000;
-	cascade = ds1338_virt_tick_bcd_reg(&reg);
-	if (!cascade)
-		return;
-
-	/*
-	 * Year
-	 */
-	reg.reg = &p->nvram[DS1338_VIRT_YEAR];
-	reg.min_val = 0;
-	reg.max_val = 99;
-	reg.tens_mask = 0b11110000;
-	cascade = ds1338_virt_tick_bcd_reg(&reg);
+	r[DS1338_VIRT_DATE] = PACK_BCD(date);
+	r[DS1338_VIRT_MONTH] = PACK_BCD(month);
+	r[DS1338_VIRT_YEAR] = PACK_BCD(year);
 }
 
-static void
-ds1338_virt_cycle_square_wave(ds1338_virt_t *p)
+/*
+ * The crystal, in 32768Hz ticks, either from the AVR cycle counter or
+ * from the host clock
+ */
+static uint64_t
+ds1338_virt_ticks(ds1338_virt_t *p)
 {
-	if(!ds1338_get_flag(p->nvram[DS1338_VIRT_CONTROL], DS1338_VIRT_SQWE)) {
-		printf("DS1338: SQWE disabled");
-		// Square wave output disabled
-		return;
-	}
-
-	p->square_wave = !p->square_wave;
-
-	if (p->square_wave) {
-		avr_raise_irq(p->irq + DS1338_SQW_IRQ_OUT, 1);
-		//printf ("Tick\n");
-	} else {
-		avr_raise_irq(p->irq + DS1338_SQW_IRQ_OUT, 0);
-		//printf ("Tock\n");
+	if (p->time_mode == DS1338_VIRT_TIME_HOST) {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return (uint64_t)tv.tv_sec * DS1338_CLK_FREQ +
+				(uint64_t)tv.tv_usec * DS1338_CLK_FREQ / 1000000;
 	}
+	avr_cycle_count_t c = p->avr->cycle;
+	uint32_t f = p->avr->frequency;
+	if (!f)
+		return 0;
+	// split, so a long run doesn't overflow
+	return (c / f) * DS1338_CLK_FREQ + (c % f) * DS1338_CLK_FREQ / f;
 }
 
 /*
@@ -278,83 +233,193 @@ ds1338_print_time(ds1338_virt_t *p)
 		        hours, minutes, seconds, day, date, month, year, pm);
 }
 
+/*
+ * Bring the time registers up to date. Nothing runs while the clock
+ * ticks, the time elapsed since the last sync is added here, when the
+ * registers are about to be read or written
+ */
+static void
+ds1338_virt_sync(ds1338_virt_t *p)
+{
+	uint64_t now = ds1338_virt_ticks(p);
+	uint64_t elapsed = now - p->last;
+	p->last = now;
+
+	// Oscillator is disabled
+	if (ds1338_get_flag(p->nvram[DS1338_VIRT_SECONDS], DS1338_VIRT_CH))
+		return;
+
+	elapsed += p->rtc;
+	p->rtc = elapsed % DS1338_CLK_FREQ;
+	if (elapsed < DS1338_CLK_FREQ)
+		return;
+	ds1338_virt_advance(p, elapsed / DS1338_CLK_FREQ);
+	if (p->verbose)
+		ds1338_print_time(p);
+}
+
+/*
+ * Square wave output. The edges are only generated while the IRQ has
+ * someone listening, the oscillator runs and SQWE is set; they are
+ * placed from 'sqw_start' so the rate doesn't drift with rounding
+ */
 static avr_cycle_count_t
-ds1338_virt_clock_tick(struct avr_t * avr,
-                       avr_cycle_count_t when,
-                       ds1338_virt_t *p)
+ds1338_virt_square_wave_tick(struct avr_t * avr,
+                             avr_cycle_count_t when,
+                             void * param)
 {
-	avr_cycle_count_t next_tick = when + avr_usec_to_cycles(avr, DS1338_CLK_PERIOD_US / 2);
+	ds1338_virt_t * p = (ds1338_virt_t *)param;
 
-	if (!ds1338_get_flag(p->nvram[DS1338_VIRT_SECONDS], DS1338_VIRT_CH)) {
-		// Oscillator is enabled. Note that this counter is allowed to wrap.
-		p->rtc++;
-	} else {
-		// Avoid a condition match below with the clock switched off
-		return next_tick;
-	}
+	p->square_wave = !p->square_wave;
+	avr_raise_irq(p->irq + DS1338_SQW_IRQ_OUT, p->square_wave);
 
-	/*
-	 * Update the time
-	 */
-	if (p->rtc == 0) {
-		// 1 second has passed
-		ds1338_virt_tick_time(p);
-                if (p->verbose)
-			ds1338_print_time(p);
-	}
+	p->sqw_edges++;
+	return p->sqw_start + p->sqw_edges * avr->frequency / p->sqw_rate;
+}
 
-	/*
-	 * Deal with the square wave output
-	 */
-	uint8_t prescaler_mode = ds1338_get_flag(p->nvram[DS1338_VIRT_CONTROL],
-	                                         DS1338_VIRT_RS0)
-	                      + (ds1338_get_flag(p->nvram[DS1338_VIRT_CONTROL],
-	                                         DS1338_VIRT_RS1) << 1);
+static void
+ds1338_virt_square_wave_update(ds1338_virt_t *p)
+{
+	static const uint16_t hz[] = {
+		[DS1338_VIRT_PRESCALER_DIV_32768] = 1,
+		[DS1338_VIRT_PRESCALER_DIV_8] = DS1338_CLK_FREQ / 8,
+		[DS1338_VIRT_PRESCALER_DIV_4] = DS1338_CLK_FREQ / 4,
+		[DS1338_VIRT_PRESCALER_OFF] = DS1338_CLK_FREQ,
+	};
+	avr_t * avr = p->avr;
+	uint8_t control = p->nvram[DS1338_VIRT_CONTROL];
 
-	switch (prescaler_mode)
-	{
-		case DS1338_VIRT_PRESCALER_DIV_32768:
-			if ((p->rtc + 1) % DS1338_CLK_FREQ == 0) {
-				ds1338_virt_cycle_square_wave(p);
-			}
-			break;
-		case DS1338_VIRT_PRESCALER_DIV_8:
-			if ((p->rtc + 1) % (DS1338_CLK_FREQ / 8) == 0)
-				ds1338_virt_cycle_square_wave(p);
-			break;
-		case DS1338_VIRT_PRESCALER_DIV_4:
-			if ((p->rtc + 1) % (DS1338_CLK_FREQ / 4) == 0)
-				ds1338_virt_cycle_square_wave(p);
-			break;
-		case DS1338_VIRT_PRESCALER_OFF:
-			ds1338_virt_cycle_square_wave(p);
-			break;
-		default:
-			printf("DS1338 ERROR: PRESCALER MODE INVALID\n");
-			break;
+	avr_cycle_timer_cancel(avr, ds1338_virt_square_wave_tick, p);
+	if (!avr->frequency)
+		return;
+
+	if (!ds1338_get_flag(control, DS1338_VIRT_SQWE)) {
+		// Square wave output disabled, the pin follows OUT
+		p->square_wave = ds1338_get_flag(control, DS1338_VIRT_OUT);
+		avr_raise_irq(p->irq + DS1338_SQW_IRQ_OUT, p->square_wave);
+		return;
 	}
+	if (!p->irq[DS1338_SQW_IRQ_OUT].hook ||
+			ds1338_get_flag(p->nvram[DS1338_VIRT_SECONDS], DS1338_VIRT_CH))
+		return;
+
+	uint8_t prescaler_mode = ds1338_get_flag(control, DS1338_VIRT_RS0)
+	                      + (ds1338_get_flag(control, DS1338_VIRT_RS1) << 1);
+	// two edges per period
+	p->sqw_rate = hz[prescaler_mode] * 2;
+	p->sqw_start = avr->cycle;
+	p->sqw_edges = 1;
+	avr_cycle_timer_register(avr, avr->frequency / p->sqw_rate,
+			ds1338_virt_square_wave_tick, p);
+}
+
+void
+ds1338_virt_set_time_mode(ds1338_virt_t * p,
+                          uint8_t mode)
+{
+	ds1338_virt_sync(p);
+	p->time_mode = mode;
+	p->last = ds1338_virt_ticks(p);
+	if (mode != DS1338_VIRT_TIME_HOST)
+		return;
 
-	return next_tick;
+	// Start from the host local time, the firmware can set it differently
+	time_t now = p->last / DS1338_CLK_FREQ;
+	struct tm * tm = localtime(&now);
+	uint8_t * r = p->nvram;
+	p->rtc = p->last % DS1338_CLK_FREQ;
+	r[DS1338_VIRT_SECONDS] = PACK_BCD(tm->tm_sec > 59 ? 59 : tm->tm_sec);
+	r[DS1338_VIRT_MINUTES] = PACK_BCD(tm->tm_min);
+	if (ds1338_get_flag(r[DS1338_VIRT_HOURS], DS1338_VIRT_12_24_HR))
+		r[DS1338_VIRT_HOURS] = (1 << DS1338_VIRT_12_24_HR) |
+				(tm->tm_hour >= 12 ? (1 << DS1338_VIRT_AM_PM) : 0) |
+				PACK_BCD(tm->tm_hour % 12 ? tm->tm_hour % 12 : 12);
+	else
+		r[DS1338_VIRT_HOURS] = PACK_BCD(tm->tm_hour);
+	r[DS1338_VIRT_DAY] = tm->tm_wday + 1;
+	r[DS1338_VIRT_DATE] = PACK_BCD(tm->tm_mday);
+	r[DS1338_VIRT_MONTH] = PACK_BCD(tm->tm_mon + 1);
+	r[DS1338_VIRT_YEAR] = PACK_BCD(tm->tm_year % 100);
+	ds1338_virt_square_wave_update(p);
 }
 
+/*
+ * A byte written by the master; the first one selects the register
+ * (see p13. DS1388 datasheet for details), the others are written there
+ */
 static void
-ds1338_virt_clock_xtal_init(struct avr_t * avr,
-                            ds1338_virt_t *p)
+ds1338_virt_write_byte(ds1338_virt_t * p,
+                       uint8_t data)
+{
+	if (p->reg_selected) {
+		if (p->verbose)
+			printf("DS1338 set register 0x%02x to 0x%02x\n",
+				p->reg_addr, data);
+		if (p->reg_addr <= DS1338_VIRT_CONTROL)
+			ds1338_virt_sync(p);
+		p->nvram[p->reg_addr] = data;
+		ds1338_virt_update(p);
+		switch (p->reg_addr) {
+			case DS1338_VIRT_SECONDS:
+				// Writing the seconds resets the countdown chain
+				p->rtc = 0;
+				ds1338_virt_square_wave_update(p);
+				break;
+			case DS1338_VIRT_CONTROL:
+				ds1338_virt_square_wave_update(p);
+				break;
+		}
+		ds1338_virt_incr_addr(p);
+	// No register selected so select one
+	} else {
+		if (p->verbose)
+			printf("DS1338 select register 0x%02x\n", data);
+		p->reg_selected = 1;
+		p->reg_addr = data;
+	}
+}
+
+static uint8_t
+ds1338_virt_read_byte(ds1338_virt_t * p)
 {
-	p->rtc = 0;
+	if (p->verbose)
+		printf("DS1338 READ data at 0x%02x: 0x%02x\n",
+			p->reg_addr, p->nvram[p->reg_addr]);
+	uint8_t data = p->nvram[p->reg_addr];
+	ds1338_virt_incr_addr(p);
+	return data;
+}
 
-	/*
-	 * Set a timer for half the clock period to allow reconstruction
-	 * of the square wave output at the maximum possible frequency.
-	 */
-	avr_cycle_timer_register_usec(avr,
-	                              DS1338_CLK_PERIOD_US / 2,
-	                              (void *) ds1338_virt_clock_tick,
-	                              p);
-
-	printf("DS1338 clock crystal period %duS or %d cycles\n",
-			DS1338_CLK_PERIOD_US,
-			(int)avr_usec_to_cycles(avr, DS1338_CLK_PERIOD_US));
+/*
+ * Transaction level handlers, see AVR_IOCTL_TWI_ADD_SLAVE
+ */
+static int
+ds1338_virt_fast_write(void * param,
+                       uint8_t addr,
+                       const uint8_t * buf,
+                       int n)
+{
+	ds1338_virt_t * p = (ds1338_virt_t*)param;
+
+	p->reg_selected = 0;
+	for (int i = 0; i < n; i++)
+		ds1338_virt_write_byte(p, buf[i]);
+	p->reg_selected = 0;
+	return n;
+}
+
+static int
+ds1338_virt_fast_read(void * param,
+                      uint8_t addr,
+                      uint8_t * buf,
+                      int n)
+{
+	ds1338_virt_t * p = (ds1338_virt_t*)param;
+
+	ds1338_virt_sync(p);
+	for (int i = 0; i < n; i++)
+		buf[i] = ds1338_virt_read_byte(p);
+	return n;
 }
 
 /*
@@ -399,6 +464,8 @@ ds1338_virt_in_hook(struct avr_irq_t * irq,
 			if (p->verbose)
 				printf("DS1338 start\n");
 			p->selected = v.u.twi.addr;
+			// the time is latched at the start of the transfer
+			ds1338_virt_sync(p);
 			avr_raise_irq(p->irq + TWI_IRQ_INPUT,
 					avr_twi_irq_msg(TWI_COND_ACK, p->selected, 1));
 		}
@@ -414,29 +481,11 @@ ds1338_virt_in_hook(struct avr_irq_t * irq,
 			// ACK the byte
 			avr_raise_irq(p->irq + TWI_IRQ_INPUT,
 					avr_twi_irq_msg(TWI_COND_ACK, p->selected, 1));
-			// Write to the selected register (see p13. DS1388 datasheet for details)
-			if (p->reg_selected) {
-				if (p->verbose)
-					printf("DS1338 set register 0x%02x to 0x%02x\n", 
-						p->reg_addr, v.u.twi.data);
-				p->nvram[p->reg_addr] = v.u.twi.data;
-				ds1338_virt_update(p);
-				ds1338_virt_incr_addr(p);
-			// No register selected so select one
-			} else {
-				if (p->verbose)
-					printf("DS1338 select register 0x%02x\n",  v.u.twi.data);
-				p->reg_selected = 1;
-				p->reg_addr = v.u.twi.data;
-			}
+			ds1338_virt_write_byte(p, v.u.twi.data);
 		}
 		// Read transaction
 		if (v.u.twi.msg & TWI_COND_READ) {
-			if (p->verbose)
-				printf("DS1338 READ data at 0x%02x: 0x%02x\n",
-					p->reg_addr, p->nvram[p->reg_addr]);
-			uint8_t data = p->nvram[p->reg_addr];
-			ds1338_virt_incr_addr(p);
+			uint8_t data = ds1338_virt_read_byte(p);
 			avr_raise_irq(p->irq + TWI_IRQ_INPUT,
 					avr_twi_irq_msg(TWI_COND_READ, p->selected, data));
 		}
@@ -469,7 +518,7 @@ ds1338_virt_init(struct avr_t * avr,
 	// Start with the oscillator disabled, at least until there is some "battery backup"
 	p->nvram[DS1338_VIRT_SECONDS] |=  (1 << DS1338_VIRT_CH);
 
-	ds1338_virt_clock_xtal_init(avr, p);
+	p->last = ds1338_virt_ticks(p);
 }
 
 /*
@@ -487,6 +536,24 @@ ds1338_virt_attach_twi(ds1338_virt_t * p,
 		p->irq + TWI_IRQ_OUTPUT);
 }
 
+/*
+ * Same, as a transaction level slave, see AVR_IOCTL_TWI_ADD_SLAVE.
+ */
+void
+ds1338_virt_attach_twi_fast(ds1338_virt_t * p,
+                            uint32_t i2c_irq_base)
+{
+	avr_twi_slave_t slave = {
+		.addr = DS1338_VIRT_TWI_ADDR,
+		.mask = 1,	// ignore the read write bit
+		.param = p,
+		.write = ds1338_virt_fast_write,
+		.read = ds1338_virt_fast_read,
+	};
+	// the TWI name is the last byte of its ioctls
+	avr_ioctl(p->avr, AVR_IOCTL_TWI_ADD_SLAVE(i2c_irq_base & 0xff), &slave);
+}
+
 /*
  * Optionally "connect" the square wave out IRQ to the AVR.
  */
@@ -497,5 +564,6 @@ ds1338_virt_attach_square_wave_output(ds1338_virt_t * p,
 	avr_connect_irq(
 		p->irq + DS1338_SQW_IRQ_OUT,
 	        avr_io_getirq(p->avr, AVR_IOCTL_IOPORT_GETIRQ(wiring->port), wiring->pin));
+	ds1338_virt_square_wave_update(p);
 }
 
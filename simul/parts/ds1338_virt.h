@@ -28,10 +28,16 @@
  *
  *  Features:
  *
- *  > External oscillator is synced to the AVR core
+ *  > External oscillator is synced to the AVR core, or to the host
+ *    clock, see ds1338_virt_set_time_mode()
  *  > Square wave output with scalable frequency
  *  > Leap year correction until 2100
  *
+ *  The time registers are not ticked every second, they are computed
+ *  from the elapsed time when the AVR reads or writes them, so long
+ *  runs cost nothing. The square wave output only runs a timer when
+ *  its IRQ is connected to something.
+ *
  *  Should also work for the pin compatible DS1307 device.
  */
 
@@ -107,6 +113,7 @@
 
 // Generic unpack of 8bit BCD register. Don't use on seconds or hours.
 #define UNPACK_BCD(x) (((x) & 0x0F) + ((x) >> 4) * 10)
+#define PACK_BCD(x) ((((x) / 10) << 4) | ((x) % 10))
 
 enum {
 	DS1338_TWI_IRQ_OUTPUT = 0,
@@ -125,6 +132,17 @@ enum {
 	DS1338_VIRT_PRESCALER_OFF,
 };
 
+/*
+ * Where the time comes from: the simulated time is derived from the AVR
+ * cycle counter, and runs as fast as the simulation does. The host time
+ * follows the host clock, starting from the host's local time, the
+ * firmware setting the clock then keeps its offset.
+ */
+enum {
+	DS1338_VIRT_TIME_SIMULATED = 0,
+	DS1338_VIRT_TIME_HOST,
+};
+
 /*
  * Describes the behaviour of the specified BCD register.
  *
@@ -156,8 +174,13 @@ typedef struct ds1338_virt_t {
 	uint8_t reg_selected;		// register selected for write
 	uint8_t reg_addr;		// register pointer
 	uint8_t nvram[64];		// battery backed up NVRAM
-	uint16_t rtc;			// RTC counter
+	uint16_t rtc;			// crystal ticks in the current second
+	uint64_t last;			// crystal ticks at the last sync
+	uint8_t time_mode;		// DS1338_VIRT_TIME_*
 	uint8_t square_wave;
+	uint32_t sqw_rate;		// square wave edges per second
+	uint64_t sqw_edges;		// edges since sqw_start
+	avr_cycle_count_t sqw_start;
 } ds1338_virt_t;
 
 void
@@ -172,10 +195,26 @@ void
 ds1338_virt_attach_twi(ds1338_virt_t * p,
                        uint32_t i2c_irq_base);
 
+/*
+ * Same, but with whole transfers handed over by the TWI rather than
+ * going through the IRQs for every phase
+ */
+void
+ds1338_virt_attach_twi_fast(ds1338_virt_t * p,
+                            uint32_t i2c_irq_base);
+
 void
 ds1338_virt_attach_square_wave_output(ds1338_virt_t * p,
                                       ds1338_pin_t * wiring);
 
+/*
+ * Switch between DS1338_VIRT_TIME_SIMULATED (the default) and
+ * DS1338_VIRT_TIME_HOST, the time already elapsed is kept.
+ */
+void
+ds1338_virt_set_time_mode(ds1338_virt_t * p,
+                          uint8_t mode);
+
 static inline int
 ds1338_get_flag(uint8_t reg, uint8_t bit)
 {
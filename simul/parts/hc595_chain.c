@@ -0,0 +1,170 @@
+/*
+	hc595_chain.c
+
+	Copyright 2016, Fernando Vicente <fvicente@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "sim_avr.h"
+#include "hc595_chain.h"
+
+/*
+ * called when a SPI byte is sent
+ */
+static void
+hc595_chain_spi_in_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	hc595_chain_t * p = (hc595_chain_t*)param;
+	// send what falls off the last stage to any chained one
+	avr_raise_irq(p->irq + IRQ_HC595_CHAIN_SPI_BYTE_OUT,
+			(p->value >> ((p->stages - 1) * 8)) & 0xff);
+	p->value = ((p->value << 8) | (value & 0xff)) & p->mask;
+}
+
+/*
+ * bit banged shift clock, DS is sampled on the rising edge
+ */
+static void
+hc595_chain_shcp_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	hc595_chain_t * p = (hc595_chain_t*)param;
+	if (irq->value || !value)	// rising edge
+		return;
+	p->value = ((p->value << 1) |
+			(p->irq[IRQ_HC595_CHAIN_DS].value & 1)) & p->mask;
+}
+
+/*
+ * called when a LATCH signal is sent. The whole output goes in one or
+ * two IRQs, then only the pins that changed and have a listener
+ */
+static void
+hc595_chain_latch_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	hc595_chain_t * p = (hc595_chain_t*)param;
+	if (!irq->value || value)	// falling edge, like hc595
+		return;
+	uint64_t changed = (p->latch ^ p->value) & p->pins;
+	p->latch = p->value;
+	if (p->stages > 4)
+		avr_raise_irq(p->irq + IRQ_HC595_CHAIN_OUT_HI, p->latch >> 32);
+	avr_raise_irq(p->irq + IRQ_HC595_CHAIN_OUT, (uint32_t)p->latch);
+
+	while (changed) {
+		int pin = __builtin_ctzll(changed);
+		changed &= changed - 1;
+		avr_raise_irq(p->pin[pin], (p->latch >> pin) & 1);
+	}
+}
+
+/*
+ * called when a RESET signal is sent; like the real part, this only
+ * clears the shift register, the outputs follow on the next latch
+ */
+static void
+hc595_chain_reset_hook(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	hc595_chain_t * p = (hc595_chain_t*)param;
+	if (irq->value && !value) 	// falling edge
+		p->value = 0;
+}
+
+static const char * irq_names[IRQ_HC595_CHAIN_COUNT] = {
+		[IRQ_HC595_CHAIN_SPI_BYTE_IN] = "8<hc595c.in",
+		[IRQ_HC595_CHAIN_SPI_BYTE_OUT] = "8>hc595c.chain",
+		[IRQ_HC595_CHAIN_DS] = "<hc595c.ds",
+		[IRQ_HC595_CHAIN_SHCP] = "<hc595c.shcp",
+		[IRQ_HC595_CHAIN_IN_LATCH] = "<hc595c.latch",
+		[IRQ_HC595_CHAIN_IN_RESET] = "<hc595c.reset",
+		[IRQ_HC595_CHAIN_OUT] = "32>hc595c.out",
+		[IRQ_HC595_CHAIN_OUT_HI] = "32>hc595c.out_hi",
+};
+
+avr_irq_t *
+hc595_chain_pin_irq(
+		hc595_chain_t *p,
+		uint8_t pin)
+{
+	if (pin >= p->stages * 8) {
+		AVR_LOG(p->avr, LOG_WARNING, "HC595: %s: no pin %d in %d stages\n",
+				__func__, pin, p->stages);
+		return NULL;
+	}
+	if (!p->pin[pin]) {
+		char name[32];
+		snprintf(name, sizeof(name), ">hc595c.q%d", pin);
+		const char * names[1] = { name };
+		p->pin[pin] = avr_alloc_irq(&p->avr->irq_pool, 0, 1, names);
+		p->pin[pin]->flags |= IRQ_FLAG_FILTERED;
+		p->pin[pin]->value = (p->latch >> pin) & 1;
+		p->pins |= 1ULL << pin;
+	}
+	return p->pin[pin];
+}
+
+void
+hc595_chain_init(
+		struct avr_t * avr,
+		hc595_chain_t *p,
+		uint8_t stages)
+{
+	memset(p, 0, sizeof(*p));
+	p->avr = avr;
+	if (!stages || stages > HC595_CHAIN_MAX) {
+		AVR_LOG(avr, LOG_WARNING, "HC595: %s: %d stages, using %d\n",
+				__func__, stages, HC595_CHAIN_MAX);
+		stages = HC595_CHAIN_MAX;
+	}
+	p->stages = stages;
+	p->mask = stages == 8 ? ~0ULL : (1ULL << (stages * 8)) - 1;
+
+	p->irq = avr_alloc_irq(&avr->irq_pool, 0, IRQ_HC595_CHAIN_COUNT, irq_names);
+	avr_irq_register_notify(p->irq + IRQ_HC595_CHAIN_SPI_BYTE_IN,
+			hc595_chain_spi_in_hook, p);
+	avr_irq_register_notify(p->irq + IRQ_HC595_CHAIN_SHCP,
+			hc595_chain_shcp_hook, p);
+	avr_irq_register_notify(p->irq + IRQ_HC595_CHAIN_IN_LATCH,
+			hc595_chain_latch_hook, p);
+	avr_irq_register_notify(p->irq + IRQ_HC595_CHAIN_IN_RESET,
+			hc595_chain_reset_hook, p);
+}
+
+void
+hc595_chain_dispose(
+		hc595_chain_t *p)
+{
+	for (int i = 0; i < HC595_CHAIN_MAX * 8; i++)
+		if (p->pin[i])
+			avr_free_irq(p->pin[i], 1);
+	avr_free_irq(p->irq, IRQ_HC595_CHAIN_COUNT);
+	memset(p, 0, sizeof(*p));
+}
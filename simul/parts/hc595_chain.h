@@ -0,0 +1,90 @@
+/*
+	hc595_chain.h
+
+	Copyright 2016, Fernando Vicente <fvicente@gmail.com>
+
+	A cascade of 'stages' 74HC595 shift registers, modelled as one wide
+	register instead of several hc595 parts wired together, so a byte
+	shifted in is one IRQ, not one per stage.
+
+	Bytes come in on IRQ_HC595_CHAIN_SPI_BYTE_IN (hooked to the SPI
+	output), or bits on IRQ_HC595_CHAIN_DS/IRQ_HC595_CHAIN_SHCP for a
+	bit banged bus. What falls off the last stage goes out of
+	IRQ_HC595_CHAIN_SPI_BYTE_OUT, for chaining even more of them.
+
+	On latch the whole parallel output is raised at once: bits 63..32 on
+	IRQ_HC595_CHAIN_OUT_HI (only when there are more than 4 stages),
+	then bits 31..0 on IRQ_HC595_CHAIN_OUT. Stage 0 is the one the data
+	enters, in the low byte. A listener that wants all 64 bits can hook
+	IRQ_HC595_CHAIN_OUT and read 'latch'.
+
+	Single pins have an IRQ only if someone asks for it with
+	hc595_chain_pin_irq(); those are raised only when the pin changes.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HC595_CHAIN_H__
+#define __HC595_CHAIN_H__
+
+#include "sim_irq.h"
+
+enum {
+	IRQ_HC595_CHAIN_SPI_BYTE_IN = 0,	// if hooked to a byte based SPI IRQ
+	IRQ_HC595_CHAIN_SPI_BYTE_OUT,		// byte shifted out of the last stage
+	IRQ_HC595_CHAIN_DS,					// serial data, bit banged
+	IRQ_HC595_CHAIN_SHCP,				// shift clock, rising edge
+	IRQ_HC595_CHAIN_IN_LATCH,
+	IRQ_HC595_CHAIN_IN_RESET,
+	IRQ_HC595_CHAIN_OUT,				// when latched, bits 31..0
+	IRQ_HC595_CHAIN_OUT_HI,				// when latched, bits 63..32
+	IRQ_HC595_CHAIN_COUNT
+};
+
+#define HC595_CHAIN_MAX		8	// stages
+
+typedef struct hc595_chain_t {
+	avr_irq_t *	irq;		// irq list
+	struct avr_t * avr;
+	uint8_t		stages;
+	uint64_t	mask;		// bits that exist, for 'stages'
+	uint64_t	latch;		// value "on the pins"
+	uint64_t 	value;		// value shifted in
+
+	uint64_t	pins;		// pins with an irq in 'pin'
+	avr_irq_t *	pin[HC595_CHAIN_MAX * 8];
+} hc595_chain_t;
+
+void
+hc595_chain_init(
+		struct avr_t * avr,
+		hc595_chain_t *p,
+		uint8_t stages);
+
+/*
+ * IRQ for output 'pin' (stage * 8 + bit), allocated on the first call.
+ * Its value is the current level; it is only raised when that changes.
+ */
+avr_irq_t *
+hc595_chain_pin_irq(
+		hc595_chain_t *p,
+		uint8_t pin);
+
+void
+hc595_chain_dispose(
+		hc595_chain_t *p);
+
+#endif /* __HC595_CHAIN_H__ */
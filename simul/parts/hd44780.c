@@ -27,20 +27,30 @@
 
 #include "hd44780.h"
 
+static const uint8_t hd44780_line_offset[] = { 0, 0x40, 0x20, 0x60 };
+
 void
 hd44780_print(
 		hd44780_t *b)
 {
 	printf("/******************\\\n");
-	const uint8_t offset[] = { 0, 0x40, 0x20, 0x60 };
 	for (int i = 0; i < b->h; i++) {
 		printf("| ");
-		fwrite(b->vram + offset[i], 1, b->w, stdout);
+		fwrite(b->vram + hd44780_line_offset[i], 1, b->w, stdout);
 		printf(" |\n");
 	}
 	printf("\\******************/\n");
 }
 
+static inline void
+hd44780_set_dirty(
+		hd44780_t *b,
+		int from,
+		int count)
+{
+	for (int i = from; i < from + count; i++)
+		b->dirty[i >> 3] |= 1 << (i & 7);
+}
 
 static void
 _hd44780_reset_cursor(
@@ -56,6 +66,7 @@ _hd44780_clear_screen(
 		hd44780_t *b)
 {
 	memset(b->vram, ' ', 80);
+	hd44780_set_dirty(b, 0, 80);
 	hd44780_set_flag(b, HD44780_FLAG_DIRTY, 1);
 	avr_raise_irq(b->irq + IRQ_HD44780_ADDR, b->cursor);
 }
@@ -106,6 +117,8 @@ hd44780_write_data(
 		hd44780_t *b)
 {
 	uint32_t delay = 37; // uS
+	if (b->vram[b->cursor] != b->datapins)
+		hd44780_set_dirty(b, b->cursor, 1);
 	b->vram[b->cursor] = b->datapins;
 	printf("hd44780_write_data %02x\n", b->datapins);
 	if (hd44780_get_flag(b, HD44780_FLAG_S_C)) {	// display shift ?
@@ -162,6 +175,7 @@ hd44780_write_command(
 			hd44780_set_flag(b, HD44780_FLAG_D, b->datapins & 4);
 			hd44780_set_flag(b, HD44780_FLAG_C, b->datapins & 2);
 			hd44780_set_flag(b, HD44780_FLAG_B, b->datapins & 1);
+			hd44780_set_dirty(b, 0, 80);
 			hd44780_set_flag(b, HD44780_FLAG_DIRTY, 1);
 			break;
 		// Entry mode set
@@ -392,3 +406,52 @@ hd44780_init(
 			1, (int)avr_usec_to_cycles(avr, 1));
 }
 
+
+void
+hd44780_get_framebuffer(
+		hd44780_t *b,
+		display_fb_t * fb)
+{
+	fb->w = b->w;
+	fb->h = b->h;
+	uint32_t size = display_fb_size(fb);
+	if (!fb->pixels)
+		fb->pixels = malloc(size);
+	memset(fb->pixels, 0, size);
+	for (int y = 0; y < fb->h; y++) {
+		const uint8_t * src = b->vram + hd44780_line_offset[y];
+		uint8_t * line = fb->pixels + y * fb->stride;
+		if (fb->bpp == 1) {
+			for (int x = 0; x < fb->w; x++)
+				if (src[x] != ' ')
+					line[x >> 3] |= 0x80 >> (x & 7);
+		} else
+			memcpy(line, src, fb->w);
+	}
+}
+
+int
+hd44780_get_dirty(
+		hd44780_t *b,
+		display_rect_t * rects,
+		int max)
+{
+	int count = 0;
+	for (int y = 0; y < b->h; y++) {
+		int first = -1, last = -1;
+		for (int x = 0; x < b->w; x++) {
+			int i = hd44780_line_offset[y] + x;
+			if (!(b->dirty[i >> 3] & (1 << (i & 7))))
+				continue;
+			if (first < 0)
+				first = x;
+			last = x;
+		}
+		if (first < 0)
+			continue;
+		display_rect_t r = { .x = first, .y = y, .w = last - first + 1, .h = 1 };
+		count = display_fb_add_rect(rects, count, max, r);
+	}
+	memset(b->dirty, 0, sizeof(b->dirty));
+	return count;
+}
@@ -49,6 +49,7 @@
 #define __HD44780_H__
 
 #include "sim_irq.h"
+#include "display_fb.h"
 
 enum {
     IRQ_HD44780_ALL = 0,	// Only if (msb) RW:E:RS:D7:D6:D5:D4 (lsb)  configured
@@ -106,6 +107,7 @@ typedef struct hd44780_t
 	uint8_t  readpins;
 
 	uint16_t flags;				// LCD flags ( HD44780_FLAG_*)
+	uint8_t  dirty[(80 + 64 + 7) / 8];	// vram bytes changed, one bit each
 } hd44780_t;
 
 void
@@ -118,6 +120,26 @@ void
 hd44780_print(
 		struct hd44780_t *b);
 
+/*
+ * The screen, one byte per character cell: fb->w/h are the display
+ * columns and lines, each byte the character code shown there. With
+ * fb->bpp at 1 a bit is set for every non blank cell. If fb->pixels is
+ * NULL it is malloc()ed, for the caller to free.
+ */
+void
+hd44780_get_framebuffer(
+		struct hd44780_t *b,
+		display_fb_t * fb);
+/*
+ * Fills 'rects' with the cells changed since the last call, at most
+ * 'max' of them; returns how many.
+ */
+int
+hd44780_get_dirty(
+		struct hd44780_t *b,
+		display_rect_t * rects,
+		int max);
+
 static inline int
 hd44780_set_flag(
 		hd44780_t *b, uint16_t bit, int val)
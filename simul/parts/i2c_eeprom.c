@@ -27,6 +27,81 @@
 #include "avr_twi.h"
 #include "i2c_eeprom.h"
 
+/*
+ * A byte written by the master: the first one or two set the address
+ * register, the rest is data
+ */
+static void
+i2c_eeprom_write_byte(
+		i2c_eeprom_t * p,
+		uint8_t data)
+{
+	// address size is how many bytes we use for address register
+	int addr_size = p->size > 256 ? 2 : 1;
+	if (p->index < addr_size) {
+		p->reg_addr |= (data << (p->index * 8));
+		if (p->index == addr_size-1) {
+			// add the slave address, if relevant
+			p->reg_addr += ((p->selected & 1) - p->addr_base) << 7;
+			if (p->verbose)
+				printf("eeprom set address to 0x%04x\n", p->reg_addr);
+		}
+	} else {
+		if (p->verbose)
+			printf("eeprom WRITE data 0x%04x: %02x\n", p->reg_addr, data);
+		p->ee[p->reg_addr++] = data;
+	}
+	p->reg_addr &= (p->size -1);
+	p->index++;
+}
+
+static uint8_t
+i2c_eeprom_read_byte(
+		i2c_eeprom_t * p)
+{
+	if (p->verbose)
+		printf("eeprom READ data 0x%04x: %02x\n", p->reg_addr, p->ee[p->reg_addr]);
+	uint8_t data = p->ee[p->reg_addr++];
+	p->reg_addr &= (p->size -1);
+	p->index++;
+	return data;
+}
+
+/*
+ * Transaction level handlers, see AVR_IOCTL_TWI_ADD_SLAVE
+ */
+static int
+i2c_eeprom_fast_write(
+		void * param,
+		uint8_t addr,
+		const uint8_t * buf,
+		int n)
+{
+	i2c_eeprom_t * p = (i2c_eeprom_t*)param;
+
+	p->selected = addr;
+	p->index = 0;
+	p->reg_addr = 0;
+	for (int i = 0; i < n; i++)
+		i2c_eeprom_write_byte(p, buf[i]);
+	p->selected = 0;
+	return n;
+}
+
+static int
+i2c_eeprom_fast_read(
+		void * param,
+		uint8_t addr,
+		uint8_t * buf,
+		int n)
+{
+	i2c_eeprom_t * p = (i2c_eeprom_t*)param;
+
+	for (int i = 0; i < n; i++)
+		buf[i] = i2c_eeprom_read_byte(p);
+	return n;
+}
+
 /*
  * called when a RESET signal is sent
  */
@@ -83,34 +158,15 @@ i2c_eeprom_in_hook(
 			// address size is how many bytes we use for address register
 			avr_raise_irq(p->irq + TWI_IRQ_INPUT,
 					avr_twi_irq_msg(TWI_COND_ACK, p->selected, 1));
-			int addr_size = p->size > 256 ? 2 : 1;
-			if (p->index < addr_size) {
-				p->reg_addr |= (v.u.twi.data << (p->index * 8));
-				if (p->index == addr_size-1) {
-					// add the slave address, if relevant
-					p->reg_addr += ((p->selected & 1) - p->addr_base) << 7;
-					if (p->verbose)
-						printf("eeprom set address to 0x%04x\n", p->reg_addr);
-				}
-			} else {
-				if (p->verbose)
-					printf("eeprom WRITE data 0x%04x: %02x\n", p->reg_addr, v.u.twi.data);
-				p->ee[p->reg_addr++] = v.u.twi.data;
-			}
-			p->reg_addr &= (p->size -1);
-			p->index++;
+			i2c_eeprom_write_byte(p, v.u.twi.data);
 		}
 		/*
 		 * It's a read transaction, just send the next byte back to the master
 		 */
 		if (v.u.twi.msg & TWI_COND_READ) {
-			if (p->verbose)
-				printf("eeprom READ data 0x%04x: %02x\n", p->reg_addr, p->ee[p->reg_addr]);
-			uint8_t data = p->ee[p->reg_addr++];
+			uint8_t data = i2c_eeprom_read_byte(p);
 			avr_raise_irq(p->irq + TWI_IRQ_INPUT,
 					avr_twi_irq_msg(TWI_COND_READ, p->selected, data));
-			p->reg_addr &= (p->size -1);
-			p->index++;
 		}
 	}
 }
@@ -157,3 +213,20 @@ i2c_eeprom_attach(
 		avr_io_getirq(avr, i2c_irq_base, TWI_IRQ_OUTPUT),
 		p->irq + TWI_IRQ_OUTPUT );
 }
+
+void
+i2c_eeprom_attach_fast(
+		struct avr_t * avr,
+		i2c_eeprom_t * p,
+		uint32_t i2c_irq_base )
+{
+	avr_twi_slave_t slave = {
+		.addr = p->addr_base,
+		.mask = p->addr_mask,
+		.param = p,
+		.write = i2c_eeprom_fast_write,
+		.read = i2c_eeprom_fast_read,
+	};
+	// the TWI name is the last byte of its ioctls
+	avr_ioctl(avr, AVR_IOCTL_TWI_ADD_SLAVE(i2c_irq_base & 0xff), &slave);
+}
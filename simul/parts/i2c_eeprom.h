@@ -88,4 +88,15 @@ i2c_eeprom_attach(
 		i2c_eeprom_t * p,
 		uint32_t i2c_irq_base );
 
+/*
+ * Same as i2c_eeprom_attach(), but as a transaction level slave; the TWI
+ * hands whole transfers to the eeprom rather than going through the IRQs
+ * for every phase, see AVR_IOCTL_TWI_ADD_SLAVE
+ */
+void
+i2c_eeprom_attach_fast(
+		struct avr_t * avr,
+		i2c_eeprom_t * p,
+		uint32_t i2c_irq_base );
+
 #endif /* __I2C_EEPROM_H___ */
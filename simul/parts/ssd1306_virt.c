@@ -29,13 +29,38 @@
 #include "avr_spi.h"
 #include "avr_ioport.h"
 
+/*
+ * Everything needs redrawing, after a change that's not in the VRAM
+ */
+static void
+ssd1306_dirty_all (ssd1306_t *part)
+{
+	for (int p = 0; p < SSD1306_VIRT_PAGES; p++)
+	{
+		part->dirty[p].lo = 0;
+		part->dirty[p].hi = part->columns - 1;
+	}
+	ssd1306_set_flag (part, SSD1306_FLAG_DIRTY, 1);
+}
+
 /*
  * Write a byte at the current cursor location and then scroll the cursor.
  */
 static void
 ssd1306_write_data (ssd1306_t *part)
 {
-	part->vram[part->cursor.page][part->cursor.column] = part->spi_data;
+	uint8_t page = part->cursor.page, column = part->cursor.column;
+
+	if (part->vram[page][column] != part->spi_data)
+	{
+		part->vram[page][column] = part->spi_data;
+		if (part->dirty[page].lo > part->dirty[page].hi)
+			part->dirty[page].lo = part->dirty[page].hi = column;
+		else if (column < part->dirty[page].lo)
+			part->dirty[page].lo = column;
+		else if (column > part->dirty[page].hi)
+			part->dirty[page].hi = column;
+	}
 
 	// Scroll the cursor
 	if (++(part->cursor.column) >= SSD1306_VIRT_COLUMNS)
@@ -66,26 +91,26 @@ ssd1306_update_command_register (ssd1306_t *part)
 		case SSD1306_VIRT_DISP_NORMAL:
 			ssd1306_set_flag (part, SSD1306_FLAG_DISPLAY_INVERTED,
 			                  0);
-			ssd1306_set_flag (part, SSD1306_FLAG_DIRTY, 1);
+			ssd1306_dirty_all (part);
 			//printf ("SSD1306: DISPLAY NORMAL\n");
 			SSD1306_CLEAR_COMMAND_REG(part);
 			return;
 		case SSD1306_VIRT_DISP_INVERTED:
 			ssd1306_set_flag (part, SSD1306_FLAG_DISPLAY_INVERTED,
 			                  1);
-			ssd1306_set_flag (part, SSD1306_FLAG_DIRTY, 1);
+			ssd1306_dirty_all (part);
 			//printf ("SSD1306: DISPLAY INVERTED\n");
 			SSD1306_CLEAR_COMMAND_REG(part);
 			return;
 		case SSD1306_VIRT_DISP_SUSPEND:
 			ssd1306_set_flag (part, SSD1306_FLAG_DISPLAY_ON, 0);
-			ssd1306_set_flag (part, SSD1306_FLAG_DIRTY, 1);
+			ssd1306_dirty_all (part);
 			//printf ("SSD1306: DISPLAY SUSPENDED\n");
 			SSD1306_CLEAR_COMMAND_REG(part);
 			return;
 		case SSD1306_VIRT_DISP_ON:
 			ssd1306_set_flag (part, SSD1306_FLAG_DISPLAY_ON, 1);
-			ssd1306_set_flag (part, SSD1306_FLAG_DIRTY, 1);
+			ssd1306_dirty_all (part);
 			//printf ("SSD1306: DISPLAY ON\n");
 			SSD1306_CLEAR_COMMAND_REG(part);
 			return;
@@ -116,24 +141,28 @@ ssd1306_update_command_register (ssd1306_t *part)
 		case SSD1306_VIRT_SET_SEG_REMAP_0:
 			ssd1306_set_flag (part, SSD1306_FLAG_SEGMENT_REMAP_0,
 			                  1);
+			ssd1306_dirty_all (part);
 			//printf ("SSD1306: SET COLUMN ADDRESS 0 TO OLED SEG0 to \n");
 			SSD1306_CLEAR_COMMAND_REG(part);
 			return;
 		case SSD1306_VIRT_SET_SEG_REMAP_127:
 			ssd1306_set_flag (part, SSD1306_FLAG_SEGMENT_REMAP_0,
 			                  0);
+			ssd1306_dirty_all (part);
 			//printf ("SSD1306: SET COLUMN ADDRESS 127 TO OLED SEG0 to \n");
 			SSD1306_CLEAR_COMMAND_REG(part);
 			return;
 		case SSD1306_VIRT_SET_COM_SCAN_NORMAL:
 			ssd1306_set_flag (part, SSD1306_FLAG_COM_SCAN_NORMAL,
 			                  1);
+			ssd1306_dirty_all (part);
 			//printf ("SSD1306: SET COM OUTPUT SCAN DIRECTION NORMAL \n");
 			SSD1306_CLEAR_COMMAND_REG(part);
 			return;
 		case SSD1306_VIRT_SET_COM_SCAN_INVERTED:
 			ssd1306_set_flag (part, SSD1306_FLAG_COM_SCAN_NORMAL,
 			                  0);
+			ssd1306_dirty_all (part);
 			//printf ("SSD1306: SET COM OUTPUT SCAN DIRECTION REMAPPED \n");
 			SSD1306_CLEAR_COMMAND_REG(part);
 			return;
@@ -153,7 +182,7 @@ ssd1306_update_setting (ssd1306_t *part)
 	{
 		case SSD1306_VIRT_SET_CONTRAST:
 			part->contrast_register = part->spi_data;
-			ssd1306_set_flag (part, SSD1306_FLAG_DIRTY, 1);
+			ssd1306_dirty_all (part);
 			SSD1306_CLEAR_COMMAND_REG(part);
 			//printf ("SSD1306: CONTRAST SET: 0x%02x\n", part->contrast_register);
 			return;
@@ -183,18 +212,16 @@ ssd1306_write_command (ssd1306_t *part)
 }
 
 /*
- * Called when a SPI byte is sent
+ * A SPI byte is received
  */
 static void
-ssd1306_spi_in_hook (struct avr_irq_t * irq, uint32_t value, void * param)
+ssd1306_spi_byte (ssd1306_t * part, uint8_t value)
 {
-	ssd1306_t * part = (ssd1306_t*) param;
-
 	// Chip select should be pulled low to enable
 	if (part->cs_pin)
 		return;
 
-	part->spi_data = value & 0xFF;
+	part->spi_data = value;
 
 	switch (part->di_pin)
 	{
@@ -210,6 +237,28 @@ ssd1306_spi_in_hook (struct avr_irq_t * irq, uint32_t value, void * param)
 	}
 }
 
+/*
+ * Called when a SPI byte is sent
+ */
+static void
+ssd1306_spi_in_hook (struct avr_irq_t * irq, uint32_t value, void * param)
+{
+	ssd1306_spi_byte ((ssd1306_t*) param, value & 0xFF);
+}
+
+/*
+ * Called with a burst of SPI bytes, all sent with the pins as they are now
+ */
+static void
+ssd1306_spi_block (void * param, const uint8_t * buf, uint32_t len,
+                   avr_cycle_count_t when, avr_cycle_count_t byte_cycles)
+{
+	ssd1306_t * part = (ssd1306_t*) param;
+
+	for (uint32_t i = 0; i < len; i++)
+		ssd1306_spi_byte (part, buf[i]);
+}
+
 /*
  * Called when chip select changes
  */
@@ -217,6 +266,8 @@ static void
 ssd1306_cs_hook (struct avr_irq_t * irq, uint32_t value, void * param)
 {
 	ssd1306_t * p = (ssd1306_t*) param;
+	// Bytes still buffered by the SPI were sent with the old pin state
+	avr_ioctl (p->avr, AVR_IOCTL_SPI_FLUSH(0), NULL);
 	p->cs_pin = value & 0xFF;
 	//printf ("SSD1306: CHIP SELECT:  0x%02x\n", value);
 
@@ -229,6 +280,7 @@ static void
 ssd1306_di_hook (struct avr_irq_t * irq, uint32_t value, void * param)
 {
 	ssd1306_t * part = (ssd1306_t*) param;
+	avr_ioctl (part->avr, AVR_IOCTL_SPI_FLUSH(0), NULL);
 	part->di_pin = value & 0xFF;
 	//printf ("SSD1306: DATA / INSTRUCTION:  0x%08x\n", value);
 }
@@ -244,6 +296,7 @@ ssd1306_reset_hook (struct avr_irq_t * irq, uint32_t value, void * param)
 	if (irq->value && !value)
 	{
 		// Falling edge
+		avr_ioctl (part->avr, AVR_IOCTL_SPI_FLUSH(0), NULL);
 		memset (part->vram, 0, part->rows * part->pages);
 		part->cursor.column = 0;
 		part->cursor.page = 0;
@@ -252,6 +305,7 @@ ssd1306_reset_hook (struct avr_irq_t * irq, uint32_t value, void * param)
 		part->contrast_register = 0x7F;
 		ssd1306_set_flag (part, SSD1306_FLAG_COM_SCAN_NORMAL, 1);
 		ssd1306_set_flag (part, SSD1306_FLAG_SEGMENT_REMAP_0, 1);
+		ssd1306_dirty_all (part);
 	}
 
 }
@@ -265,10 +319,19 @@ static const char * irq_names[IRQ_SSD1306_COUNT] =
 void
 ssd1306_connect (ssd1306_t * part, ssd1306_wiring_t * wiring)
 {
-	avr_connect_irq (
-	                avr_io_getirq (part->avr, AVR_IOCTL_SPI_GETIRQ(0),
-	                               SPI_IRQ_OUTPUT),
-	                part->irq + IRQ_SSD1306_SPI_BYTE_IN);
+	/*
+	 * Take the SPI bytes in blocks, and fall back to one IRQ per byte
+	 * if the SPI can't do that
+	 */
+	avr_spi_block_t block = {
+		.param = part,
+		.write = ssd1306_spi_block,
+	};
+	if (avr_ioctl (part->avr, AVR_IOCTL_SPI_SET_BLOCK(0), &block) < 0)
+		avr_connect_irq (
+		                avr_io_getirq (part->avr, AVR_IOCTL_SPI_GETIRQ(0),
+		                               SPI_IRQ_OUTPUT),
+		                part->irq + IRQ_SSD1306_SPI_BYTE_IN);
 
 	avr_connect_irq (
 	                avr_io_getirq (part->avr,
@@ -303,6 +366,7 @@ ssd1306_init (struct avr_t *avr, struct ssd1306_t * part, int width, int height)
 	part->columns = width;
 	part->rows = height;
 	part->pages = height / 8; 	// 8 pixels per page
+	ssd1306_dirty_all (part);
 
 	/*
 	 * Register callbacks on all our IRQs
@@ -324,3 +388,89 @@ ssd1306_init (struct avr_t *avr, struct ssd1306_t * part, int width, int height)
 	printf ("SSD1306: %duS is %d cycles for your AVR\n", 1,
 	        (int) avr_usec_to_cycles (avr, 1));
 }
+
+/*
+ * VRAM byte for a screen page and column, reversed when the COM scan
+ * direction is, as the GL renderer does.
+ */
+static uint8_t
+ssd1306_screen_byte (ssd1306_t *part, int page, int column)
+{
+	if (!ssd1306_get_flag (part, SSD1306_FLAG_SEGMENT_REMAP_0))
+		column = part->columns - 1 - column;
+	if (ssd1306_get_flag (part, SSD1306_FLAG_COM_SCAN_NORMAL))
+		return part->vram[page][column];
+
+	uint8_t b = part->vram[part->pages - 1 - page][column];
+	b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+	b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+	b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+	return b;
+}
+
+void
+ssd1306_get_framebuffer (ssd1306_t * part, display_fb_t * fb)
+{
+	fb->w = part->columns;
+	fb->h = part->rows;
+	uint32_t size = display_fb_size (fb);
+	if (!fb->pixels)
+		fb->pixels = malloc (size);
+	memset (fb->pixels, 0, size);
+
+	int on = ssd1306_get_flag (part, SSD1306_FLAG_DISPLAY_ON);
+	int invert = ssd1306_get_flag (part, SSD1306_FLAG_DISPLAY_INVERTED);
+	// same curve as the GL renderer: even 0 contrast is clearly visible
+	uint8_t level = 255 * (part->contrast_register / 512.0 + 0.5);
+
+	for (int y = 0; y < fb->h; y++)
+	{
+		uint8_t * line = fb->pixels + y * fb->stride;
+		for (int x = 0; x < fb->w; x++)
+		{
+			int lit = on && (((ssd1306_screen_byte (part, y / 8, x)
+			                >> (y & 7)) & 1) ^ invert);
+			if (!lit)
+				continue;
+			if (fb->bpp == 1)
+				line[x >> 3] |= 0x80 >> (x & 7);
+			else
+				line[x] = level;
+		}
+	}
+}
+
+int
+ssd1306_get_dirty (ssd1306_t * part, display_rect_t * rects, int max)
+{
+	int count = 0;
+	int remap = !ssd1306_get_flag (part, SSD1306_FLAG_SEGMENT_REMAP_0);
+	int flip = !ssd1306_get_flag (part, SSD1306_FLAG_COM_SCAN_NORMAL);
+
+	for (int p = 0; p < part->pages; p++)
+	{
+		if (part->dirty[p].lo > part->dirty[p].hi)
+			continue;
+		display_rect_t r = {
+			.x = remap ? part->columns - 1 - part->dirty[p].hi :
+			                part->dirty[p].lo,
+			.y = (flip ? part->pages - 1 - p : p) * 8,
+			.w = part->dirty[p].hi - part->dirty[p].lo + 1,
+			.h = 8,
+		};
+		count = display_fb_add_rect (rects, count, max, r);
+		part->dirty[p].lo = 1;
+		part->dirty[p].hi = 0;
+	}
+	return count;
+}
+
+int
+ssd1306_dump_pgm (ssd1306_t * part, const char * filename)
+{
+	display_fb_t fb = { .bpp = 8 };
+	ssd1306_get_framebuffer (part, &fb);
+	int res = display_fb_write_pgm (&fb, filename);
+	free (fb.pixels);
+	return res;
+}
@@ -41,6 +41,7 @@
 #define __SSD1306_VIRT_H__
 
 #include "sim_irq.h"
+#include "display_fb.h"
 
 #define SSD1306_VIRT_DATA			1
 #define SSD1306_VIRT_INSTRUCTION 		0
@@ -146,6 +147,13 @@ typedef struct ssd1306_t
 	uint8_t cs_pin;
 	uint8_t di_pin;
 	uint8_t spi_data;
+	/*
+	 * Columns written in each page since the last ssd1306_get_dirty(),
+	 * lo > hi when the page is clean
+	 */
+	struct {
+		uint8_t lo, hi;
+	} dirty[SSD1306_VIRT_PAGES];
 } ssd1306_t;
 
 typedef struct ssd1306_pin_t
@@ -181,4 +189,24 @@ ssd1306_get_flag (ssd1306_t *b, uint16_t bit)
 void
 ssd1306_connect (ssd1306_t * part, ssd1306_wiring_t * wiring);
 
+/*
+ * The screen as it looks, through the segment remap, COM scan direction,
+ * inversion and display on/off. The caller sets fb->bpp; lit pixels are
+ * set in 1 bpp, and at the contrast level in 8 bpp. If fb->pixels is
+ * NULL it is malloc()ed, for the caller to free.
+ */
+void
+ssd1306_get_framebuffer (ssd1306_t * part, display_fb_t * fb);
+
+/*
+ * Fills 'rects' with the screen areas changed since the last call, in
+ * screen coordinates, at most 'max' of them; returns how many.
+ */
+int
+ssd1306_get_dirty (ssd1306_t * part, display_rect_t * rects, int max);
+
+// writes the screen as a PGM file, returns 0 on success
+int
+ssd1306_dump_pgm (ssd1306_t * part, const char * filename);
+
 #endif 
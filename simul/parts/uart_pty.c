@@ -25,13 +25,18 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
-#include <signal.h>
+#include <poll.h>
 #ifdef __APPLE__
 #include <util.h>
 #else
 #include <pty.h>
 #endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 
 #include "uart_pty.h"
 #include "avr_uart.h"
@@ -45,6 +50,57 @@ DEFINE_FIFO(uint8_t,uart_pty_fifo);
 #define TRACE(_w)
 #endif
 
+// the fallback flush timer, see uart_pty_flush_timer()
+#define UART_PTY_FLUSH_HZ	1000
+#define UART_PTY_IDLE_HZ	30
+
+enum { UART_PTY_DOORBELL = 2 };	// epoll tag, after the two ports
+
+static void
+uart_pty_ring(
+		uart_pty_t * p)
+{
+#ifdef __linux__
+	uint64_t one = 1;
+#else
+	uint8_t one = 1;
+#endif
+	TRACE(ssize_t r =) write(p->doorbell[1], &one, sizeof(one));
+}
+
+/*
+ * Wake the I/O thread, but only if it's asleep; it sets 'waiting' before
+ * looking at the fifos, so whatever we did before this is seen either way
+ */
+static void
+uart_pty_kick(
+		uart_pty_t * p)
+{
+	__sync_synchronize();
+	if (p->waiting && __sync_bool_compare_and_swap(&p->waiting, 1, 0))
+		uart_pty_ring(p);
+}
+
+static void
+uart_pty_ring_clear(
+		uart_pty_t * p)
+{
+	uint8_t drain[64];	// eventfd needs 8, the pipe can take any size
+	while (read(p->doorbell[0], drain, sizeof(drain)) > 0)
+		;
+}
+
+// queue a byte for the I/O thread
+static void
+uart_pty_queue(
+		uart_pty_t * p,
+		uart_pty_port_t * port,
+		uint8_t byte)
+{
+	uart_pty_fifo_write(&port->in, byte);
+	uart_pty_kick(p);
+}
+
 /*
  * called when a byte is send via the uart on the AVR
  */
@@ -56,13 +112,36 @@ uart_pty_in_hook(
 {
 	uart_pty_t * p = (uart_pty_t*)param;
 	TRACE(printf("uart_pty_in_hook %02x\n", value);)
-	uart_pty_fifo_write(&p->pty.in, value);
+	uart_pty_queue(p, &p->pty, value);
 
 	if (p->tap.s) {
 		if (p->tap.crlf && value == '\n')
-			uart_pty_fifo_write(&p->tap.in, '\r');
-		uart_pty_fifo_write(&p->tap.in, value);
+			uart_pty_queue(p, &p->tap, '\r');
+		uart_pty_queue(p, &p->tap, value);
+	}
+}
+
+/*
+ * Hand over as much of the pty fifo as the uart will take. When connected
+ * with uart_pty_connect() it's done in chunks with AVR_IOCTL_UART_PUSH_BUF,
+ * otherwise one IRQ_UART_PTY_BYTE_OUT per byte.
+ * Returns the number of bytes the uart took
+ */
+static uint32_t
+uart_pty_push(
+		uart_pty_t * p,
+		const uint8_t * buf,
+		uint32_t len)
+{
+	if (p->uart) {
+		avr_uart_buf_t b = { .buf = buf, .len = len };
+		avr_ioctl(p->avr, AVR_IOCTL_UART_PUSH_BUF(p->uart), &b);
+		return b.done;
 	}
+	uint32_t done = 0;
+	while (p->xon && done < len)
+		avr_raise_irq(p->irq + IRQ_UART_PTY_BYTE_OUT, buf[done++]);
+	return done;
 }
 
 // try to empty our fifo, the uart_pty_xoff_hook() will be called when
@@ -71,32 +150,53 @@ static void
 uart_pty_flush_incoming(
 		uart_pty_t * p)
 {
-	while (p->xon && !uart_pty_fifo_isempty(&p->pty.out)) {
-		TRACE(int r = p->pty.out.read;)
-		uint8_t byte = uart_pty_fifo_read(&p->pty.out);
-		TRACE(printf("uart_pty_flush_incoming send r %03d:%02x\n", r, byte);)
-		avr_raise_irq(p->irq + IRQ_UART_PTY_BYTE_OUT, byte);
+	uart_pty_fifo_t * f = &p->pty.out;
+	int flushed = 0;
+
+	while (p->xon && !uart_pty_fifo_isempty(f)) {
+		uint16_t r = f->read;
+		uint32_t len = uart_pty_fifo_get_read_size(f);
+		if (r + len > uart_pty_fifo_fifo_size)
+			len = uart_pty_fifo_fifo_size - r;	// up to the wrap point
+		uint32_t done = uart_pty_push(p, f->buffer + r, len);
+		TRACE(printf("uart_pty_flush_incoming sent %d/%d\n", done, len);)
 
 		if (p->tap.s) {
-			if (p->tap.crlf && byte == '\n')
-				uart_pty_fifo_write(&p->tap.in, '\r');
-			uart_pty_fifo_write(&p->tap.in, byte);
+			for (uint32_t i = 0; i < done; i++) {
+				uint8_t byte = f->buffer[r + i];
+				if (p->tap.crlf && byte == '\n')
+					uart_pty_queue(p, &p->tap, '\r');
+				uart_pty_queue(p, &p->tap, byte);
+			}
 		}
+		uart_pty_fifo_read_offset(f, done);
+		flushed += done;
+		if (done < len)
+			break;
 	}
 	if (p->tap.s) {
 		while (p->xon && !uart_pty_fifo_isempty(&p->tap.out)) {
 			uint8_t byte = uart_pty_fifo_read(&p->tap.out);
 			if (p->tap.crlf && byte == '\r') {
-				uart_pty_fifo_write(&p->tap.in, '\n');
+				uart_pty_queue(p, &p->tap, '\n');
 			}
 			if (byte == '\n')
 				continue;
-			uart_pty_fifo_write(&p->tap.in, byte);
+			uart_pty_queue(p, &p->tap, byte);
 			avr_raise_irq(p->irq + IRQ_UART_PTY_BYTE_OUT, byte);
+			flushed++;
 		}
 	}
+	// room was made, the I/O thread might be waiting for it to read more
+	if (flushed)
+		uart_pty_kick(p);
 }
 
+/*
+ * Fallback for firmwares that don't poll the uart status, so XON isn't
+ * raised. It runs while XON is on, at UART_PTY_FLUSH_HZ when bytes came
+ * in, and backs off to UART_PTY_IDLE_HZ while the pty stays quiet.
+ */
 avr_cycle_count_t
 uart_pty_flush_timer(
 		struct avr_t * avr,
@@ -104,10 +204,18 @@ uart_pty_flush_timer(
 		void * param)
 {
 	uart_pty_t * p = (uart_pty_t*)param;
+	avr_cycle_count_t fast = avr_hz_to_cycles(avr, UART_PTY_FLUSH_HZ);
+	avr_cycle_count_t idle = avr_hz_to_cycles(avr, UART_PTY_IDLE_HZ);
 
+	if (uart_pty_fifo_isempty(&p->pty.out) &&
+			uart_pty_fifo_isempty(&p->tap.out)) {
+		if (p->flush_interval < idle)
+			p->flush_interval *= 2;
+	} else
+		p->flush_interval = fast;
 	uart_pty_flush_incoming(p);
 	/* always return a cycle NUMBER not a cycle count */
-	return p->xon ? when + avr_hz_to_cycles(p->avr, 1000) : 0;
+	return p->xon ? when + p->flush_interval : 0;
 }
 
 /*
@@ -122,14 +230,16 @@ uart_pty_xon_hook(
 {
 	uart_pty_t * p = (uart_pty_t*)param;
 	TRACE(if (!p->xon) printf("uart_pty_xon_hook\n");)
+	if (!p->xon)
+		p->flush_interval = avr_hz_to_cycles(p->avr, UART_PTY_FLUSH_HZ);
 	p->xon = 1;
 
 	uart_pty_flush_incoming(p);
 
 	// if the buffer is not flushed, try to do it later
-	if (p->xon)
-			avr_cycle_timer_register(p->avr, avr_hz_to_cycles(p->avr, 1000),
-						uart_pty_flush_timer, param);
+	if (p->xon && !avr_cycle_timer_status(p->avr, uart_pty_flush_timer, param))
+		avr_cycle_timer_register(p->avr, p->flush_interval,
+				uart_pty_flush_timer, param);
 }
 
 /*
@@ -147,79 +257,106 @@ uart_pty_xoff_hook(
 	avr_cycle_timer_cancel(p->avr, uart_pty_flush_timer, param);
 }
 
+// only ask for what can be acted on: room to read into, bytes to write
+static void
+uart_pty_update_events(
+		uart_pty_t * p,
+		int ti)
+{
+	uart_pty_port_t * port = &p->port[ti];
+	uint32_t events = 0;
+
+	if (!uart_pty_fifo_isfull(&port->out))
+		events |= POLLIN;
+	if (!uart_pty_fifo_isempty(&port->in))
+		events |= POLLOUT;
+	if (events == port->events)
+		return;
+	port->events = events;
+#ifdef __linux__
+	struct epoll_event ev = {
+		.events = (events & POLLIN ? EPOLLIN : 0) |
+				(events & POLLOUT ? EPOLLOUT : 0),
+		.data.u32 = ti,
+	};
+	epoll_ctl(p->poll, EPOLL_CTL_MOD, port->s, &ev);
+#endif
+}
+
+static int
+uart_pty_wait(
+		uart_pty_t * p)
+{
+#ifdef __linux__
+	struct epoll_event ev[3];
+	return epoll_wait(p->poll, ev, 3, -1);
+#else
+	struct pollfd fds[3] = {
+		{ .fd = p->doorbell[0], .events = POLLIN },
+	};
+	int count = 1;
+	for (int ti = 0; ti < 2; ti++) if (p->port[ti].s) {
+		fds[count].fd = p->port[ti].s;
+		fds[count++].events = p->port[ti].events;
+	}
+	return poll(fds, count, -1);
+#endif
+}
+
+/*
+ * The I/O thread. Both the ptys and the doorbell are non blocking, so
+ * after each wake up it just moves as much as it can, both ways, in as
+ * few read()/write() as the fifo wrap around allows.
+ */
 static void *
 uart_pty_thread(
 		void * param)
 {
 	uart_pty_t * p = (uart_pty_t*)param;
 
-	while (1) {
-		fd_set read_set, write_set;
-		int max = 0;
-		FD_ZERO(&read_set);
-		FD_ZERO(&write_set);
+	while (!p->stop) {
+		p->waiting = 1;
+		__sync_synchronize();
+		for (int ti = 0; ti < 2; ti++) if (p->port[ti].s)
+			uart_pty_update_events(p, ti);
 
-		for (int ti = 0; ti < 2; ti++) if (p->port[ti].s) {
-			// read more only if buffer was flushed
-			if (p->port[ti].buffer_len == p->port[ti].buffer_done) {
-				FD_SET(p->port[ti].s, &read_set);
-				max = p->port[ti].s > max ? p->port[ti].s : max;
-			}
-			if (!uart_pty_fifo_isempty(&p->port[ti].in)) {
-				FD_SET(p->port[ti].s, &write_set);
-				max = p->port[ti].s > max ? p->port[ti].s : max;
-			}
-		}
-
-		// short, but not too short interval
-		struct timeval timo = { 0, 500 };
-		int ret = select(max+1, &read_set, &write_set, NULL, &timo);
-
-		if (!ret)
-			continue;
-		if (ret < 0)
+		if (uart_pty_wait(p) < 0 && errno != EINTR)
 			break;
+		p->waiting = 0;
+		uart_pty_ring_clear(p);
 
 		for (int ti = 0; ti < 2; ti++) if (p->port[ti].s) {
-			if (FD_ISSET(p->port[ti].s, &read_set)) {
-				ssize_t r = read(p->port[ti].s, p->port[ti].buffer,
-									sizeof(p->port[ti].buffer)-1);
-				p->port[ti].buffer_len = r;
-				p->port[ti].buffer_done = 0;
-				TRACE(if (!p->port[ti].tap)
-						hdump("pty recv", p->port[ti].buffer, r);)
-			}
-			if (p->port[ti].buffer_done < p->port[ti].buffer_len) {
-				// write them in fifo
-				while (p->port[ti].buffer_done < p->port[ti].buffer_len &&
-						!uart_pty_fifo_isfull(&p->port[ti].out)) {
-					int index = p->port[ti].buffer_done++;
-					TRACE(int wi = p->port[ti].out.write;)
-					uart_pty_fifo_write(&p->port[ti].out,
-							p->port[ti].buffer[index]);
-					TRACE(printf("w %3d:%02x (%d/%d) %s\n",
-								wi, p->port[ti].buffer[index],
-								p->port[ti].out.read,
-								p->port[ti].out.write,
-								p->xon ? "XON" : "XOFF");)
-				}
+			uart_pty_port_t * port = &p->port[ti];
+			uart_pty_fifo_t * out = &port->out;
+			uart_pty_fifo_t * in = &port->in;
+			ssize_t r;
+
+			while (!uart_pty_fifo_isfull(out)) {
+				uint16_t w = out->write;
+				size_t len = uart_pty_fifo_get_write_size(out);
+				if (w + len > uart_pty_fifo_fifo_size)
+					len = uart_pty_fifo_fifo_size - w;
+				r = read(port->s, out->buffer + w, len);
+				if (r <= 0)
+					break;
+				TRACE(if (!port->tap) hdump("pty recv", out->buffer + w, r);)
+				uart_pty_fifo_write_offset(out, r);
 			}
-			if (FD_ISSET(p->port[ti].s, &write_set)) {
-				uint8_t buffer[512];
-				// write them in fifo
-				uint8_t * dst = buffer;
-				while (!uart_pty_fifo_isempty(&p->port[ti].in) &&
-						dst < (buffer + sizeof(buffer)))
-					*dst++ = uart_pty_fifo_read(&p->port[ti].in);
-				size_t len = dst - buffer;
-				TRACE(size_t r =) write(p->port[ti].s, buffer, len);
-				TRACE(if (!p->port[ti].tap) hdump("pty send", buffer, r);)
+			while (!uart_pty_fifo_isempty(in)) {
+				uint16_t rd = in->read;
+				size_t len = uart_pty_fifo_get_read_size(in);
+				if (rd + len > uart_pty_fifo_fifo_size)
+					len = uart_pty_fifo_fifo_size - rd;
+				r = write(port->s, in->buffer + rd, len);
+				if (r <= 0)
+					break;
+				TRACE(if (!port->tap) hdump("pty send", in->buffer + rd, r);)
+				uart_pty_fifo_read_offset(in, r);
 			}
 		}
-		/* DO NOT call this, this create a concurency issue with the
-		 * FIFO that can't be solved cleanly with a memory barrier
-			uart_pty_flush_incoming(p);
-		  */
+		/* DO NOT call uart_pty_flush_incoming() here, the AVR side of
+		 * the fifos belong to the AVR thread; it picks up the bytes
+		 * on XON, or from its timer */
 	}
 	return NULL;
 }
@@ -243,6 +380,18 @@ uart_pty_init(
 	int hastap = (getenv("SIMAVR_UART_TAP") && atoi(getenv("SIMAVR_UART_TAP"))) ||
 			(getenv("SIMAVR_UART_XTERM") && atoi(getenv("SIMAVR_UART_XTERM"))) ;
 
+#ifdef __linux__
+	p->doorbell[0] = p->doorbell[1] = eventfd(0, EFD_NONBLOCK);
+	p->poll = epoll_create1(0);
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = UART_PTY_DOORBELL };
+	epoll_ctl(p->poll, EPOLL_CTL_ADD, p->doorbell[0], &ev);
+#else
+	if (pipe(p->doorbell) == 0) {
+		fcntl(p->doorbell[0], F_SETFL, O_NONBLOCK);
+		fcntl(p->doorbell[1], F_SETFL, O_NONBLOCK);
+	}
+#endif
+
 	for (int ti = 0; ti < 1 + hastap; ti++) {
 		int m, s;
 
@@ -254,11 +403,16 @@ uart_pty_init(
 		tcgetattr(m, &tio);
 		cfmakeraw(&tio);
 		tcsetattr(m, TCSANOW, &tio);
+		fcntl(m, F_SETFL, fcntl(m, F_GETFL) | O_NONBLOCK);
 		p->port[ti].s = m;
 		p->port[ti].tap = ti != 0;
 		p->port[ti].crlf = ti != 0;
 		printf("uart_pty_init %s on port *** %s ***\n",
 				ti == 0 ? "bridge" : "tap", p->port[ti].slavename);
+#ifdef __linux__
+		struct epoll_event pev = { .events = 0, .data.u32 = ti };
+		epoll_ctl(p->poll, EPOLL_CTL_ADD, m, &pev);
+#endif
 	}
 
 	pthread_create(&p->thread, NULL, uart_pty_thread, p);
@@ -270,12 +424,19 @@ uart_pty_stop(
 		uart_pty_t * p)
 {
 	puts(__func__);
-	pthread_kill(p->thread, SIGINT);
+	p->stop = 1;
+	uart_pty_ring(p);
+	void * ret;
+	pthread_join(p->thread, &ret);
 	for (int ti = 0; ti < 2; ti++)
 		if (p->port[ti].s)
 			close(p->port[ti].s);
-	void * ret;
-	pthread_join(p->thread, &ret);
+#ifdef __linux__
+	close(p->poll);
+#else
+	close(p->doorbell[1]);
+#endif
+	close(p->doorbell[0]);
 }
 
 void
@@ -296,6 +457,8 @@ uart_pty_connect(
 	if (src && dst) {
 		avr_connect_irq(src, p->irq + IRQ_UART_PTY_BYTE_IN);
 		avr_connect_irq(p->irq + IRQ_UART_PTY_BYTE_OUT, dst);
+		// pty bytes are pushed in bulk from now on, bypassing BYTE_OUT
+		p->uart = uart;
 	}
 	if (xon)
 		avr_irq_register_notify(xon, uart_pty_xon_hook, p);
@@ -25,6 +25,7 @@
 
 #include <pthread.h>
 #include "sim_irq.h"
+#include "sim_cycle_timers.h"
 #include "fifo_declare.h"
 
 enum {
@@ -33,16 +34,20 @@ enum {
 	IRQ_UART_PTY_COUNT
 };
 
-DECLARE_FIFO(uint8_t,uart_pty_fifo, 512);
+/*
+ * Both directions go through lock free, single producer/consumer fifos
+ * between the AVR thread and the I/O thread. They are filled and drained
+ * with bulk read()/write() from the I/O thread.
+ */
+DECLARE_FIFO(uint8_t,uart_pty_fifo, 16384);
 
 typedef struct uart_pty_port_t {
 	int			tap : 1, crlf : 1;
 	int 		s;			// socket we chat on
 	char 		slavename[64];
-	uart_pty_fifo_t in;
-	uart_pty_fifo_t out;
-	uint8_t		buffer[512];
-	size_t		buffer_len, buffer_done;
+	uint32_t	events;		// what the I/O thread currently waits for
+	uart_pty_fifo_t in;		// AVR -> pty
+	uart_pty_fifo_t out;	// pty -> AVR
 } uart_pty_port_t, *uart_pty_port_p;
 
 typedef struct uart_pty_t {
@@ -51,6 +56,13 @@ typedef struct uart_pty_t {
 
 	pthread_t	thread;
 	int			xon;
+	char		uart;		// the uart we are connected to, if any
+	volatile int stop;
+	volatile int waiting;	// I/O thread is, or is about to be, asleep
+
+	int			poll;		// epoll descriptor, on linux
+	int			doorbell[2];	// wakes up the I/O thread (eventfd, or pipe)
+	avr_cycle_count_t flush_interval;	// fallback timer, backs off when idle
 
 	union {
 		struct {
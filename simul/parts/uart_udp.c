@@ -19,17 +19,80 @@
 	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE		// recvmmsg()/sendmmsg()
+#endif
 #include <pthread.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <poll.h>
 
 #include "uart_udp.h"
 #include "avr_uart.h"
+#include "sim_time.h"
 #include "sim_hex.h"
 
-DEFINE_FIFO(uint8_t,uart_udp_fifo);
+DEFINE_FIFO(uart_udp_dgram_t,uart_udp_fifo);
+
+// datagrams moved per sendmmsg()/recvmmsg()
+#define UART_UDP_BATCH	16
+
+static inline uart_udp_dgram_t *
+uart_udp_slot(
+		uart_udp_fifo_t * f,
+		FIFO_CURSOR_TYPE cursor,
+		uint32_t o)
+{
+	return &f->buffer[(cursor + o) & (uart_udp_fifo_fifo_size - 1)];
+}
+
+// wake the I/O thread, if it's asleep
+static void
+uart_udp_kick(
+		uart_udp_t * p)
+{
+	__sync_synchronize();
+	if (p->waiting && __sync_bool_compare_and_swap(&p->waiting, 1, 0)) {
+		uint8_t one = 1;
+		// a full pipe means it's awake anyway
+		ssize_t r = write(p->doorbell[1], &one, 1);
+		(void)r;
+	}
+}
+
+// hand the datagram being filled to the I/O thread
+static void
+uart_udp_tx_close(
+		uart_udp_t * p)
+{
+	p->tx = NULL;
+	uart_udp_fifo_write_offset(&p->in, 1);
+	uart_udp_kick(p);
+}
+
+/*
+ * Runs once per datagram rather than once per byte; if bytes came in since
+ * it was armed, it just moves itself to the end of the new idle gap
+ */
+static avr_cycle_count_t
+uart_udp_tx_timer(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	uart_udp_t * p = (uart_udp_t*)param;
+	avr_cycle_count_t gap = avr_usec_to_cycles(avr, p->coalesce_usec);
+
+	if (!p->tx)
+		return 0;
+	if (p->tx->cycle + gap > when)
+		return p->tx->cycle + gap;
+	uart_udp_tx_close(p);
+	return 0;
+}
 
 /*
  * called when a byte is send via the uart on the AVR
@@ -37,8 +100,96 @@ DEFINE_FIFO(uint8_t,uart_udp_fifo);
 static void uart_udp_in_hook(struct avr_irq_t * irq, uint32_t value, void * param)
 {
 	uart_udp_t * p = (uart_udp_t*)param;
+	avr_t * avr = p->avr;
 //	printf("uart_udp_in_hook %02x\n", value);
-	uart_udp_fifo_write(&p->in, value);
+
+	if (!p->tx) {
+		if (uart_udp_fifo_isfull(&p->in)) {
+			if (!p->dropped++)
+				printf("UDP dropping bytes, network side is stalled\n");
+			return;
+		}
+		p->tx = uart_udp_slot(&p->in, p->in.write, 0);
+		p->tx->off = UART_UDP_STAMP_SIZE;
+		p->tx->len = 0;
+		if (p->stamp) {
+			uint64_t c = avr->cycle;
+			uint8_t * h = p->tx->data;
+			for (int i = 0; i < 4; i++)
+				h[i] = UART_UDP_STAMP_MAGIC >> (24 - (i * 8));
+			for (int i = 0; i < 8; i++)
+				h[4 + i] = c >> (56 - (i * 8));
+		}
+		avr_cycle_timer_register_usec(avr, p->coalesce_usec,
+				uart_udp_tx_timer, p);
+	}
+	p->tx->data[p->tx->off + p->tx->len++] = value;
+	p->tx->cycle = avr->cycle;	// of the last byte, for the idle gap
+	// a datagram holds that much at most, whatever was asked
+	uint16_t size = p->coalesce_size < UART_UDP_DGRAM_SIZE ?
+			p->coalesce_size : UART_UDP_DGRAM_SIZE;
+	if (p->tx->len >= size) {
+		avr_cycle_timer_cancel(avr, uart_udp_tx_timer, p);
+		uart_udp_tx_close(p);
+	}
+}
+
+static uint32_t
+uart_udp_push(
+		uart_udp_t * p,
+		const uint8_t * buf,
+		uint32_t len)
+{
+	if (p->uart) {
+		avr_uart_buf_t b = { .buf = buf, .len = len };
+		avr_ioctl(p->avr, AVR_IOCTL_UART_PUSH_BUF(p->uart), &b);
+		return b.done;
+	}
+	uint32_t done = 0;
+	while (p->xon && done < len)
+		avr_raise_irq(p->irq + IRQ_UART_UDP_BYTE_OUT, buf[done++]);
+	return done;
+}
+
+static avr_cycle_count_t uart_udp_rx_timer(
+		struct avr_t * avr, avr_cycle_count_t when, void * param);
+
+// try to empty our fifo, the uart_udp_xoff_hook() will be called when
+// other side is full
+static void
+uart_udp_flush_incoming(
+		uart_udp_t * p)
+{
+	avr_t * avr = p->avr;
+	int consumed = 0;
+
+	while (p->xon && !uart_udp_fifo_isempty(&p->out)) {
+		uart_udp_dgram_t * d = uart_udp_slot(&p->out, p->out.read, 0);
+		if (d->cycle > avr->cycle) {
+			avr_cycle_timer_register(avr, d->cycle - avr->cycle,
+					uart_udp_rx_timer, p);
+			break;
+		}
+		p->rx_done += uart_udp_push(p, d->data + d->off + p->rx_done,
+				d->len - p->rx_done);
+		if (p->rx_done < d->len)
+			break;
+		p->rx_done = 0;
+		uart_udp_fifo_read_offset(&p->out, 1);
+		consumed++;
+	}
+	if (consumed)
+		uart_udp_kick(p);
+}
+
+static avr_cycle_count_t
+uart_udp_rx_timer(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	uart_udp_flush_incoming((uart_udp_t*)param);
+	return 0;
 }
 
 /*
@@ -51,13 +202,7 @@ static void uart_udp_xon_hook(struct avr_irq_t * irq, uint32_t value, void * par
 //	if (!p->xon)
 //		printf("uart_udp_xon_hook\n");
 	p->xon = 1;
-	// try to empty our fifo, the uart_udp_xoff_hook() will be called when
-	// other side is full
-	while (p->xon && !uart_udp_fifo_isempty(&p->out)) {
-		uint8_t byte = uart_udp_fifo_read(&p->out);
-	//	printf("uart_udp_xon_hook send %02x\n", byte);
-		avr_raise_irq(p->irq + IRQ_UART_UDP_BYTE_OUT, byte);
-	}
+	uart_udp_flush_incoming(p);
 }
 
 /*
@@ -71,51 +216,141 @@ static void uart_udp_xoff_hook(struct avr_irq_t * irq, uint32_t value, void * pa
 	p->xon = 0;
 }
 
-static void * uart_udp_thread(void * param)
+// parse the cycle stamp, if there is one
+static void
+uart_udp_rx_parse(
+		uart_udp_t * p,
+		uart_udp_dgram_t * d,
+		size_t len)
 {
-	uart_udp_t * p = (uart_udp_t*)param;
-
-	while (1) {
-		fd_set read_set, write_set;
-		int max = p->s + 1;
-		FD_ZERO(&read_set);
-		FD_ZERO(&write_set);
-
-		FD_SET(p->s, &read_set);
-		if (!uart_udp_fifo_isempty(&p->in))
-			FD_SET(p->s, &write_set);
-
-		struct timeval timo = { 0, 500 };	// short, but not too short interval
-		int ret = select(max, &read_set, &write_set, NULL, &timo);
-
-		if (!ret)
-			continue;
-
-		if (FD_ISSET(p->s, &read_set)) {
-			uint8_t buffer[512];
+	const uint8_t * h = d->data;
+	uint32_t magic = 0;
+	d->cycle = 0;
+	d->off = 0;
+	d->len = len;
+	if (!p->stamp || len < UART_UDP_STAMP_SIZE)
+		return;
+	for (int i = 0; i < 4; i++)
+		magic = (magic << 8) | h[i];
+	if (magic != UART_UDP_STAMP_MAGIC)
+		return;
+	for (int i = 0; i < 8; i++)
+		d->cycle = (d->cycle << 8) | h[4 + i];
+	d->off = UART_UDP_STAMP_SIZE;
+	d->len = len - UART_UDP_STAMP_SIZE;
+}
 
+// read as many datagrams as there are free slots, straight into them
+static void
+uart_udp_recv(
+		uart_udp_t * p)
+{
+	while (!uart_udp_fifo_isfull(&p->out)) {
+		uint32_t count = uart_udp_fifo_get_write_size(&p->out);
+		if (count > UART_UDP_BATCH)
+			count = UART_UDP_BATCH;
+#ifdef __linux__
+		struct mmsghdr msg[UART_UDP_BATCH];
+		struct iovec iov[UART_UDP_BATCH];
+		struct sockaddr_in from[UART_UDP_BATCH];
+		memset(msg, 0, count * sizeof(msg[0]));
+		for (uint32_t i = 0; i < count; i++) {
+			uart_udp_dgram_t * d = uart_udp_slot(&p->out, p->out.write, i);
+			iov[i].iov_base = d->data;
+			iov[i].iov_len = sizeof(d->data);
+			msg[i].msg_hdr.msg_iov = &iov[i];
+			msg[i].msg_hdr.msg_iovlen = 1;
+			msg[i].msg_hdr.msg_name = &from[i];
+			msg[i].msg_hdr.msg_namelen = sizeof(from[i]);
+		}
+		int r = recvmmsg(p->s, msg, count, MSG_DONTWAIT, NULL);
+		if (r <= 0)
+			return;
+		for (int i = 0; i < r; i++)
+			uart_udp_rx_parse(p, uart_udp_slot(&p->out, p->out.write, i),
+					msg[i].msg_len);
+		p->peer = from[r - 1];
+#else
+		int r = 0;
+		while (r < count) {
+			uart_udp_dgram_t * d = uart_udp_slot(&p->out, p->out.write, r);
 			socklen_t len = sizeof(p->peer);
-			ssize_t r = recvfrom(p->s, buffer, sizeof(buffer)-1, 0, (struct sockaddr*)&p->peer, &len);
-
-		//	hdump("udp recv", buffer, r);
+			ssize_t got = recvfrom(p->s, d->data, sizeof(d->data), MSG_DONTWAIT,
+					(struct sockaddr*)&p->peer, &len);
+			if (got < 0)
+				break;
+			uart_udp_rx_parse(p, d, got);
+			r++;
+		}
+		if (!r)
+			return;
+#endif
+	//	hdump("udp recv", ...);
+		uart_udp_fifo_write_offset(&p->out, r);
+	}
+}
 
-			// write them in fifo
-			uint8_t * src = buffer;
-			while (r-- && !uart_udp_fifo_isfull(&p->out))
-				uart_udp_fifo_write(&p->out, *src++);
-			if (r > 0)
-				printf("UDP dropped %zu bytes\n", r);
+static void
+uart_udp_send(
+		uart_udp_t * p)
+{
+	while (!uart_udp_fifo_isempty(&p->in)) {
+		uint32_t count = uart_udp_fifo_get_read_size(&p->in);
+		if (count > UART_UDP_BATCH)
+			count = UART_UDP_BATCH;
+		int hdr = p->stamp ? UART_UDP_STAMP_SIZE : 0;
+#ifdef __linux__
+		struct mmsghdr msg[UART_UDP_BATCH];
+		struct iovec iov[UART_UDP_BATCH];
+		memset(msg, 0, count * sizeof(msg[0]));
+		for (uint32_t i = 0; i < count; i++) {
+			uart_udp_dgram_t * d = uart_udp_slot(&p->in, p->in.read, i);
+			iov[i].iov_base = d->data + d->off - hdr;
+			iov[i].iov_len = d->len + hdr;
+			msg[i].msg_hdr.msg_iov = &iov[i];
+			msg[i].msg_hdr.msg_iovlen = 1;
+			msg[i].msg_hdr.msg_name = &p->peer;
+			msg[i].msg_hdr.msg_namelen = sizeof(p->peer);
 		}
-		if (FD_ISSET(p->s, &write_set)) {
-			uint8_t buffer[512];
-			// write them in fifo
-			uint8_t * dst = buffer;
-			while (!uart_udp_fifo_isempty(&p->in) && dst < (buffer+sizeof(buffer)))
-				*dst++ = uart_udp_fifo_read(&p->in);
-			socklen_t len = dst - buffer;
-			/*size_t r = */sendto(p->s, buffer, len, 0, (struct sockaddr*)&p->peer, sizeof(p->peer));
-		//	hdump("udp send", buffer, r);
+		int r = sendmmsg(p->s, msg, count, MSG_DONTWAIT);
+#else
+		int r = 0;
+		while (r < count) {
+			uart_udp_dgram_t * d = uart_udp_slot(&p->in, p->in.read, r);
+			if (sendto(p->s, d->data + d->off - hdr, d->len + hdr, MSG_DONTWAIT,
+					(struct sockaddr*)&p->peer, sizeof(p->peer)) < 0)
+				break;
+			r++;
 		}
+#endif
+		if (r <= 0)
+			return;
+	//	hdump("udp send", ...);
+		uart_udp_fifo_read_offset(&p->in, r);
+	}
+}
+
+static void * uart_udp_thread(void * param)
+{
+	uart_udp_t * p = (uart_udp_t*)param;
+
+	while (!p->stop) {
+		p->waiting = 1;
+		__sync_synchronize();
+		struct pollfd fds[2] = {
+			{ .fd = p->s, .events =
+				(uart_udp_fifo_isfull(&p->out) ? 0 : POLLIN) |
+				(uart_udp_fifo_isempty(&p->in) ? 0 : POLLOUT) },
+			{ .fd = p->doorbell[0], .events = POLLIN },
+		};
+		if (poll(fds, 2, -1) < 0 && errno != EINTR)
+			break;
+		p->waiting = 0;
+		uint8_t drain[64];
+		while (read(p->doorbell[0], drain, sizeof(drain)) > 0)
+			;
+		uart_udp_recv(p);
+		uart_udp_send(p);
 	}
 	return NULL;
 }
@@ -127,6 +362,7 @@ static const char * irq_names[IRQ_UART_UDP_COUNT] = {
 
 void uart_udp_init(struct avr_t * avr, uart_udp_t * p)
 {
+	memset(p, 0, sizeof(*p));
 	p->avr = avr;
 	p->irq = avr_alloc_irq(&avr->irq_pool, 0, IRQ_UART_UDP_COUNT, irq_names);
 	avr_irq_register_notify(p->irq + IRQ_UART_UDP_BYTE_IN, uart_udp_in_hook, p);
@@ -147,6 +383,15 @@ void uart_udp_init(struct avr_t * avr, uart_udp_t * p)
 
 	printf("uart_udp_init bridge on port %d\n", 4321);
 
+	p->coalesce_usec = 1000;
+	p->coalesce_size = UART_UDP_DGRAM_SIZE;
+	if (pipe(p->doorbell)) {
+		fprintf(stderr, "%s: Can't create pipe: %s", __FUNCTION__, strerror(errno));
+		return ;
+	}
+	fcntl(p->doorbell[0], F_SETFL, O_NONBLOCK);
+	fcntl(p->doorbell[1], F_SETFL, O_NONBLOCK);
+
 	pthread_create(&p->thread, NULL, uart_udp_thread, p);
 
 }
@@ -166,6 +411,8 @@ void uart_udp_connect(uart_udp_t * p, char uart)
 	if (src && dst) {
 		avr_connect_irq(src, p->irq + IRQ_UART_UDP_BYTE_IN);
 		avr_connect_irq(p->irq + IRQ_UART_UDP_BYTE_OUT, dst);
+		// received bytes are pushed in bulk from now on, bypassing BYTE_OUT
+		p->uart = uart;
 	}
 	if (xon)
 		avr_irq_register_notify(xon, uart_udp_xon_hook, p);
@@ -173,3 +420,14 @@ void uart_udp_connect(uart_udp_t * p, char uart)
 		avr_irq_register_notify(xoff, uart_udp_xoff_hook, p);
 }
 
+void uart_udp_stop(uart_udp_t * p)
+{
+	p->stop = 1;
+	p->waiting = 1;
+	uart_udp_kick(p);
+	void * ret;
+	pthread_join(p->thread, &ret);
+	close(p->s);
+	close(p->doorbell[0]);
+	close(p->doorbell[1]);
+}
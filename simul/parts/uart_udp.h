@@ -25,6 +25,7 @@
 
 #include "sim_network.h"
 #include "sim_irq.h"
+#include "sim_cycle_timers.h"
 #include "fifo_declare.h"
 
 enum {
@@ -33,7 +34,29 @@ enum {
 	IRQ_UART_UDP_COUNT
 };
 
-DECLARE_FIFO(uint8_t,uart_udp_fifo, 512);
+/*
+ * Bytes sent by the AVR are coalesced into datagrams; one goes out once
+ * 'coalesce_size' bytes are pending, UART_UDP_DGRAM_SIZE at most whatever
+ * it's set to, or the uart was quiet for 'coalesce_usec'. The I/O thread
+ * sends and receives them in batches.
+ *
+ * With 'stamp' set, each datagram starts with a UART_UDP_STAMP_SIZE header;
+ * the UART_UDP_STAMP_MAGIC, then the cycle the first byte was sent on,
+ * both big endian. Received datagrams that have one are not delivered to
+ * the AVR before that cycle, so simulated nodes started together keep
+ * their timing. Datagrams without it are delivered as soon as possible.
+ */
+#define UART_UDP_DGRAM_SIZE		512
+#define UART_UDP_STAMP_SIZE		12
+#define UART_UDP_STAMP_MAGIC	0x41565263	// 'AVRc'
+
+typedef struct uart_udp_dgram_t {
+	uint64_t	cycle;		// when to deliver, if stamped
+	uint16_t	off, len;	// payload, in data[]
+	uint8_t		data[UART_UDP_STAMP_SIZE + UART_UDP_DGRAM_SIZE];
+} uart_udp_dgram_t;
+
+DECLARE_FIFO(uart_udp_dgram_t,uart_udp_fifo, 64);
 
 typedef struct uart_udp_t {
 	avr_irq_t *	irq;		// irq list
@@ -42,14 +65,27 @@ typedef struct uart_udp_t {
 	pthread_t	thread;
 	int 		s;			// socket we chat on
 	struct sockaddr_in peer;
+	int			doorbell[2];	// pipe, wakes up the I/O thread
+	volatile int waiting;	// I/O thread is, or is about to be, asleep
+	volatile int stop;
 
 	int			xon;
-	uart_udp_fifo_t in;
-	uart_udp_fifo_t out;
+	char		uart;		// the uart we are connected to, if any
+	int			stamp;		// send, and honor, cycle stamps
+	uint32_t	coalesce_usec;
+	uint16_t	coalesce_size;
+	uart_udp_dgram_t * tx;	// datagram being filled, if any
+	uint16_t	rx_done;	// bytes of the head 'out' datagram delivered
+	uint32_t	dropped;
+
+	uart_udp_fifo_t in;		// AVR -> network
+	uart_udp_fifo_t out;	// network -> AVR
 } uart_udp_t;
 
 void uart_udp_init(struct avr_t * avr, uart_udp_t * b);
 
 void uart_udp_connect(uart_udp_t * p, char uart);
 
+void uart_udp_stop(uart_udp_t * p);
+
 #endif /* __UART_UDP_H___ */
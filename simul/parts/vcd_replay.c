@@ -0,0 +1,317 @@
+/*
+	vcd_replay.c
+
+	Copyright 2016, Fernando Vicente <fvicente@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <zlib.h>
+#include "sim_avr.h"
+#include "vcd_replay.h"
+
+static int
+vcd_replay_getc(
+		vcd_replay_t * r)
+{
+	if (r->pos == r->len) {
+		int n = r->eof ? 0 : gzread((gzFile)r->file, r->buf, sizeof(r->buf));
+		if (n <= 0) {
+			r->eof = 1;
+			return EOF;
+		}
+		r->len = n;
+		r->pos = 0;
+	}
+	return (uint8_t)r->buf[r->pos++];
+}
+
+/*
+ * Next blank separated word, returns its whole length, zero at the end;
+ * only what fits in 'tok' is kept
+ */
+static int
+vcd_replay_token(
+		vcd_replay_t * r,
+		char * tok,
+		int size)
+{
+	int c, l = 0;
+
+	do
+		c = vcd_replay_getc(r);
+	while (c != EOF && isspace(c));
+	while (c != EOF && !isspace(c)) {
+		if (l < size - 1)
+			tok[l] = c;
+		l++;
+		c = vcd_replay_getc(r);
+	}
+	tok[l < size ? l : size - 1] = 0;
+	return l;
+}
+
+static void
+vcd_replay_skip(
+		vcd_replay_t * r)
+{
+	char tok[64];
+	while (vcd_replay_token(r, tok, sizeof(tok)) && strcmp(tok, "$end"))
+		;
+}
+
+static int
+vcd_replay_find(
+		vcd_replay_t * r,
+		const char * id)
+{
+	for (int i = 0; i < r->signal_count; i++)
+		if (!strcmp(r->signal[i].id, id))
+			return i;
+	return -1;
+}
+
+// "1ns", or "10 us" in two words
+static void
+vcd_replay_timescale(
+		vcd_replay_t * r)
+{
+	static const struct {
+		const char * name;
+		double unit;
+	} units[] = {
+		{ "s", 1 }, { "ms", 1e-3 }, { "us", 1e-6 },
+		{ "ns", 1e-9 }, { "ps", 1e-12 }, { "fs", 1e-15 },
+	};
+	char tok[64], ts[64] = "";
+
+	while (vcd_replay_token(r, tok, sizeof(tok)) && strcmp(tok, "$end"))
+		strncat(ts, tok, sizeof(ts) - strlen(ts) - 1);
+	char * u;
+	double n = strtod(ts, &u);
+	for (int i = 0; i < sizeof(units) / sizeof(units[0]); i++)
+		if (!strcmp(u, units[i].name))
+			r->unit = n * units[i].unit;
+}
+
+static int
+vcd_replay_header(
+		vcd_replay_t * r)
+{
+	char tok[64];
+
+	r->unit = 1e-9;
+	while (vcd_replay_token(r, tok, sizeof(tok))) {
+		if (!strcmp(tok, "$enddefinitions")) {
+			vcd_replay_skip(r);
+			return 0;
+		} else if (!strcmp(tok, "$timescale")) {
+			vcd_replay_timescale(r);
+		} else if (!strcmp(tok, "$var")) {
+			char size[16];
+			vcd_replay_token(r, tok, sizeof(tok));	// type
+			vcd_replay_token(r, size, sizeof(size));
+			if (r->signal_count == VCD_REPLAY_MAX_SIGNALS) {
+				AVR_LOG(r->avr, LOG_WARNING, "VCD_REPLAY: %s: too many signals\n",
+						__func__);
+				vcd_replay_skip(r);
+				continue;
+			}
+			vcd_replay_signal_t * s = &r->signal[r->signal_count];
+			s->size = atoi(size);
+			if (vcd_replay_token(r, s->id, sizeof(s->id)) >= sizeof(s->id)) {
+				AVR_LOG(r->avr, LOG_WARNING, "VCD_REPLAY: %s: identifier too long\n",
+						__func__);
+				vcd_replay_skip(r);
+				continue;
+			}
+			r->signal_count++;
+			vcd_replay_token(r, s->name, sizeof(s->name));
+			vcd_replay_skip(r);	// a bit range maybe
+		} else if (tok[0] == '$' && strcmp(tok, "$end"))
+			vcd_replay_skip(r);	// $scope, $comment, $date...
+	}
+	return -1;
+}
+
+/*
+ * Reads the next batch of changes, returns how many. Times are rounded
+ * to the nearest cycle
+ */
+static uint32_t
+vcd_replay_fill(
+		vcd_replay_t * r)
+{
+	char tok[128], id[VCD_REPLAY_ID_SIZE];
+
+	r->head = r->count = 0;
+	while (r->count < VCD_REPLAY_BATCH && vcd_replay_token(r, tok, sizeof(tok))) {
+		uint32_t value;
+		switch (tok[0]) {
+			case '#':
+				r->now = r->start +
+						(avr_cycle_count_t)(strtoull(tok + 1, NULL, 10) * r->scale + 0.5);
+				continue;
+			case '$':
+				// the values in $dumpvars are changes like the others
+				if (!strcmp(tok, "$comment"))
+					vcd_replay_skip(r);
+				continue;
+			case '0':
+			case '1':
+				value = tok[0] - '0';
+				// too long, it's none of ours
+				if (snprintf(id, sizeof(id), "%s", tok + 1) >= sizeof(id))
+					continue;
+				break;
+			case 'b':
+			case 'B': {
+				// the last 32 bits, 'x' and 'z' as 0, unless they all are
+				const char * b = tok + 1;
+				if (!b[strcspn(b, "01")]) {
+					vcd_replay_token(r, id, sizeof(id));
+					continue;
+				}
+				int l = strlen(b);
+				if (l > 32)
+					b += l - 32;
+				value = 0;
+				while (*b)
+					value = (value << 1) | (*b++ == '1');
+				if (vcd_replay_token(r, id, sizeof(id)) >= sizeof(id))
+					continue;
+			}	break;
+			case 'r':
+			case 'R':
+				value = (uint32_t)strtod(tok + 1, NULL);
+				if (vcd_replay_token(r, id, sizeof(id)) >= sizeof(id))
+					continue;
+				break;
+			default:	// 'x' and 'z' scalars
+				continue;
+		}
+		int s = vcd_replay_find(r, id);
+		if (s < 0)
+			continue;
+		vcd_replay_change_t * c = &r->batch[r->count++];
+		c->when = r->now;
+		c->signal = s;
+		c->value = value;
+	}
+	return r->count;
+}
+
+/*
+ * Raises all the changes that are due, and comes back at the next
+ * timestamp, reading more as needed
+ */
+static avr_cycle_count_t
+vcd_replay_timer(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	vcd_replay_t * r = (vcd_replay_t *)param;
+
+	for (;;) {
+		if (r->head == r->count && !vcd_replay_fill(r))
+			return 0;
+		vcd_replay_change_t * c = &r->batch[r->head];
+		if (c->when > when)
+			return c->when;
+		avr_raise_irq(r->irq + c->signal, c->value);
+		r->head++;
+	}
+}
+
+int
+vcd_replay_init(
+		struct avr_t * avr,
+		vcd_replay_t * r,
+		const char * filename)
+{
+	memset(r, 0, sizeof(*r));
+	r->avr = avr;
+	r->file = gzopen(filename, "rb");
+	if (!r->file) {
+		AVR_LOG(avr, LOG_ERROR, "VCD_REPLAY: %s: can't open '%s'\n",
+				__func__, filename);
+		return -1;
+	}
+	if (vcd_replay_header(r) || !r->signal_count) {
+		AVR_LOG(avr, LOG_ERROR, "VCD_REPLAY: %s: '%s' has no signals\n",
+				__func__, filename);
+		gzclose((gzFile)r->file);
+		r->file = NULL;
+		return -1;
+	}
+	char names[VCD_REPLAY_MAX_SIGNALS][48];
+	const char * np[VCD_REPLAY_MAX_SIGNALS];
+	for (int i = 0; i < r->signal_count; i++) {
+		vcd_replay_signal_t * s = &r->signal[i];
+		if (s->size > 1)
+			snprintf(names[i], sizeof(names[i]), "%d>replay.%s", s->size, s->name);
+		else
+			snprintf(names[i], sizeof(names[i]), ">replay.%s", s->name);
+		np[i] = names[i];
+	}
+	r->irq = avr_alloc_irq(&avr->irq_pool, 0, r->signal_count, np);
+	return 0;
+}
+
+avr_irq_t *
+vcd_replay_get_irq(
+		vcd_replay_t * r,
+		const char * name)
+{
+	for (int i = 0; i < r->signal_count; i++)
+		if (!strcmp(r->signal[i].name, name))
+			return r->irq + i;
+	return NULL;
+}
+
+void
+vcd_replay_start(
+		vcd_replay_t * r)
+{
+	avr_t * avr = r->avr;
+
+	r->start = r->now = avr->cycle;
+	r->scale = r->unit * avr->frequency;
+	if (!vcd_replay_fill(r))
+		return;
+	avr_cycle_count_t next = r->batch[0].when;
+	avr_cycle_timer_register(avr,
+			next > avr->cycle ? next - avr->cycle : 0,
+			vcd_replay_timer, r);
+}
+
+void
+vcd_replay_dispose(
+		vcd_replay_t * r)
+{
+	avr_cycle_timer_cancel(r->avr, vcd_replay_timer, r);
+	if (r->file)
+		gzclose((gzFile)r->file);
+	r->file = NULL;
+	if (r->irq)
+		avr_free_irq(r->irq, r->signal_count);
+	r->irq = NULL;
+}
@@ -0,0 +1,105 @@
+/*
+	vcd_replay.h
+
+	Copyright 2016, Fernando Vicente <fvicente@gmail.com>
+
+	Replays a VCD file as stimulus: each signal of the file gets an
+	output IRQ, raised with the recorded values at the recorded times,
+	VCD time zero being when vcd_replay_start() is called. Captures of
+	a real logic analyzer (the button bounce of the actual board) can so
+	drive the firmware, at full simulation speed.
+
+	The file is read as it goes, a batch of changes at a time, from a
+	single cycle timer that fires once per timestamp. Gzip compressed
+	files, like the ones avr_vcd_start() writes for a ".gz" name, are
+	read as is.
+
+	Values are up to 32 bits. An unknown value, 'x' or 'z', leaves the
+	IRQ as it was; in a vector with known bits they read as 0. Real
+	values are rounded down, millivolts for an ADC input say.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __VCD_REPLAY_H__
+#define __VCD_REPLAY_H__
+
+#include "sim_irq.h"
+#include "sim_cycle_timers.h"
+
+#define VCD_REPLAY_MAX_SIGNALS	32
+#define VCD_REPLAY_BATCH		256	// changes read at once
+#define VCD_REPLAY_ID_SIZE		16	// longest identifier code, and its zero
+
+typedef struct vcd_replay_signal_t {
+	char		id[VCD_REPLAY_ID_SIZE];	// VCD identifier code
+	char		name[32];
+	int			size;		// in bits
+} vcd_replay_signal_t;
+
+typedef struct vcd_replay_change_t {
+	avr_cycle_count_t	when;
+	uint32_t	value;
+	uint8_t		signal;
+} vcd_replay_change_t;
+
+typedef struct vcd_replay_t {
+	avr_irq_t *	irq;		// one per signal, in the order of the file
+	struct avr_t * avr;
+
+	void *		file;		// gzFile
+	char		buf[4096];	// read ahead
+	uint32_t	pos, len;
+	int			eof;
+
+	double		unit;		// timescale, in seconds
+	double		scale;		// cycles per unit
+	avr_cycle_count_t	start;
+	avr_cycle_count_t	now;	// last timestamp read
+
+	int			signal_count;
+	vcd_replay_signal_t	signal[VCD_REPLAY_MAX_SIGNALS];
+
+	vcd_replay_change_t	batch[VCD_REPLAY_BATCH];
+	uint32_t	head, count;
+} vcd_replay_t;
+
+/*
+ * Reads the header of 'filename', and allocates the IRQs. Returns 0, or
+ * -1 if it's not a VCD file that can be read
+ */
+int
+vcd_replay_init(
+		struct avr_t * avr,
+		vcd_replay_t * r,
+		const char * filename);
+
+// output IRQ of the signal called 'name' in the file, or NULL
+avr_irq_t *
+vcd_replay_get_irq(
+		vcd_replay_t * r,
+		const char * name);
+
+// VCD time zero is now
+void
+vcd_replay_start(
+		vcd_replay_t * r);
+
+void
+vcd_replay_dispose(
+		vcd_replay_t * r);
+
+#endif /* __VCD_REPLAY_H__ */
@@ -40,9 +40,90 @@
 #include <errno.h>
 #include <unistd.h>
 #include <assert.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 #include "avr_usb.h"
 
+/*
+ * How long to wait for the AVR before trying again anyway, in case it
+ * changed something that doesn't ring the doorbell
+ */
+#define VHCI_USB_RETRY_MS	50
+
+/*
+ * Wakes the USB thread if it's waiting on the AVR; it sets 'waiting'
+ * before trying, so a change made right after a NAK is never missed
+ */
+static void
+vhci_usb_kick(
+		struct vhci_usb_t * p)
+{
+	uint64_t one = 1;
+
+	__sync_synchronize();
+	if (p->waiting && __sync_bool_compare_and_swap(&p->waiting, 1, 0)) {
+		ssize_t r = write(p->doorbell, &one, sizeof(one));
+		(void)r;
+	}
+}
+
+enum {
+	VHCI_USB_WAKE_AVR = 1 << 0,
+	VHCI_USB_WAKE_HOST = 1 << 1,
+};
+
+/*
+ * Sleeps until the doorbell rings or, when 'host' is set, the VHCI has
+ * work for us. 'waiting' must have been set before checking on the AVR.
+ */
+static int
+vhci_usb_wait(
+		struct vhci_usb_t * p,
+		bool host)
+{
+	struct pollfd fds[2] = {
+		{ .fd = p->doorbell, .events = POLLIN },
+		{ .fd = p->fd, .events = POLLIN },
+	};
+	int wake = 0;
+
+	if (poll(fds, host ? 2 : 1, host ? -1 : VHCI_USB_RETRY_MS) > 0) {
+		if (fds[0].revents & POLLIN) {
+			uint64_t drain;
+			ssize_t r = read(p->doorbell, &drain, sizeof(drain));
+			(void)r;
+			wake |= VHCI_USB_WAKE_AVR;
+		}
+		if (host && fds[1].revents)
+			wake |= VHCI_USB_WAKE_HOST;
+	}
+	p->waiting = 0;
+	return wake;
+}
+
+/*
+ * Passes a transfer to the AVR, and as long as it NAKs, sleeps until the
+ * firmware does something about its endpoints
+ */
+static int
+vhci_usb_avr_ioctl(
+		struct vhci_usb_t * p,
+		uint32_t ctl,
+		struct avr_io_usb * pkt)
+{
+	for (;;) {
+		p->waiting = 1;
+		__sync_synchronize();
+		int ret = avr_ioctl(p->avr, ctl, pkt);
+		if (ret != AVR_IOCTL_USB_NAK) {
+			p->waiting = 0;
+			return ret;
+		}
+		vhci_usb_wait(p, false);
+	}
+}
+
 static void
 vhci_usb_attach_hook(
         struct avr_irq_t * irq,
@@ -52,6 +133,16 @@ vhci_usb_attach_hook(
 	struct vhci_usb_t * p = (struct vhci_usb_t*) param;
 	p->attached = !!value;
 	printf("avr attached: %d\n", p->attached);
+	vhci_usb_kick(p);
+}
+
+static void
+vhci_usb_ep_hook(
+        struct avr_irq_t * irq,
+        uint32_t value,
+        void * param)
+{
+	vhci_usb_kick((struct vhci_usb_t*) param);
 }
 
 struct usbsetup {
@@ -85,18 +176,12 @@ control_read(
 	struct avr_io_usb pkt =
 		{ ep->epnum, sizeof(struct usbsetup), (uint8_t*) &buf };
 
-	avr_ioctl(p->avr, AVR_IOCTL_USB_SETUP, &pkt);
+	vhci_usb_avr_ioctl(p, AVR_IOCTL_USB_SETUP, &pkt);
 
 	pkt.sz = wLength;
 	pkt.buf = data;
 	while (wLength) {
-		usleep(1000);
-		ret = avr_ioctl(p->avr, AVR_IOCTL_USB_READ, &pkt);
-		if (ret == AVR_IOCTL_USB_NAK) {
-			printf(" NAK\n");
-			usleep(50000);
-			continue;
-		}
+		ret = vhci_usb_avr_ioctl(p, AVR_IOCTL_USB_READ, &pkt);
 		if (ret == AVR_IOCTL_USB_STALL) {
 			printf(" STALL\n");
 			return ret;
@@ -110,12 +195,8 @@ control_read(
 	}
 	wLength = pkt.buf - data;
 
-	usleep(1000);
 	pkt.sz = 0;
-	while ((ret = avr_ioctl(p->avr, AVR_IOCTL_USB_WRITE, &pkt))
-	        == AVR_IOCTL_USB_NAK) {
-		usleep(50000);
-	}
+	ret = vhci_usb_avr_ioctl(p, AVR_IOCTL_USB_WRITE, &pkt);
 	assert(ret==0);
 	return wLength;
 }
@@ -138,17 +219,13 @@ control_write(
 	struct avr_io_usb pkt =
 		{ ep->epnum, sizeof(struct usbsetup), (uint8_t*) &buf };
 
-	avr_ioctl(p->avr, AVR_IOCTL_USB_SETUP, &pkt);
-	usleep(10000);
+	vhci_usb_avr_ioctl(p, AVR_IOCTL_USB_SETUP, &pkt);
 
 	if (wLength > 0) {
 		pkt.sz = (wLength > ep->epsz ? ep->epsz : wLength);
 		pkt.buf = data;
-		while ((ret = avr_ioctl(p->avr, AVR_IOCTL_USB_WRITE, &pkt)) != 0) {
-			if (ret == AVR_IOCTL_USB_NAK) {
-				usleep(50000);
-				continue;
-			}
+		for (;;) {
+			ret = vhci_usb_avr_ioctl(p, AVR_IOCTL_USB_WRITE, &pkt);
 			if (ret == AVR_IOCTL_USB_STALL) {
 				printf(" STALL\n");
 				return ret;
@@ -158,16 +235,14 @@ control_write(
 				break;
 			pkt.buf += pkt.sz;
 			wLength -= pkt.sz;
+			if (!wLength)
+				break;
 			pkt.sz = (wLength > ep->epsz ? ep->epsz : wLength);
 		}
 	}
 
 	pkt.sz = 0;
-	while ((ret = avr_ioctl(p->avr, AVR_IOCTL_USB_READ, &pkt))
-	        == AVR_IOCTL_USB_NAK) {
-		usleep(50000);
-	}
-	return ret;
+	return vhci_usb_avr_ioctl(p, AVR_IOCTL_USB_READ, &pkt);
 }
 
 static void
@@ -197,8 +272,11 @@ handle_status_change(
 	}
 	if (~prev->status & USB_VHCI_PORT_STAT_RESET
 	        && curr->status & USB_VHCI_PORT_STAT_RESET) {
+		// give the firmware a chance to set ep0 up again
+		p->waiting = 1;
+		__sync_synchronize();
 		avr_ioctl(p->avr, AVR_IOCTL_USB_RESET, NULL);
-		usleep(50000);
+		vhci_usb_wait(p, false);
 		if (curr->status & USB_VHCI_PORT_STAT_CONNECTION) {
 			if (usb_vhci_port_reset_done(p->fd, 1, 1) < 0) {
 				perror("reset_done");
@@ -301,8 +379,8 @@ vhci_usb_thread(
 	for (unsigned cycle = 0;; cycle++) {
 		struct usb_vhci_work wrk;
 
-		int res = usb_vhci_fetch_work(p->fd, &wrk);
-
+		p->waiting = 1;
+		__sync_synchronize();
 		if (p->attached != avrattached) {
 			if (p->attached && port_status.status & USB_VHCI_PORT_STAT_POWER) {
 				if (usb_vhci_port_connect(p->fd, 1, USB_VHCI_DATA_RATE_FULL)
@@ -317,7 +395,11 @@ vhci_usb_thread(
 			}
 			avrattached = p->attached;
 		}
+		// sleep until the host has work, or the AVR attaches/detaches
+		if (!(vhci_usb_wait(p, true) & VHCI_USB_WAKE_HOST))
+			continue;
 
+		int res = usb_vhci_fetch_work(p->fd, &wrk);
 		if (res < 0) {
 			if (errno == ETIMEDOUT || errno == EINTR || errno == ENODATA)
 				continue;
@@ -398,6 +480,13 @@ vhci_usb_init(
 	p->avr = avr;
 	pthread_t thread;
 
+	p->waiting = 0;
+	p->doorbell = eventfd(0, EFD_NONBLOCK);
+	if (p->doorbell < 0) {
+		perror("eventfd");
+		abort();
+	}
+
 	pthread_create(&thread, NULL, vhci_usb_thread, p);
 
 }
@@ -410,5 +499,7 @@ vhci_usb_connect(
 	avr_irq_t * t = avr_io_getirq(p->avr, AVR_IOCTL_USB_GETIRQ(),
 	        USB_IRQ_ATTACH);
 	avr_irq_register_notify(t, vhci_usb_attach_hook, p);
+	t = avr_io_getirq(p->avr, AVR_IOCTL_USB_GETIRQ(), USB_IRQ_EP_UPDATE);
+	avr_irq_register_notify(t, vhci_usb_ep_hook, p);
 }
 
@@ -27,6 +27,8 @@ typedef struct vhci_usb_t {
 
     bool attached;
     int fd;
+    int doorbell;		// eventfd, rung by the simulation thread
+    volatile int waiting;	// the USB thread waits for the doorbell
 } vhci_usb_t;
 
 
@@ -22,9 +22,102 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef __MINGW32__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include "sim_time.h"
 #include "avr_adc.h"
 
+// per channel state of the analog sources, see AVR_IOCTL_ADC_SET_SOURCE
+typedef struct avr_adc_stream_t {
+	avr_adc_generator_t	generator;
+	void *				param;
+	const avr_adc_sample_t * samples;
+	uint32_t			count;
+	uint32_t			cursor;		// last sample used
+	void *				map;		// if the samples were mmap()ed
+	size_t				map_size;
+} avr_adc_stream_t;
+
+static void
+avr_adc_stream_release(
+		avr_adc_stream_t * s)
+{
+#ifndef __MINGW32__
+	if (s->map)
+		munmap(s->map, s->map_size);
+#endif
+	memset(s, 0, sizeof(*s));
+}
+
+/*
+ * Find the last sample at or before 'usec'. Conversions mostly move forward
+ * in time, so start from the previous one, and bisect if it's not the next.
+ */
+static uint32_t
+avr_adc_stream_seek(
+		avr_adc_stream_t * s,
+		uint64_t usec)
+{
+	const avr_adc_sample_t * t = s->samples;
+	uint32_t i = s->cursor < s->count ? s->cursor : 0;
+
+	if (t[i].usec > usec)
+		i = 0;
+	if (i + 1 < s->count && t[i + 1].usec <= usec) {
+		if (i + 2 < s->count && t[i + 2].usec <= usec) {
+			uint32_t hi = s->count - 1;
+			while (i < hi) {
+				uint32_t mid = i + (hi - i + 1) / 2;
+				if (t[mid].usec <= usec)
+					i = mid;
+				else
+					hi = mid - 1;
+			}
+		} else
+			i++;
+	}
+	s->cursor = i;
+	return i;
+}
+
+static uint32_t
+avr_adc_stream_sample(
+		avr_t * avr,
+		avr_adc_stream_t * s,
+		avr_cycle_count_t cycle)
+{
+	if (s->generator)
+		return s->generator(avr, cycle, s->param);
+
+	uint64_t usec = avr_cycles_to_nsec(avr, cycle) / 1000;
+	uint32_t i = avr_adc_stream_seek(s, usec);
+	const avr_adc_sample_t * a = &s->samples[i];
+
+	if (usec <= a->usec || i + 1 == s->count)
+		return a->mv;
+	const avr_adc_sample_t * b = a + 1;
+	return a->mv + (((int64_t)b->mv - a->mv) * (int64_t)(usec - a->usec)) /
+			(int64_t)(b->usec - a->usec);
+}
+
+// returns the millivolts on channel 'chan', from a source or the IRQ value
+static uint32_t
+avr_adc_get_channel(
+		avr_adc_t * p,
+		uint8_t chan)
+{
+	if (p->stream && chan < ARRAY_SIZE(p->adc_values)) {
+		avr_adc_stream_t * s = &p->stream[chan];
+		if (s->generator || s->count)
+			return avr_adc_stream_sample(p->io.avr, s, p->sample_cycle);
+	}
+	return p->adc_values[chan];
+}
+
 static avr_cycle_count_t
 avr_adc_int_raise(
 		struct avr_t * avr, avr_cycle_count_t when, void * param)
@@ -61,13 +154,13 @@ avr_adc_read_l(
 	uint32_t reg = 0;
 	switch (mux.kind) {
 		case ADC_MUX_SINGLE:
-			reg = p->adc_values[mux.src];
+			reg = avr_adc_get_channel(p, mux.src);
 			break;
 		case ADC_MUX_DIFF:
 			if (mux.gain == 0)
 				mux.gain = 1;
-			reg = ((uint32_t)p->adc_values[mux.src] * mux.gain) -
-					((uint32_t)p->adc_values[mux.diff] * mux.gain);
+			reg = (avr_adc_get_channel(p, mux.src) * mux.gain) -
+					(avr_adc_get_channel(p, mux.diff) * mux.gain);
 			break;
 		case ADC_MUX_TEMP:
 			reg = p->temp; // assumed to be already calibrated somehow
@@ -238,6 +331,8 @@ avr_adc_write_adcsra(
 			uint32_t v;
 		} e = { .mux = p->muxmode[muxi] };
 		avr_raise_irq(p->io.irq + ADC_IRQ_OUT_TRIGGER, e.v);
+		// sample and hold, for the analog sources
+		p->sample_cycle = avr->cycle;
 
 		// clock prescaler are just a bit shift.. and 0 means 1
 		uint32_t div = avr_regbit_get_array(avr, p->adps, ARRAY_SIZE(p->adps));
@@ -305,6 +400,94 @@ static void avr_adc_reset(avr_io_t * port)
 		avr_irq_register_notify(p->io.irq + i, avr_adc_irq_notify, p);
 }
 
+static int
+avr_adc_set_source(
+		avr_adc_t * p,
+		avr_adc_source_t * src)
+{
+	avr_t * avr = p->io.avr;
+
+	if (src->channel >= ARRAY_SIZE(p->adc_values)) {
+		AVR_LOG(avr, LOG_WARNING, "ADC: %s: invalid channel %d\n",
+				__func__, src->channel);
+		return -2;
+	}
+	if (!p->stream)
+		p->stream = calloc(ARRAY_SIZE(p->adc_values), sizeof(*p->stream));
+	avr_adc_stream_t * s = &p->stream[src->channel];
+	avr_adc_stream_release(s);
+
+	if (src->generator) {
+		s->generator = src->generator;
+		s->param = src->param;
+	} else if (src->samples && src->count) {
+		s->samples = src->samples;
+		s->count = src->count;
+	} else if (src->filename) {
+#ifndef __MINGW32__
+		struct stat st;
+		int fd = open(src->filename, O_RDONLY);
+		if (fd == -1 || fstat(fd, &st) ||
+				st.st_size < sizeof(avr_adc_sample_t)) {
+			AVR_LOG(avr, LOG_ERROR, "ADC: %s: can't use '%s'\n",
+					__func__, src->filename);
+			if (fd != -1)
+				close(fd);
+			return -2;
+		}
+		s->map_size = st.st_size;
+		s->map = mmap(NULL, s->map_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (s->map == MAP_FAILED) {
+			AVR_LOG(avr, LOG_ERROR, "ADC: %s: can't map '%s'\n",
+					__func__, src->filename);
+			s->map = NULL;
+			return -2;
+		}
+		s->samples = s->map;
+		s->count = s->map_size / sizeof(avr_adc_sample_t);
+#else
+		AVR_LOG(avr, LOG_ERROR, "ADC: %s: file sources are not supported\n",
+				__func__);
+		return -2;
+#endif
+	}
+	AVR_LOG(avr, LOG_TRACE, "ADC: channel %d source %s\n", src->channel,
+			s->generator ? "generator" : s->count ? "samples" : "detached");
+	return 0;
+}
+
+static int
+avr_adc_ioctl(
+		struct avr_io_t * port,
+		uint32_t ctl,
+		void * io_param)
+{
+	avr_adc_t * p = (avr_adc_t *)port;
+
+	switch (ctl) {
+		case AVR_IOCTL_ADC_SET_SOURCE:
+			if (!io_param)
+				return -2;
+			return avr_adc_set_source(p, (avr_adc_source_t *)io_param);
+	}
+	return -1;
+}
+
+static void
+avr_adc_dealloc(
+		struct avr_io_t * port)
+{
+	avr_adc_t * p = (avr_adc_t *)port;
+
+	if (!p->stream)
+		return;
+	for (int i = 0; i < ARRAY_SIZE(p->adc_values); i++)
+		avr_adc_stream_release(&p->stream[i]);
+	free(p->stream);
+	p->stream = NULL;
+}
+
 static const char * irq_names[ADC_IRQ_COUNT] = {
 	[ADC_IRQ_ADC0] = "16<adc0",
 	[ADC_IRQ_ADC1] = "16<adc1",
@@ -330,6 +513,8 @@ static const char * irq_names[ADC_IRQ_COUNT] = {
 static	avr_io_t	_io = {
 	.kind = "adc",
 	.reset = avr_adc_reset,
+	.ioctl = avr_adc_ioctl,
+	.dealloc = avr_adc_dealloc,
 	.irq_names = irq_names,
 };
 
@@ -56,6 +56,41 @@ enum {
 // Get the internal IRQ corresponding to the INT
 #define AVR_IOCTL_ADC_GETIRQ AVR_IOCTL_DEF('a','d','c',' ')
 
+/*
+ * Analog sources. Instead of pushing values with the ADC_IRQ_ADC* IRQs, a
+ * time varying signal can be attached to a channel. It is only sampled
+ * when the firmware reads a conversion result, at the cycle the conversion
+ * was started, so long curves don't need any timer at all.
+ * A source is either:
+ * + a generator function, returning millivolts for a given cycle
+ * + a piecewise linear table of avr_adc_sample_t, sorted by time
+ * + a file of avr_adc_sample_t (host endianness), that gets memory mapped
+ * Sample times are microseconds of simulated time.
+ * Setting a source with none of these detaches the channel, and it reverts
+ * to the values sent to the ADC_IRQ_ADC* IRQs.
+ */
+typedef struct avr_adc_sample_t {
+	uint64_t	usec;
+	uint32_t	mv;
+	uint32_t	reserved;
+} avr_adc_sample_t;
+
+typedef uint32_t (*avr_adc_generator_t)(
+		struct avr_t * avr,
+		avr_cycle_count_t cycle,
+		void * param);
+
+typedef struct avr_adc_source_t {
+	uint8_t				channel;	// 0-7, as in ADC_IRQ_ADC0-ADC_IRQ_ADC7
+	avr_adc_generator_t	generator;
+	void *				param;		// passed to generator
+	const avr_adc_sample_t * samples;	// not copied, needs to stay around
+	uint32_t			count;
+	const char *		filename;
+} avr_adc_source_t;
+
+#define AVR_IOCTL_ADC_SET_SOURCE AVR_IOCTL_DEF('a','d','c','s')
+
 /*
  * Definition of a ADC mux mode.
  */
@@ -139,6 +174,8 @@ typedef struct avr_adc_t {
 	uint16_t		temp;		// temp sensor reading
 	uint8_t			first;
 	uint8_t			read_status;	// marked one when adcl is read
+	avr_cycle_count_t	sample_cycle;	// when the current conversion started
+	struct avr_adc_stream_t * stream;	// analog sources, if any were set
 } avr_adc_t;
 
 void avr_adc_init(avr_t * avr, avr_adc_t * port);
@@ -24,6 +24,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef __MINGW32__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include "avr_eeprom.h"
 
 static avr_cycle_count_t avr_eempe_clear(struct avr_t * avr, avr_cycle_count_t when, void * param)
@@ -59,6 +65,16 @@ static void avr_eeprom_write(avr_t * avr, avr_io_addr_t addr, uint8_t v, void *
 			addr = avr->data[p->r_eearl];
 	//	printf("eeprom write %04x <- %02x\n", addr, avr->data[p->r_eedr]);
 		p->eeprom[addr] = avr->data[p->r_eedr];	
+		if (++p->writes[addr] == AVR_EEPROM_ENDURANCE)
+			AVR_LOG(avr, LOG_WARNING, "EEPROM: cell %04x written %d times\n",
+					addr, AVR_EEPROM_ENDURANCE);
+#ifndef __MINGW32__
+		if (p->map && p->sync != AVR_EEPROM_SYNC_EXIT) {
+			long page = sysconf(_SC_PAGESIZE);
+			msync(p->map + (addr & ~(page - 1)), 1,
+					p->sync == AVR_EEPROM_SYNC_WRITE ? MS_SYNC : MS_ASYNC);
+		}
+#endif
 		// Automatically clears that bit (?)
 		avr_regbit_clear(avr, p->eempe);
 
@@ -79,6 +95,63 @@ static void avr_eeprom_write(avr_t * avr, avr_io_addr_t addr, uint8_t v, void *
 	avr_regbit_clear(avr, p->eere);
 }
 
+#ifndef __MINGW32__
+static void avr_eeprom_unmap(avr_eeprom_t * p)
+{
+	if (!p->map)
+		return;
+	msync(p->map, p->size, MS_SYNC);
+	munmap(p->map, p->size);
+	p->map = NULL;
+}
+#endif
+
+static int avr_eeprom_set_file(avr_eeprom_t * p, avr_eeprom_file_t * file)
+{
+	avr_t * avr = p->io.avr;
+#ifndef __MINGW32__
+	struct stat st;
+	int fd = open(file->filename, O_RDWR | O_CREAT, 0644);
+	if (fd == -1 || fstat(fd, &st)) {
+		AVR_LOG(avr, LOG_ERROR, "EEPROM: %s: can't open '%s'\n",
+				__FUNCTION__, file->filename);
+		if (fd != -1)
+			close(fd);
+		return -2;
+	}
+	if (st.st_size < p->size && ftruncate(fd, p->size)) {
+		AVR_LOG(avr, LOG_ERROR, "EEPROM: %s: can't extend '%s'\n",
+				__FUNCTION__, file->filename);
+		close(fd);
+		return -2;
+	}
+	uint8_t * map = mmap(NULL, p->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		AVR_LOG(avr, LOG_ERROR, "EEPROM: %s: can't map '%s'\n",
+				__FUNCTION__, file->filename);
+		return -2;
+	}
+	// new cells take what was there before
+	if (st.st_size < p->size)
+		memcpy(map + st.st_size, p->eeprom + st.st_size, p->size - st.st_size);
+	if (p->map)
+		avr_eeprom_unmap(p);
+	else
+		free(p->eeprom);
+	p->eeprom = p->map = map;
+	p->sync = file->sync;
+	AVR_LOG(avr, LOG_TRACE, "EEPROM: %s: '%s' mapped, %d bytes from the file\n",
+			__FUNCTION__, file->filename,
+			(int)(st.st_size < p->size ? st.st_size : p->size));
+	return 0;
+#else
+	AVR_LOG(avr, LOG_ERROR, "EEPROM: %s: backing files are not supported\n",
+			__FUNCTION__);
+	return -2;
+#endif
+}
+
 static int avr_eeprom_ioctl(struct avr_io_t * port, uint32_t ctl, void * io_param)
 {
 	avr_eeprom_t * p = (avr_eeprom_t *)port;
@@ -108,6 +181,21 @@ static int avr_eeprom_ioctl(struct avr_io_t * port, uint32_t ctl, void * io_para
 			else	// allow to get access to the read data, for gdb support
 				desc->ee = p->eeprom + desc->offset;
 		}	break;
+		case AVR_IOCTL_EEPROM_SET_FILE: {
+			avr_eeprom_file_t * file = (avr_eeprom_file_t*)io_param;
+			if (!file || !file->filename) {
+				AVR_LOG(port->avr, LOG_WARNING, "EEPROM: %s: AVR_IOCTL_EEPROM_SET_FILE Invalid argument\n",
+						__FUNCTION__);
+				return -2;
+			}
+			res = avr_eeprom_set_file(p, file);
+		}	break;
+		case AVR_IOCTL_EEPROM_GET_WRITES:
+			if (!io_param)
+				return -2;
+			*(uint32_t **)io_param = p->writes;
+			res = 0;
+			break;
 	}
 	
 	return res;
@@ -116,9 +204,16 @@ static int avr_eeprom_ioctl(struct avr_io_t * port, uint32_t ctl, void * io_para
 static void avr_eeprom_dealloc(struct avr_io_t * port)
 {
 	avr_eeprom_t * p = (avr_eeprom_t *)port;
+#ifndef __MINGW32__
+	if (p->map)
+		avr_eeprom_unmap(p);
+	else
+#endif
 	if (p->eeprom)
 		free(p->eeprom);
 	p->eeprom = NULL;
+	free(p->writes);
+	p->writes = NULL;
 }
 
 static	avr_io_t	_io = {
@@ -135,6 +230,7 @@ void avr_eeprom_init(avr_t * avr, avr_eeprom_t * p)
 
 	p->eeprom = malloc(p->size);
 	memset(p->eeprom, 0xff, p->size);
+	p->writes = calloc(p->size, sizeof(*p->writes));
 	
 	avr_register_io(avr, &p->io);
 	avr_register_vector(avr, &p->ready);
@@ -33,6 +33,11 @@ typedef struct avr_eeprom_t {
 
 	uint8_t *	eeprom;	// actual bytes
 	uint16_t	size;	// size for this MCU
+	uint32_t *	writes;	// write count of each cell
+
+	// backing file, see AVR_IOCTL_EEPROM_SET_FILE
+	uint8_t *	map;	// == eeprom when mapped
+	uint8_t		sync;	// AVR_EEPROM_SYNC_*
 	
 	uint8_t r_eearh;
 	uint8_t r_eearl;
@@ -59,6 +64,32 @@ typedef struct avr_eeprom_desc_t {
 #define AVR_IOCTL_EEPROM_GET	AVR_IOCTL_DEF('e','e','g','p')
 #define AVR_IOCTL_EEPROM_SET	AVR_IOCTL_DEF('e','e','s','p')
 
+/*
+ * Backs the EEPROM with a file, mapped shared so the bytes the firmware
+ * writes are the ones in the file, and survive the simulator.
+ * A new (or short) file is extended to the EEPROM size, erased to 0xff
+ * with whatever was loaded before -- from the .hex or ELF -- copied in;
+ * an existing file is used as is, it is the previous session.
+ */
+enum {
+	AVR_EEPROM_SYNC_EXIT = 0,	// msync when the AVR is terminated
+	AVR_EEPROM_SYNC_ASYNC,		// schedule the page write on each EEPROM write
+	AVR_EEPROM_SYNC_WRITE,		// wait for the page write on each EEPROM write
+};
+
+typedef struct avr_eeprom_file_t {
+	const char *	filename;
+	uint8_t			sync;	// AVR_EEPROM_SYNC_*
+} avr_eeprom_file_t;
+
+#define AVR_IOCTL_EEPROM_SET_FILE	AVR_IOCTL_DEF('e','e','f','p')
+
+// takes a uint32_t **, set to the per cell write counters
+#define AVR_IOCTL_EEPROM_GET_WRITES	AVR_IOCTL_DEF('e','e','w','p')
+
+// rated endurance, a warning is logged when a cell goes past it
+#define AVR_EEPROM_ENDURANCE	100000
+
 
 /*
  * the eeprom block seems to be very similar across AVRs, 
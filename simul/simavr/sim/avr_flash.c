@@ -22,6 +22,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef __MINGW32__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include "avr_flash.h"
 
 static avr_cycle_count_t avr_progen_clear(struct avr_t * avr, avr_cycle_count_t when, void * param)
@@ -53,14 +59,155 @@ static void avr_flash_clear_temppage(avr_flash_t *p)
 	}
 }
 
-static int avr_flash_ioctl(struct avr_io_t * port, uint32_t ctl, void * io_param)
+static void avr_flash_set_dirty(avr_flash_t *p, avr_flashaddr_t z)
 {
-	if (ctl != AVR_IOCTL_FLASH_SPM)
+	uint32_t page = z / p->spm_pagesize;
+	if (page < p->pages)
+		p->dirty[page >> 3] |= 1 << (page & 7);
+}
+
+#ifndef __MINGW32__
+static int avr_flash_commit(avr_flash_t *p)
+{
+	avr_t * avr = p->io.avr;
+	int res = 0;
+
+	if (!p->map)
 		return -1;
+	for (uint32_t page = 0; page < p->pages; page++) {
+		if (!(p->dirty[page >> 3] & (1 << (page & 7))))
+			continue;
+		off_t o = (off_t)page * p->spm_pagesize;
+		if (pwrite(p->fd, avr->flash + o, p->spm_pagesize, o) != p->spm_pagesize) {
+			AVR_LOG(avr, LOG_ERROR, "FLASH: %s: can't write page %04x\n",
+					__FUNCTION__, page);
+			res = -2;
+			continue;
+		}
+		p->dirty[page >> 3] &= ~(1 << (page & 7));
+	}
+	return res;
+}
+
+static void avr_flash_unmap(avr_flash_t *p)
+{
+	avr_t * avr = p->io.avr;
+
+	if (!p->map)
+		return;
+	if (p->commit)
+		avr_flash_commit(p);
+	munmap(p->map, p->map_size);
+	close(p->fd);
+	if (avr->flash == p->map)
+		avr->flash = NULL;
+	p->map = NULL;
+}
+#endif
+
+static int avr_flash_set_file(avr_flash_t *p, avr_flash_file_t * file)
+{
+	avr_t * avr = p->io.avr;
+#ifndef __MINGW32__
+	uint32_t size = avr->flashend + 1;
+	struct stat st;
 
+	int fd = open(file->filename, O_RDWR | O_CREAT, 0644);
+	if (fd == -1 || fstat(fd, &st)) {
+		AVR_LOG(avr, LOG_ERROR, "FLASH: %s: can't open '%s'\n",
+				__FUNCTION__, file->filename);
+		if (fd != -1)
+			close(fd);
+		return -2;
+	}
+	if (!st.st_size) {
+		// first run, the file starts with what's loaded
+		if (pwrite(fd, avr->flash, size, 0) != size) {
+			AVR_LOG(avr, LOG_ERROR, "FLASH: %s: can't write '%s'\n",
+					__FUNCTION__, file->filename);
+			close(fd);
+			return -2;
+		}
+		st.st_size = size;
+	}
+	/*
+	 * Erased flash for the whole size, and the file mapped private over
+	 * it, as much of it as there is. Past the end of the file, the last
+	 * page of the mapping reads as zeroes, and needs erasing too.
+	 */
+	long pagesize = sysconf(_SC_PAGESIZE);
+	uint32_t used = st.st_size < size ? st.st_size : size;
+	uint32_t used_map = (used + pagesize - 1) & ~(pagesize - 1);
+	uint32_t map_size = (size + pagesize - 1) & ~(pagesize - 1);
+	uint8_t * map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map != MAP_FAILED) {
+		memset(map + used_map, 0xff, map_size - used_map);
+		if (mmap(map, used_map, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+			munmap(map, map_size);
+			map = MAP_FAILED;
+		}
+	}
+	if (map == MAP_FAILED) {
+		AVR_LOG(avr, LOG_ERROR, "FLASH: %s: can't map '%s'\n",
+				__FUNCTION__, file->filename);
+		close(fd);
+		return -2;
+	}
+	if (used < used_map)
+		memset(map + used, 0xff, used_map - used);
+
+	if (p->map)
+		avr_flash_unmap(p);
+	else
+		free(avr->flash);
+	avr->flash = p->map = map;
+	p->map_size = map_size;
+	p->fd = fd;
+	p->commit = file->commit;
+	memset(p->dirty, 0, (p->pages + 7) / 8);
+	AVR_LOG(avr, LOG_TRACE, "FLASH: %s: '%s' mapped, %d bytes from the file\n",
+			__FUNCTION__, file->filename, used);
+	return 0;
+#else
+	AVR_LOG(avr, LOG_ERROR, "FLASH: %s: backing files are not supported\n",
+			__FUNCTION__);
+	return -2;
+#endif
+}
+
+static int avr_flash_ioctl(struct avr_io_t * port, uint32_t ctl, void * io_param)
+{
 	avr_flash_t * p = (avr_flash_t *)port;
 	avr_t * avr = p->io.avr;
 
+	switch (ctl) {
+		case AVR_IOCTL_FLASH_SPM:
+			break;
+		case AVR_IOCTL_FLASH_SET_FILE:
+			if (!io_param || !((avr_flash_file_t *)io_param)->filename)
+				return -2;
+			return avr_flash_set_file(p, (avr_flash_file_t *)io_param);
+		case AVR_IOCTL_FLASH_COMMIT:
+#ifndef __MINGW32__
+			return avr_flash_commit(p);
+#else
+			return -2;
+#endif
+		case AVR_IOCTL_FLASH_GET_DIRTY: {
+			avr_flash_dirty_t * d = (avr_flash_dirty_t *)io_param;
+			if (!d)
+				return -2;
+			d->bitmap = p->dirty;
+			d->pages = p->pages;
+			d->page_size = p->spm_pagesize;
+			return 0;
+		}
+		default:
+			return -1;
+	}
+
 	avr_flashaddr_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
 	if (avr->rampz)
 		z |= avr->data[avr->rampz] << 16;
@@ -71,12 +218,14 @@ static int avr_flash_ioctl(struct avr_io_t * port, uint32_t ctl, void * io_param
 		avr_cycle_timer_cancel(avr, avr_progen_clear, p);
 
 		if (avr_regbit_get(avr, p->pgers)) {
-			z &= ~1;
+			z &= ~(p->spm_pagesize - 1);
+			avr_flash_set_dirty(p, z);
 			AVR_LOG(avr, LOG_TRACE, "FLASH: Erasing page %04x (%d)\n", (z / p->spm_pagesize), p->spm_pagesize);
 			for (int i = 0; i < p->spm_pagesize; i++)
 				avr->flash[z++] = 0xff;
 		} else if (avr_regbit_get(avr, p->pgwrt)) {
 			z &= ~(p->spm_pagesize - 1);
+			avr_flash_set_dirty(p, z);
 			AVR_LOG(avr, LOG_TRACE, "FLASH: Writing page %04x (%d)\n", (z / p->spm_pagesize), p->spm_pagesize);
 			for (int i = 0; i < p->spm_pagesize / 2; i++) {
 				avr->flash[z++] = p->tmppage[i];
@@ -118,6 +267,11 @@ avr_flash_dealloc(struct avr_io_t * port)
 
 	if (p->tmppage_used)
 		free(p->tmppage_used);
+#ifndef __MINGW32__
+	avr_flash_unmap(p);
+#endif
+	free(p->dirty);
+	p->dirty = NULL;
 }
 
 static	avr_io_t	_io = {
@@ -138,6 +292,9 @@ void avr_flash_init(avr_t * avr, avr_flash_t * p)
 	if (!p->tmppage_used)
 		p->tmppage_used = malloc(p->spm_pagesize / 2);
 
+	p->pages = (avr->flashend + 1) / p->spm_pagesize;
+	p->dirty = calloc((p->pages + 7) / 8, 1);
+
 	avr_register_io(avr, &p->io);
 	avr_register_vector(avr, &p->flash);
 
@@ -49,6 +49,14 @@ typedef struct avr_flash_t {
 	avr_regbit_t rwwsb;		// read while write section busy
 
 	avr_int_vector_t flash;	// Interrupt vector
+
+	uint8_t *	dirty;		// one bit per page written by SPM, see below
+	uint32_t	pages;		// number of spm_pagesize pages in the flash
+	// backing file, see AVR_IOCTL_FLASH_SET_FILE
+	uint8_t *	map;		// == avr->flash when mapped
+	uint32_t	map_size;
+	int			fd;
+	uint8_t		commit;		// write the dirty pages back at termination
 } avr_flash_t;
 
 /* Set if the flash supports a Read While Write section */
@@ -59,6 +67,37 @@ void avr_flash_init(avr_t * avr, avr_flash_t * p);
 
 #define AVR_IOCTL_FLASH_SPM		AVR_IOCTL_DEF('f','s','p','m')
 
+/*
+ * Maps the flash from a raw binary image, copy-on-write: what the firmware
+ * programs with SPM stays in memory, and the file is left alone until
+ * AVR_IOCTL_FLASH_COMMIT writes the dirty pages back -- or termination, if
+ * 'commit' is set. A bootloader or OTA update test can then run back to
+ * back, each run starting from the flash the previous one left.
+ * If the file is missing or empty, it is created with the current flash,
+ * so load the firmware first; an existing file replaces it.
+ */
+typedef struct avr_flash_file_t {
+	const char *	filename;
+	uint8_t			commit;
+} avr_flash_file_t;
+
+#define AVR_IOCTL_FLASH_SET_FILE	AVR_IOCTL_DEF('f','f','i','l')
+#define AVR_IOCTL_FLASH_COMMIT		AVR_IOCTL_DEF('f','c','m','t')
+
+/*
+ * Pages erased or written by SPM since the firmware was loaded, or the
+ * last commit. Bit (n & 7) of bitmap[n >> 3] is page n, at
+ * n * page_size bytes in the flash.
+ */
+typedef struct avr_flash_dirty_t {
+	const uint8_t *	bitmap;
+	uint32_t		pages;
+	uint16_t		page_size;
+} avr_flash_dirty_t;
+
+// takes a avr_flash_dirty_t*, filled in
+#define AVR_IOCTL_FLASH_GET_DIRTY	AVR_IOCTL_DEF('f','d','r','t')
+
 #define AVR_SELFPROG_DECLARE_INTERNAL(_spmr, _spen, _vector) \
 		.r_spm = _spmr,\
 		.spm_pagesize = SPM_PAGESIZE,\
@@ -20,6 +20,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include "avr_ioport.h"
 
 #define D(_w)
@@ -42,27 +43,81 @@ avr_ioport_read(
 	return v;
 }
 
+/*
+ * Count the edges between two states of the pin IRQs, and the time
+ * spent high by those that fall
+ */
+static inline void
+avr_ioport_count(
+		avr_ioport_t * p,
+		uint8_t old,
+		uint8_t value)
+{
+	uint8_t changed = old ^ value;
+	if (!changed || !p->stats_on)
+		return;
+	avr_cycle_count_t now = p->io.avr->cycle;
+	while (changed) {
+		int i = __builtin_ctz(changed);
+		changed &= changed - 1;
+		avr_ioport_pin_stats_t * s = &p->stats[i];
+		if (value & (1 << i))
+			s->rising++;
+		else {
+			s->falling++;
+			s->high += now - s->last_edge;
+		}
+		s->last_edge = now;
+	}
+}
+
+static void
+avr_ioport_stats_clear(
+		avr_ioport_t * p)
+{
+	memset(p->stats, 0, sizeof(p->stats));
+	p->stats_since = p->io.avr->cycle;
+	for (int i = 0; i < 8; i++)
+		p->stats[i].last_edge = p->stats_since;
+}
+
+/*
+ * Resolve the pin vector, and raise the pin IRQs that changed since the last
+ * time. The pin IRQs are filtered anyway, but the display loops of most
+ * firmwares are nothing but port writes, so it's worth not calling
+ * avr_raise_irq() 9 times for each of them.
+ */
 static void
 avr_ioport_update_irqs(
 		avr_ioport_t * p)
 {
 	avr_t * avr = p->io.avr;
 	uint8_t ddr = avr->data[p->r_ddr];
+	uint8_t port = avr->data[p->r_port];
+	uint8_t pull_mask = p->external.pull_mask;
 	// Set the PORT value if the pin is marked as output
 	// otherwise, if there is an 'external' pullup, set it
 	// otherwise, if the PORT pin was 1 to indicate an
 	// internal pullup, set that.
-	for (int i = 0; i < 8; i++) {
-		if (ddr & (1 << i))
-			avr_raise_irq(p->io.irq + i, (avr->data[p->r_port] >> i) & 1);
-		else if (p->external.pull_mask & (1 << i))
-			avr_raise_irq(p->io.irq + i, (p->external.pull_value >> i) & 1);
-		else if ((avr->data[p->r_port] >> i) & 1)
-			avr_raise_irq(p->io.irq + i, 1);
+	uint8_t drive = ddr | pull_mask | port;
+	uint8_t value = (port & (ddr | ~pull_mask)) |
+			(p->external.pull_value & pull_mask & ~ddr);
+	uint8_t changed = ((value ^ p->pin_irq) | p->pin_irq_init) & drive;
+
+	// all the edges of this write in one go, the notify sees no change
+	uint8_t pin_irq = (p->pin_irq & ~changed) | (value & changed);
+	avr_ioport_count(p, p->pin_irq, pin_irq);
+	p->pin_irq = pin_irq;
+	while (changed) {
+		int i = __builtin_ctz(changed);
+		changed &= changed - 1;
+		avr_raise_irq(p->io.irq + i, (value >> i) & 1);
 	}
-	uint8_t pin = (avr->data[p->r_pin] & ~ddr) | (avr->data[p->r_port] & ddr);
-	pin = (pin & ~p->external.pull_mask) | p->external.pull_value;
-	avr_raise_irq(p->io.irq + IOPORT_IRQ_PIN_ALL, pin);
+	uint8_t pin = (avr->data[p->r_pin] & ~ddr) | (port & ddr);
+	pin = (pin & ~pull_mask) | p->external.pull_value;
+	avr_irq_t * all = p->io.irq + IOPORT_IRQ_PIN_ALL;
+	if (all->value != pin || (all->flags & IRQ_FLAG_INIT))
+		avr_raise_irq(all, pin);
 }
 
 static void
@@ -134,6 +189,11 @@ avr_ioport_irq_notify(
 	int output = value & AVR_IOPORT_OUTPUT;
 	value &= 0xff;
 	uint8_t mask = 1 << irq->irq;
+	// keep track of the pin IRQs values, see avr_ioport_update_irqs()
+	uint8_t pin_irq = value ? (p->pin_irq | mask) : (p->pin_irq & ~mask);
+	avr_ioport_count(p, p->pin_irq, pin_irq);
+	p->pin_irq = pin_irq;
+	p->pin_irq_init &= ~mask;
 		// set the real PIN bit. ddr doesn't matter here as it's masked when read.
 	avr->data[p->r_pin] &= ~mask;
 	if (value)
@@ -193,6 +253,17 @@ avr_ioport_ioctl(
 				return o;
 			}
 		}	break;
+		case AVR_IOCTL_IOPORT_PIN_WATCHED: {
+			avr_regbit_t * b = (avr_regbit_t*)io_param;
+
+			if (b->reg == p->r_port || b->reg == p->r_pin || b->reg == p->r_ddr) {
+				uint8_t mask = 1 << b->bit;
+				// our own notify is always there
+				return avr_irq_hook_count(p->io.irq + b->bit) > 1 ||
+						(p->r_pcint && (avr->data[p->r_pcint] & mask)) ||
+						p->stats_on;
+			}
+		}	break;
 		default: {
 			/*
 			 * Return the port state if the IOCTL matches us.
@@ -208,6 +279,28 @@ avr_ioport_ioctl(
 					*((avr_ioport_state_t*)io_param) = state;
 				res = 0;
 			}
+			/*
+			 * Pin counters, started by the first call
+			 */
+			if (ctl == AVR_IOCTL_IOPORT_GET_STATS(p->name)) {
+				avr_ioport_stats_t * st = (avr_ioport_stats_t*)io_param;
+				// the first call starts them, there is nothing to copy yet
+				if (!p->stats_on) {
+					p->stats_on = 1;
+					avr_ioport_stats_clear(p);
+				}
+				st->since = p->stats_since;
+				st->now = avr->cycle;
+				for (int i = 0; i < 8; i++) {
+					st->pin[i] = p->stats[i];
+					// the pins high now, up to now
+					if (p->pin_irq & (1 << i))
+						st->pin[i].high += avr->cycle - p->stats[i].last_edge;
+				}
+				if (st->reset)
+					avr_ioport_stats_clear(p);
+				res = 0;
+			}
 			/*
 			 * Set the default IRQ values when pin is set as input
 			 */
@@ -264,6 +357,8 @@ void avr_ioport_init(avr_t * avr, avr_ioport_t * p)
 
 	for (int i = 0; i < IOPORT_IRQ_COUNT; i++)
 		p->io.irq[i].flags |= IRQ_FLAG_FILTERED;
+	p->pin_irq = 0;
+	p->pin_irq_init = 0xff;
 
 	avr_register_io_write(avr, p->r_port, avr_ioport_write, p);
 	avr_register_io_read(avr, p->r_pin, avr_ioport_read, p);
@@ -84,6 +84,44 @@ typedef struct avr_ioport_external_t {
 // add port name (uppercase) to set default input pin IRQ values
 #define AVR_IOCTL_IOPORT_SET_EXTERNAL(_name) AVR_IOCTL_DEF('i','o','p',(_name))
 
+/*
+ * ioctl used to get the pin activity counters of a port. They are only
+ * kept once this was called, the first call starts them and copies
+ * zeroes, with 'since' and 'now' the current cycle. Set 'reset' to
+ * start counting again after the copy. Like any pin listener, start
+ * them before a timer driving one of the pins does, see avr_timer.c.
+ *
+ * avr_ioport_stats_t st = { .reset = 1 };
+ * avr_ioctl(avr, AVR_IOCTL_IOPORT_GET_STATS('B'), &st);
+ * ... run ...
+ * avr_ioctl(avr, AVR_IOCTL_IOPORT_GET_STATS('B'), &st);
+ * printf("PB3 duty %.1f%%\n", 100.0 * st.pin[3].high / (st.now - st.since));
+ */
+typedef struct avr_ioport_pin_stats_t {
+	uint32_t rising, falling;		// edges
+	avr_cycle_count_t high;			// cycles spent high
+	avr_cycle_count_t last_edge;	// cycle of the last edge, or of the reset
+} avr_ioport_pin_stats_t;
+
+typedef struct avr_ioport_stats_t {
+	uint8_t reset;					// in: start counting again
+	avr_cycle_count_t since;		// cycle the counting started
+	avr_cycle_count_t now;			// cycle of this copy
+	avr_ioport_pin_stats_t pin[8];
+} avr_ioport_stats_t;
+
+// add port name (uppercase) to get the pin counters
+#define AVR_IOCTL_IOPORT_GET_STATS(_name) AVR_IOCTL_DEF('i','o','t',(_name))
+
+/*
+ * this ioctl takes a avr_regbit_t, and returns 1 if anything can tell the
+ * level of that pin IRQ apart: a hook or a connected IRQ on it besides the
+ * port's own, a pin change interrupt, or the pin counters. 0 if nothing
+ * does, so a peripheral driving it can skip the edges. -1 if it's not a pin
+ * of ours. PIN reads don't count, they show PORT for an output pin.
+ */
+#define AVR_IOCTL_IOPORT_PIN_WATCHED AVR_IOCTL_DEF('i','o','g','w')
+
 /**
  * pin structure
  */
@@ -114,6 +152,15 @@ typedef struct avr_ioport_t {
 	struct {
 		uint8_t pull_mask, pull_value;
 	} external;
+
+	// last value raised on the pin IRQs, and pins never raised yet.
+	// Only the pins that differ get raised again on PORT/DDR/PIN writes
+	uint8_t pin_irq, pin_irq_init;
+
+	// pin activity counters, see AVR_IOCTL_IOPORT_GET_STATS
+	uint8_t stats_on;
+	avr_cycle_count_t stats_since;
+	avr_ioport_pin_stats_t stats[8];
 } avr_ioport_t;
 
 void avr_ioport_init(avr_t * avr, avr_ioport_t * port);
@@ -20,8 +20,67 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include "avr_spi.h"
 
+avr_cycle_count_t avr_spi_byte_cycles(avr_t * avr, avr_spi_t * p)
+{
+	// SPR1:0 select fosc/4, 16, 64, 128; SPI2X doubles the SCK rate
+	static const uint8_t divider[4] = { 4, 16, 64, 128 };
+	avr_cycle_count_t div = divider[(avr_regbit_get(avr, p->spr[1]) << 1) |
+			avr_regbit_get(avr, p->spr[0])];
+	if (avr_regbit_get(avr, p->spr[2]))
+		div >>= 1;
+	return 8 * div;
+}
+
+static void avr_spi_flush(avr_spi_t * p)
+{
+	if (!p->pending.len)
+		return;
+	uint32_t len = p->pending.len;
+	p->pending.len = 0;
+	if (p->block.write)
+		p->block.write(p->block.param, p->pending.buf, len,
+				p->pending.first, p->pending.byte_cycles);
+}
+
+/*
+ * Delivers the block once the master has stopped sending for a couple of
+ * byte times. This is polled every AVR_SPI_IDLE_POLL bytes rather than
+ * moved along with each byte, so a long burst only costs a few timers
+ */
+#define AVR_SPI_IDLE_POLL	16
+
+static avr_cycle_count_t avr_spi_idle(struct avr_t * avr, avr_cycle_count_t when, void * param)
+{
+	avr_spi_t * p = (avr_spi_t *)param;
+
+	if (!p->pending.len)
+		return 0;
+	if (when < p->pending.last + 2 * p->pending.byte_cycles)
+		return when + AVR_SPI_IDLE_POLL * p->pending.byte_cycles;
+	avr_spi_flush(p);
+	return 0;
+}
+
+static void avr_spi_queue(avr_spi_t * p, uint8_t b, avr_cycle_count_t when,
+		avr_cycle_count_t byte_cycles)
+{
+	avr_t * avr = p->io.avr;
+
+	if (p->pending.len && (p->pending.len == AVR_SPI_BLOCK_BUFFER ||
+			p->pending.byte_cycles != byte_cycles))
+		avr_spi_flush(p);
+	if (!p->pending.len) {
+		p->pending.first = when;
+		p->pending.byte_cycles = byte_cycles;
+		avr_cycle_timer_register(avr, AVR_SPI_IDLE_POLL * byte_cycles, avr_spi_idle, p);
+	}
+	p->pending.last = when;
+	p->pending.buf[p->pending.len++] = b;
+}
+
 static avr_cycle_count_t avr_spi_raise(struct avr_t * avr, avr_cycle_count_t when, void * param)
 {
 	avr_spi_t * p = (avr_spi_t *)param;
@@ -30,7 +89,11 @@ static avr_cycle_count_t avr_spi_raise(struct avr_t * avr, avr_cycle_count_t whe
 		// in master mode, any byte is sent as it comes..
 		if (avr_regbit_get(avr, p->mstr)) {
 			avr_raise_interrupt(avr, &p->spi);
-			avr_raise_irq(p->io.irq + SPI_IRQ_OUTPUT, avr->data[p->r_spdr]);
+			if (p->block.write)
+				avr_spi_queue(p, avr->data[p->r_spdr], when,
+						avr_spi_byte_cycles(avr, p));
+			else
+				avr_raise_irq(p->io.irq + SPI_IRQ_OUTPUT, avr->data[p->r_spdr]);
 		}
 	}
 	return 0;
@@ -55,7 +118,7 @@ static void avr_spi_write(struct avr_t * avr, avr_io_addr_t addr, uint8_t v, voi
 		avr_regbit_clear(avr, p->spi.raised);
 
 		avr_core_watch_write(avr, addr, v);
-		avr_cycle_timer_register_usec(avr, 100, avr_spi_raise, p); // should be speed dependent
+		avr_cycle_timer_register(avr, avr_spi_byte_cycles(avr, p), avr_spi_raise, p);
 	}
 }
 
@@ -83,6 +146,40 @@ void avr_spi_reset(struct avr_io_t *io)
 {
 	avr_spi_t * p = (avr_spi_t *)io;
 	avr_irq_register_notify(p->io.irq + SPI_IRQ_INPUT, avr_spi_irq_input, p);
+	avr_cycle_timer_cancel(p->io.avr, avr_spi_idle, p);
+	p->pending.len = 0;
+}
+
+static int avr_spi_ioctl(struct avr_io_t * port, uint32_t ctl, void * io_param)
+{
+	avr_spi_t * p = (avr_spi_t *)port;
+
+	if (ctl == AVR_IOCTL_SPI_FLUSH(p->name)) {
+		avr_spi_flush(p);
+		return 0;
+	}
+	if (ctl != AVR_IOCTL_SPI_SET_BLOCK(p->name))
+		return -1;
+	// whatever was queued goes to the old handler
+	avr_spi_flush(p);
+	avr_cycle_timer_cancel(p->io.avr, avr_spi_idle, p);
+	if (io_param) {
+		p->block = *(avr_spi_block_t *)io_param;
+		if (!p->pending.buf)
+			p->pending.buf = malloc(AVR_SPI_BLOCK_BUFFER);
+	} else
+		p->block.write = NULL;
+	return 0;
+}
+
+static void avr_spi_dealloc(struct avr_io_t * port)
+{
+	avr_spi_t * p = (avr_spi_t *)port;
+
+	free(p->pending.buf);
+	p->pending.buf = NULL;
+	p->pending.len = 0;
+	p->block.write = NULL;
 }
 
 static const char * irq_names[SPI_IRQ_COUNT] = {
@@ -93,6 +190,8 @@ static const char * irq_names[SPI_IRQ_COUNT] = {
 static	avr_io_t	_io = {
 	.kind = "spi",
 	.reset = avr_spi_reset,
+	.ioctl = avr_spi_ioctl,
+	.dealloc = avr_spi_dealloc,
 	.irq_names = irq_names,
 };
 
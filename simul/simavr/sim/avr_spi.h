@@ -37,6 +37,31 @@ enum {
 // add port number to get the real IRQ
 #define AVR_IOCTL_SPI_GETIRQ(_name) AVR_IOCTL_DEF('s','p','i',(_name))
 
+/*
+ * Block transfers. A part that only listens (a display, a shift register
+ * chain...) can register a 'write' handler instead of hooking
+ * SPI_IRQ_OUTPUT. The bytes the AVR master sends are then buffered, and
+ * nothing is raised on SPI_IRQ_OUTPUT for them; the buffer is handed to
+ * 'write' in one call when it is full, when the bus has been idle for a
+ * couple of byte times, or when the part asks for it with
+ * AVR_IOCTL_SPI_FLUSH -- typically from its chip select or data/command
+ * pin hooks, so the bytes are seen with the pins as they were.
+ * 'when' is the cycle the first byte of the block completed, the others
+ * followed every 'byte_cycles'. Timing seen by the firmware is unchanged.
+ */
+typedef struct avr_spi_block_t {
+	void *		param;
+	void (*write)(void * param, const uint8_t * buf, uint32_t len,
+			avr_cycle_count_t when, avr_cycle_count_t byte_cycles);
+} avr_spi_block_t;
+
+// takes a avr_spi_block_t*, which is copied, NULL to go back to per byte IRQs
+#define AVR_IOCTL_SPI_SET_BLOCK(_name) AVR_IOCTL_DEF('s','p','b',(_name))
+// deliver whatever is buffered now
+#define AVR_IOCTL_SPI_FLUSH(_name) AVR_IOCTL_DEF('s','p','f',(_name))
+
+#define AVR_SPI_BLOCK_BUFFER	1024	// a 128x64 monochrome framebuffer
+
 typedef struct avr_spi_t {
 	avr_io_t	io;
 	char name;
@@ -53,8 +78,20 @@ typedef struct avr_spi_t {
 	avr_int_vector_t spi;	// spi interrupt
 
 	uint8_t		input_data_register;
+
+	avr_spi_block_t	block;		// block transfer handler, if any
+	struct {
+		uint8_t *	buf;		// AVR_SPI_BLOCK_BUFFER bytes
+		uint32_t	len;
+		avr_cycle_count_t	first;	// cycle the first byte completed
+		avr_cycle_count_t	last;	// cycle the last byte completed
+		avr_cycle_count_t	byte_cycles;
+	} pending;
 } avr_spi_t;
 
+// cycles it takes to shift a byte out, with the current SPR/SPI2X bits
+avr_cycle_count_t avr_spi_byte_cycles(avr_t * avr, avr_spi_t * p);
+
 void avr_spi_init(avr_t * avr, avr_spi_t * port);
 
 #define AVR_SPIX_DECLARE(_name, _prr, _prspi) \
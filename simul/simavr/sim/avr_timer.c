@@ -68,6 +68,80 @@ _timer_get_icr(
 	return p->io.avr->data[p->r_icr] |
 				(p->r_tcnth ? (p->io.avr->data[p->r_icrh] << 8) : 0);
 }
+/*
+ * Compare and overflow events are only scheduled when they have an observable
+ * effect: an enabled interrupt, a 'raised' flag that isn't set yet (the
+ * firmware could poll it), someone listening to the vector IRQs, or to the
+ * comparator output, see _avr_timer_out_observed(). Otherwise TCNT is just
+ * derived from tov_base, and a running timer nobody looks at costs nothing,
+ * a PWM dimming a LED nobody samples included.
+ * Writes to the timer registers (TIMSK and TIFR included) re-arm the events
+ * with avr_timer_arm(). Like any other IRQ hooks, listeners are expected to
+ * be registered before the timer starts.
+ */
+static int
+_avr_timer_vector_observed(
+		avr_t * avr,
+		avr_int_vector_t * vector)
+{
+	if (!vector->vector)
+		return 0;
+	return avr_regbit_get(avr, vector->enable) ||
+			(vector->raised.reg && !avr_regbit_get(avr, vector->raised)) ||
+			vector->irq[AVR_INT_IRQ_PENDING].hook ||
+			avr->interrupts.irq[AVR_INT_IRQ_PENDING].hook;
+}
+
+/*
+ * The comparator output is always connected to its pin, if it has one, so
+ * it's the listeners past the pin that count. A toggle writes PORT, which
+ * the firmware can read back, so it always counts.
+ */
+static int
+_avr_timer_out_observed(
+		avr_timer_t * p,
+		int compi)
+{
+	avr_t * avr = p->io.avr;
+	avr_irq_t * irq = &p->io.irq[TIMER_IRQ_OUT_COMP + compi];
+	avr_regbit_t pin = p->comp[compi].com_pin;
+
+	switch (avr_regbit_get(avr, p->comp[compi].com)) {
+		case avr_timer_com_normal:
+			return 0;
+		case avr_timer_com_toggle:
+			if (pin.reg)
+				return 1;
+			break;
+	}
+	if (!pin.reg)
+		return irq->hook != NULL;
+	return avr_irq_hook_count(irq) > 1 ||
+			avr_ioctl(avr, AVR_IOCTL_IOPORT_PIN_WATCHED, &pin) != 0;
+}
+
+static int
+_avr_timer_comp_observed(
+		avr_timer_t * p,
+		int compi)
+{
+	return _avr_timer_vector_observed(p->io.avr, &p->comp[compi].interrupt) ||
+			_avr_timer_out_observed(p, compi);
+}
+
+static int
+_avr_timer_tov_observed(
+		avr_timer_t * p)
+{
+	if (_avr_timer_vector_observed(p->io.avr, &p->overflow))
+		return 1;
+	// the comparators are re-armed by the overflow
+	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++)
+		if (p->comp[compi].comp_cycles && _avr_timer_comp_observed(p, compi))
+			return 1;
+	return 0;
+}
+
 static avr_cycle_count_t
 avr_timer_comp(
 		avr_timer_t *p,
@@ -177,7 +251,7 @@ avr_timer_tov(
 		{ avr_timer_compa, avr_timer_compb, avr_timer_compc };
 
 	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++) {
-		if (p->comp[compi].comp_cycles) {
+		if (p->comp[compi].comp_cycles && _avr_timer_comp_observed(p, compi)) {
 			if (p->comp[compi].comp_cycles < p->tov_cycles) {
 				avr_timer_comp_on_tov(p, when, compi);
 				avr_cycle_timer_register(avr,
@@ -187,17 +261,79 @@ avr_timer_tov(
 				dispatch[compi](avr, when, param);
 		}
 	}
-
+	// nobody cares, stop here. avr_timer_arm() will restart us if needed
+	if (!_avr_timer_tov_observed(p))
+		return 0;
 	return when + p->tov_cycles;
 }
 
+/*
+ * The output was left alone while nobody looked at it: set it to the level
+ * it has at this point of the period, as if all the edges had been raised
+ */
+static void
+avr_timer_comp_catch_up(
+		avr_timer_t * p,
+		int compi,
+		avr_cycle_count_t elapsed)
+{
+	avr_irq_t * irq = &p->io.irq[TIMER_IRQ_OUT_COMP + compi];
+	int match = elapsed >= p->comp[compi].comp_cycles;
+	uint32_t level;
+
+	switch (avr_regbit_get(p->io.avr, p->comp[compi].com)) {
+		case avr_timer_com_clear:	// set on tov, clear on match
+			level = !match;
+			break;
+		case avr_timer_com_set:
+			level = match;
+			break;
+		default:	// a toggle can't be left alone
+			return;
+	}
+	if (irq->value != level)
+		avr_raise_irq(irq, level);
+}
+
+/*
+ * (Re)schedule the overflow and compare events that became observable,
+ * at the right phase of the current period.
+ */
+static void
+avr_timer_arm(
+		avr_timer_t * p)
+{
+	avr_t * avr = p->io.avr;
+	static const avr_cycle_timer_t dispatch[AVR_TIMER_COMP_COUNT] =
+		{ avr_timer_compa, avr_timer_compb, avr_timer_compc };
+
+	if (p->tov_cycles <= 1 || !_avr_timer_tov_observed(p))
+		return;
+	avr_cycle_count_t elapsed = (avr->cycle - p->tov_base) % p->tov_cycles;
+
+	if (!avr_cycle_timer_status(avr, avr_timer_tov, p)) {
+		p->tov_base = avr->cycle - elapsed;
+		avr_cycle_timer_register(avr, p->tov_cycles - elapsed, avr_timer_tov, p);
+	}
+	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++) {
+		avr_cycle_count_t comp = p->comp[compi].comp_cycles;
+		if (!comp || comp >= p->tov_cycles || !_avr_timer_comp_observed(p, compi) ||
+				avr_cycle_timer_status(avr, dispatch[compi], p))
+			continue;
+		avr_timer_comp_catch_up(p, compi, elapsed);
+		if (comp > elapsed)
+			avr_cycle_timer_register(avr, comp - elapsed, dispatch[compi], p);
+	}
+}
+
 static uint16_t
 _avr_timer_get_current_tcnt(
 		avr_timer_t * p)
 {
 	avr_t * avr = p->io.avr;
 	if (p->tov_cycles) {
-		uint64_t when = avr->cycle - p->tov_base;
+		// the overflow timer might not be running, see avr_timer_arm()
+		uint64_t when = (avr->cycle - p->tov_base) % p->tov_cycles;
 
 		return (when * (((uint32_t)p->tov_top)+1)) / p->tov_cycles;
 	}
@@ -407,6 +543,7 @@ avr_timer_write_ocr(
 			avr_timer_reconfigure(timer);
 			break;
 	}
+	avr_timer_arm(timer);
 }
 
 static void
@@ -459,6 +596,8 @@ avr_timer_write(
 
 		avr_timer_reconfigure(p);
 	}
+	// the output compare modes might have changed
+	avr_timer_arm(p);
 }
 
 /*
@@ -490,6 +629,25 @@ avr_timer_write_pending(
 
 	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++)
 		avr_clear_interrupt_if(avr, &p->comp[compi].interrupt, cp[compi]);
+	// cleared flags need to be raised again
+	avr_timer_arm(p);
+}
+
+/*
+ * write to the TIMSK register(s). The events might need to be rescheduled
+ * if an interrupt gets enabled.
+ */
+static void
+avr_timer_write_imsk(
+		struct avr_t * avr,
+		avr_io_addr_t addr,
+		uint8_t v,
+		void * param)
+{
+	avr_timer_t * p = (avr_timer_t *)param;
+
+	avr_core_watch_write(avr, addr, v);
+	avr_timer_arm(p);
 }
 
 static void
@@ -645,6 +803,18 @@ avr_timer_init(
 	// register. Might not be true on all devices ?
 	avr_register_io_write(avr, p->overflow.raised.reg, avr_timer_write_pending, p);
 
+	// watch the interrupt enable register(s), to re-arm the events when needed
+	avr_io_addr_t imsk[1 + AVR_TIMER_COMP_COUNT] = { p->overflow.enable.reg };
+	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++)
+		imsk[1 + compi] = p->comp[compi].interrupt.enable.reg;
+	for (int i = 0; i < ARRAY_SIZE(imsk); i++) {
+		int done = !imsk[i] || imsk[i] == p->overflow.raised.reg;
+		for (int j = 0; j < i && !done; j++)
+			done = imsk[j] == imsk[i];
+		if (!done)
+			avr_register_io_write(avr, imsk[i], avr_timer_write_imsk, p);
+	}
+
 	/*
 	 * Even if the timer is 16 bits, we don't care to have watches on the
 	 * high bytes because the datasheet says that the low address is always
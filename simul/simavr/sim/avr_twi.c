@@ -20,6 +20,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include "avr_twi.h"
 
 /*
@@ -106,10 +107,8 @@ avr_twi_set_state_timer(
 }
 
 /*
- * This is supposed to trigger a timer whose duration is a multiple
- * of 'twi' clock cycles, which should be derived from the prescaler
- * (100khz, 400khz etc).
- * Right now it cheats and uses one twi cycle == one usec.
+ * Trigger a timer whose duration is a multiple of 'twi' clock cycles,
+ * SCL is F_CPU / (16 + 2 * TWBR * 4^TWPS), see the datasheet.
  */
 static void
 _avr_twi_delay_state(
@@ -117,10 +116,38 @@ _avr_twi_delay_state(
 		int twi_cycles,
 		uint8_t state)
 {
+	avr_t * avr = p->io.avr;
+	avr_cycle_count_t scl = 16 +
+			(2 * avr->data[p->r_twbr] << (2 * avr_regbit_get(avr, p->twps)));
+
 	p->next_twstate = state;
-	// TODO: calculate clock rate, convert to cycles, and use that
-	avr_cycle_timer_register_usec(
-			p->io.avr, twi_cycles, avr_twi_set_state_timer, p);
+	avr_cycle_timer_register(avr, twi_cycles * scl, avr_twi_set_state_timer, p);
+}
+
+static avr_twi_slave_t *
+_avr_twi_find_slave(
+		avr_twi_t * p,
+		uint8_t addr)
+{
+	for (int i = 0; i < p->slave_count; i++) {
+		avr_twi_slave_t * s = &p->slave[i];
+		if ((s->addr & ~s->mask) == (addr & ~s->mask))
+			return s;
+	}
+	return NULL;
+}
+
+// a STOP or repeated START ends a transaction level transfer
+static void
+_avr_twi_fast_end(
+		avr_twi_t * p)
+{
+	avr_twi_slave_t * s = p->fast.slave;
+
+	if (s && p->fast.len && s->write)
+		s->write(s->param, p->peer_addr, p->fast.buf, p->fast.len);
+	p->fast.slave = NULL;
+	p->fast.len = 0;
 }
 
 static void
@@ -156,6 +183,8 @@ avr_twi_write(
 			avr_clear_interrupt(avr, &p->twi);
 			avr_core_watch_write(avr, p->r_twdr, 0xff);
 			_avr_twi_status_set(p, TWI_NO_STATE, 0);
+			p->fast.slave = NULL;
+			p->fast.len = 0;
 			p->state = 0;
 			p->peer_addr = 0;
 		}
@@ -178,7 +207,9 @@ avr_twi_write(
 #if AVR_TWI_DEBUG
 		AVR_TRACE(avr, "<<<<< I2C stop\n");
 #endif
-		if (p->state) { // doing stuff
+		if (p->fast.slave)
+			_avr_twi_fast_end(p);
+		else if (p->state) { // doing stuff
 			if (p->state & TWI_COND_START) {
 				avr_raise_irq(p->io.irq + TWI_IRQ_OUTPUT,
 						avr_twi_irq_msg(TWI_COND_STOP, p->peer_addr, 1));
@@ -193,6 +224,7 @@ avr_twi_write(
 #if AVR_TWI_DEBUG
 		AVR_TRACE(avr, ">>>>> I2C %sstart\n", p->state & TWI_COND_START ? "RE" : "");
 #endif
+		_avr_twi_fast_end(p);
 		// generate a start condition
 		if (p->state & TWI_COND_START)
 			_avr_twi_delay_state(p, 0, TWI_REP_START);
@@ -265,7 +297,23 @@ avr_twi_write(
 
 			AVR_TRACE(avr, "state %02x want %02x\n", p->state, msgv);
 			// if the latch is ready... as set by writing/reading the TWDR
-			if (p->state & msgv) {
+			if ((p->state & msgv) && p->fast.slave) {
+				avr_twi_slave_t * s = p->fast.slave;
+				if (do_read) {
+					uint8_t b = 0xff;
+					if (s->read)
+						s->read(s->param, p->peer_addr, &b, 1);
+					avr->data[p->r_twdr] = b;
+					_avr_twi_delay_state(p, 9,
+							do_ack ? TWI_MRX_DATA_ACK : TWI_MRX_DATA_NACK);
+				} else {
+					int room = p->fast.len < AVR_TWI_FAST_BUFFER;
+					if (room)
+						p->fast.buf[p->fast.len++] = avr->data[p->r_twdr];
+					_avr_twi_delay_state(p, 9,
+							room ? TWI_MTX_DATA_ACK : TWI_MTX_DATA_NACK);
+				}
+			} else if (p->state & msgv) {
 
 				// we send an IRQ and we /expect/ a slave to reply
 				// immediately via an IRQ to set the COND_ACK bit
@@ -296,11 +344,17 @@ avr_twi_write(
 			p->peer_addr = avr->data[p->r_twdr];
 			p->state &= ~TWI_COND_ACK;	// clear ACK bit
 
-			// we send an IRQ and we /expect/ a slave to reply
+			// transaction level slaves ack right away, the others
+			// get an IRQ and we /expect/ a slave to reply
 			// immediately via an IRQ tp set the COND_ACK bit
 			// otherwise it's assumed it's been nacked...
-			avr_raise_irq(p->io.irq + TWI_IRQ_OUTPUT,
-					avr_twi_irq_msg(TWI_COND_START, p->peer_addr, 0));
+			p->fast.slave = _avr_twi_find_slave(p, p->peer_addr);
+			p->fast.len = 0;
+			if (p->fast.slave)
+				p->state |= TWI_COND_ACK;
+			else
+				avr_raise_irq(p->io.irq + TWI_IRQ_OUTPUT,
+						avr_twi_irq_msg(TWI_COND_START, p->peer_addr, 0));
 
 			if (p->peer_addr & 1) { // read ?
 				p->state |= TWI_COND_READ;	// always allow read to start with
@@ -459,6 +513,8 @@ void avr_twi_reset(struct avr_io_t *io)
 	avr_twi_t * p = (avr_twi_t *)io;
 	avr_irq_register_notify(p->io.irq + TWI_IRQ_INPUT, avr_twi_irq_input, p);
 	p->state = p->peer_addr = 0;
+	p->fast.slave = NULL;
+	p->fast.len = 0;
 	avr_regbit_setto_raw(p->io.avr, p->twsr, TWI_NO_STATE);
 }
 
@@ -468,9 +524,41 @@ static const char * irq_names[TWI_IRQ_COUNT] = {
 	[TWI_IRQ_STATUS] = "8>status",
 };
 
+static int
+avr_twi_ioctl(
+		struct avr_io_t * port,
+		uint32_t ctl,
+		void * io_param)
+{
+	avr_twi_t * p = (avr_twi_t *)port;
+
+	if (ctl != AVR_IOCTL_TWI_ADD_SLAVE(p->name) || !io_param)
+		return -1;
+	if (!p->fast.buf)
+		p->fast.buf = malloc(AVR_TWI_FAST_BUFFER);
+	p->slave = realloc(p->slave, (p->slave_count + 1) * sizeof(*p->slave));
+	p->slave[p->slave_count++] = *(avr_twi_slave_t *)io_param;
+	return 0;
+}
+
+static void
+avr_twi_dealloc(
+		struct avr_io_t * port)
+{
+	avr_twi_t * p = (avr_twi_t *)port;
+
+	free(p->slave);
+	free(p->fast.buf);
+	p->slave = NULL;
+	p->fast.buf = NULL;
+	p->slave_count = 0;
+}
+
 static	avr_io_t	_io = {
 	.kind = "twi",
 	.reset = avr_twi_reset,
+	.ioctl = avr_twi_ioctl,
+	.dealloc = avr_twi_dealloc,
 	.irq_names = irq_names,
 };
 
@@ -65,6 +65,32 @@ typedef struct avr_twi_msg_irq_t {
 // add port number to get the real IRQ
 #define AVR_IOCTL_TWI_GETIRQ(_name) AVR_IOCTL_DEF('t','w','i',(_name))
 
+/*
+ * Transaction level slaves. Instead of answering each start, address and
+ * data phase on TWI_IRQ_OUTPUT/TWI_IRQ_INPUT, a part can register handlers
+ * for whole transfers. When the AVR master addresses one of these, nothing
+ * is raised on TWI_IRQ_OUTPUT for the transfer; the TWI acks by itself,
+ * buffers what the master writes and hands it to 'write' in one call at
+ * the STOP or repeated START, and asks 'read' for the bytes the master
+ * clocks in (one at a time, as the master only tells it wants more by
+ * acking the previous one). Bus timing is the same as without.
+ * 'addr' is the 8 bits bus address, including the read/write bit; a slave
+ * matches when (addr & ~mask) == (slave addr & ~mask).
+ * 'read' returns the number of bytes it filled, zero reads as 0xff.
+ */
+typedef struct avr_twi_slave_t {
+	uint8_t		addr;
+	uint8_t		mask;
+	void *		param;
+	int (*write)(void * param, uint8_t addr, const uint8_t * buf, int n);
+	int (*read)(void * param, uint8_t addr, uint8_t * buf, int n);
+} avr_twi_slave_t;
+
+// takes a avr_twi_slave_t*, which is copied
+#define AVR_IOCTL_TWI_ADD_SLAVE(_name) AVR_IOCTL_DEF('t','w','s',(_name))
+
+#define AVR_TWI_FAST_BUFFER	512	// longest write transfer, the rest is NACKed
+
 typedef struct avr_twi_t {
 	avr_io_t	io;
 	char name;
@@ -92,6 +118,14 @@ typedef struct avr_twi_t {
 	uint8_t state;
 	uint8_t peer_addr;
 	uint8_t next_twstate;
+
+	avr_twi_slave_t * slave;	// transaction level slaves, if any
+	uint8_t		slave_count;
+	struct {
+		avr_twi_slave_t * slave;	// current transfer goes to this one
+		uint16_t	len;
+		uint8_t *	buf;			// AVR_TWI_FAST_BUFFER bytes
+	} fast;
 } avr_twi_t;
 
 void
@@ -35,15 +35,99 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include "avr_uart.h"
 #include "sim_hex.h"
+#include "sim_time.h"
 
 //#define TRACE(_w) _w
 #ifndef TRACE
 #define TRACE(_w)
 #endif
 
-DEFINE_FIFO(uint8_t, uart_fifo);
+/*
+ * The reception fifo. Same as a DECLARE_FIFO one, except the size is
+ * only known at runtime
+ */
+static inline uint32_t
+uart_input_count(
+		avr_uart_t * p)
+{
+	return (p->input_write - p->input_read) & (p->input_size - 1);
+}
+
+static inline int
+uart_input_isempty(
+		avr_uart_t * p)
+{
+	return p->input_read == p->input_write;
+}
+
+static inline int
+uart_input_isfull(
+		avr_uart_t * p)
+{
+	return uart_input_count(p) == p->input_size - 1;
+}
+
+static inline void
+uart_input_write(
+		avr_uart_t * p,
+		uint8_t b)
+{
+	if (uart_input_isfull(p))
+		return;
+	p->input[p->input_write] = b;
+	p->input_write = (p->input_write + 1) & (p->input_size - 1);
+}
+
+static inline uint8_t
+uart_input_read(
+		avr_uart_t * p)
+{
+	if (uart_input_isempty(p))
+		return 0;
+	uint8_t b = p->input[p->input_read];
+	p->input_read = (p->input_read + 1) & (p->input_size - 1);
+	return b;
+}
+
+static int
+uart_input_resize(
+		avr_uart_t * p,
+		uint32_t depth)
+{
+	uint32_t size = 2;
+	if (depth > AVR_UART_MAX_DEPTH)
+		return -1;
+	// one slot is always kept free to tell full from empty
+	while (size < depth + 1)
+		size <<= 1;
+	uint32_t count = p->input ? uart_input_count(p) : 0;
+	if (count >= size)
+		return -1;
+	uint8_t * input = malloc(size);
+	if (!input)
+		return -1;
+	for (uint32_t i = 0; i < count; i++)
+		input[i] = p->input[(p->input_read + i) & (p->input_size - 1)];
+	free(p->input);
+	p->input = input;
+	p->input_size = size;
+	p->input_read = 0;
+	p->input_write = count;
+	return 0;
+}
+
+// wire time of one byte, in cycles
+static avr_cycle_count_t
+avr_uart_byte_cycles(
+		avr_uart_t * p)
+{
+	if (p->flags & AVR_UART_FLAG_NO_DELAY)
+		return 0;
+	return avr_usec_to_cycles(p->io.avr, p->usec_per_byte);
+}
 
 static avr_cycle_count_t avr_uart_txc_raise(struct avr_t * avr, avr_cycle_count_t when, void * param)
 {
@@ -64,10 +148,35 @@ static avr_cycle_count_t avr_uart_rxc_raise(struct avr_t * avr, avr_cycle_count_
 	return 0;
 }
 
+// a polling loop, "lds; sbrs; rjmp", comes back within that
+#define AVR_UART_SPIN_CYCLES	8
+
+// our byte timer, if it's the next one due
+static avr_cycle_timer_slot_p avr_uart_next_byte(avr_t * avr, avr_uart_t * p)
+{
+	avr_cycle_timer_slot_p t = avr->cycle_timers.timer;
+	if (t && t->param == p &&
+			(t->timer == avr_uart_rxc_raise || t->timer == avr_uart_txc_raise))
+		return t;
+	return NULL;
+}
+
+/*
+ * Turbo mode, the firmware is spinning on UCSRA with nothing else due
+ * before our byte: the time it would spin goes by at once. It runs as a
+ * timer, between instructions, and the byte timer fires right after it
+ */
+static avr_cycle_count_t avr_uart_spin_skip(struct avr_t * avr, avr_cycle_count_t when, void * param)
+{
+	avr_cycle_timer_slot_p t = avr_uart_next_byte(avr, (avr_uart_t *)param);
+	if (t && t->when > avr->cycle)
+		avr->cycle = t->when;
+	return 0;
+}
+
 static uint8_t avr_uart_rxc_read(struct avr_t * avr, avr_io_addr_t addr, void * param)
 {
 	avr_uart_t * p = (avr_uart_t *)param;
-	uint8_t v = avr_core_watch_read(avr, addr);
 
 	//static uint8_t old = 0xff; if (v != old) printf("UCSRA read %02x\n", v); old = v;
 	//
@@ -80,18 +189,31 @@ static uint8_t avr_uart_rxc_read(struct avr_t * avr, avr_io_addr_t addr, void *
 	uint8_t ri = !avr_regbit_get(avr, p->rxen) || !avr_regbit_get(avr, p->rxc.raised);
 	uint8_t ti = !avr_regbit_get(avr, p->txen) || !avr_regbit_get(avr, p->txc.raised);
 
-	if (p->flags & AVR_UART_FLAG_POOL_SLEEP) {
-
-		if (ri && ti)
+	if (ri && ti) {
+		/*
+		 * In turbo mode, the same instruction polling again a few cycles
+		 * later is a loop spinning. If our own byte timer is the very next
+		 * thing due, nothing else can happen until then, so skip ahead to
+		 * it once this instruction is done, see avr_uart_spin_skip()
+		 */
+		int spin = p->poll_pc == avr->pc &&
+				avr->cycle - p->poll_cycle <= AVR_UART_SPIN_CYCLES;
+		p->poll_pc = avr->pc;
+		p->poll_cycle = avr->cycle;
+		if ((p->flags & AVR_UART_FLAG_TURBO) && spin &&
+				avr_uart_next_byte(avr, p))
+			avr_cycle_timer_register(avr, 0, avr_uart_spin_skip, p);
+		else if (p->flags & AVR_UART_FLAG_POOL_SLEEP)
 			usleep(1);
-	}
+	} else
+		p->poll_pc = ~0;
 	// if reception is idle and the fifo is empty, tell whomever there is room
-	if (avr_regbit_get(avr, p->rxen) && uart_fifo_isempty(&p->input)) {
+	if (avr_regbit_get(avr, p->rxen) && uart_input_isempty(p)) {
 		avr_raise_irq(p->io.irq + UART_IRQ_OUT_XOFF, 0);
 		avr_raise_irq(p->io.irq + UART_IRQ_OUT_XON, 1);
 	}
 
-	return v;
+	return avr_core_watch_read(avr, addr);
 }
 
 static uint8_t avr_uart_read(struct avr_t * avr, avr_io_addr_t addr, void * param)
@@ -107,16 +229,16 @@ static uint8_t avr_uart_read(struct avr_t * avr, avr_io_addr_t addr, void * para
 		avr_core_watch_read(avr, addr);
 		return 0;
 	}
-	uint8_t v = uart_fifo_read(&p->input);
+	uint8_t v = uart_input_read(p);
 
-//	TRACE(printf("UART read %02x %s\n", v, uart_fifo_isempty(&p->input) ? "EMPTY!" : "");)
+//	TRACE(printf("UART read %02x %s\n", v, uart_input_isempty(p) ? "EMPTY!" : "");)
 	avr->data[addr] = v;
 	// made to trigger potential watchpoints
 	v = avr_core_watch_read(avr, addr);
 
 	// trigger timer if more characters are pending
-	if (!uart_fifo_isempty(&p->input))
-		avr_cycle_timer_register_usec(avr, p->usec_per_byte, avr_uart_rxc_raise, p);
+	if (!uart_input_isempty(p))
+		avr_cycle_timer_register(avr, avr_uart_byte_cycles(p), avr_uart_rxc_raise, p);
 
 	return v;
 }
@@ -152,8 +274,8 @@ static void avr_uart_udr_write(struct avr_t * avr, avr_io_addr_t addr, uint8_t v
 
 	if ( p->udrc.vector)
 		avr_regbit_clear(avr, p->udrc.raised);
-	avr_cycle_timer_register_usec(avr,
-			p->usec_per_byte, avr_uart_txc_raise, p); // should be uart speed dependent
+	avr_cycle_timer_register(avr,
+			avr_uart_byte_cycles(p), avr_uart_txc_raise, p);
 
 	if (p->flags & AVR_UART_FLAG_STDIO) {
 		const int maxsize = 256;
@@ -217,13 +339,33 @@ static void avr_uart_irq_input(struct avr_irq_t * irq, uint32_t value, void * pa
 	if (!avr_regbit_get(avr, p->rxen))
 		return;
 
-	if (uart_fifo_isempty(&p->input))
-		avr_cycle_timer_register_usec(avr, p->usec_per_byte, avr_uart_rxc_raise, p); // should be uart speed dependent
-	uart_fifo_write(&p->input, value); // add to fifo
+	if (uart_input_isempty(p))
+		avr_cycle_timer_register(avr, avr_uart_byte_cycles(p), avr_uart_rxc_raise, p);
+	uart_input_write(p, value); // add to fifo
+
+	TRACE(printf("UART IRQ in %02x (%d/%d) %s\n", value, p->input_read, p->input_write, uart_input_isfull(p) ? "FULL!!" : "");)
+
+	if (uart_input_isfull(p))
+		avr_raise_irq(p->io.irq + UART_IRQ_OUT_XOFF, 1);
+}
+
+/*
+ * Same as raising UART_IRQ_INPUT for each byte, without going through
+ * the IRQ hooks and the rx timer for each of them
+ */
+static void avr_uart_push_buf(avr_uart_t * p, avr_uart_buf_t * b)
+{
+	avr_t * avr = p->io.avr;
 
-	TRACE(printf("UART IRQ in %02x (%d/%d) %s\n", value, p->input.read, p->input.write, uart_fifo_isfull(&p->input) ? "FULL!!" : "");)
+	b->done = 0;
+	if (!avr_regbit_get(avr, p->rxen))
+		return;
+	if (uart_input_isempty(p) && b->len)
+		avr_cycle_timer_register(avr, avr_uart_byte_cycles(p), avr_uart_rxc_raise, p);
+	while (b->done < b->len && !uart_input_isfull(p))
+		uart_input_write(p, b->buf[b->done++]);
 
-	if (uart_fifo_isfull(&p->input))
+	if (uart_input_isfull(p))
 		avr_raise_irq(p->io.irq + UART_IRQ_OUT_XOFF, 1);
 }
 
@@ -237,7 +379,9 @@ void avr_uart_reset(struct avr_io_t *io)
 	avr_irq_register_notify(p->io.irq + UART_IRQ_INPUT, avr_uart_irq_input, p);
 	avr_cycle_timer_cancel(avr, avr_uart_rxc_raise, p);
 	avr_cycle_timer_cancel(avr, avr_uart_txc_raise, p);
-	uart_fifo_reset(&p->input);
+	avr_cycle_timer_cancel(avr, avr_uart_spin_skip, p);
+	p->input_read = p->input_write = 0;
+	p->poll_pc = ~0;
 
         avr_regbit_set(avr, p->ucsz);
         avr_regbit_clear(avr, p->ucsz2);
@@ -263,6 +407,17 @@ static int avr_uart_ioctl(struct avr_io_t * port, uint32_t ctl, void * io_param)
 		*(uint32_t*)io_param = p->flags;
 		res = 0;
 	}
+	if (ctl == AVR_IOCTL_UART_SET_DEPTH(p->name)) {
+		res = uart_input_resize(p, *(uint32_t*)io_param);
+		if (res)
+			AVR_LOG(p->io.avr, LOG_WARNING,
+					"UART: %c: can't set fifo depth to %d\n",
+					p->name, *(uint32_t*)io_param);
+	}
+	if (ctl == AVR_IOCTL_UART_PUSH_BUF(p->name)) {
+		avr_uart_push_buf(p, (avr_uart_buf_t*)io_param);
+		res = 0;
+	}
 
 	return res;
 }
@@ -274,10 +429,21 @@ static const char * irq_names[UART_IRQ_COUNT] = {
 	[UART_IRQ_OUT_XOFF] = ">xoff",
 };
 
+static void avr_uart_dealloc(struct avr_io_t * port)
+{
+	avr_uart_t * p = (avr_uart_t *)port;
+
+	free(p->input);
+	p->input = NULL;
+	free(p->stdio_out);
+	p->stdio_out = NULL;
+}
+
 static	avr_io_t	_io = {
 	.kind = "uart",
 	.reset = avr_uart_reset,
 	.ioctl = avr_uart_ioctl,
+	.dealloc = avr_uart_dealloc,
 	.irq_names = irq_names,
 };
 
@@ -288,6 +454,8 @@ void avr_uart_init(avr_t * avr, avr_uart_t * p)
 //	printf("%s UART%c UDR=%02x\n", __FUNCTION__, p->name, p->r_udr);
 
 	p->flags = AVR_UART_FLAG_POOL_SLEEP|AVR_UART_FLAG_STDIO;
+	p->input = NULL;
+	uart_input_resize(p, AVR_UART_FIFO_DEFAULT - 1);
 
 	avr_register_io(avr, &p->io);
 	avr_register_vector(avr, &p->rxc);
@@ -28,10 +28,6 @@ extern "C" {
 
 #include "sim_avr.h"
 
-#include "fifo_declare.h"
-
-DECLARE_FIFO(uint8_t, uart_fifo, 64);
-
 /*
  * The method of "connecting" the the UART from external code is to use 4 IRQS.
  * The easy one is UART->YOU, where you will be called with the byte every time
@@ -78,11 +74,20 @@ enum {
 enum {
 	// the uart code monitors for firmware that pool on
 	// reception registers, and can do an atomic usleep()
-	// if it's detected, this helps regulating CPU
+	// if it's detected, this helps regulating CPU.
 	AVR_UART_FLAG_POOL_SLEEP = (1 << 0),
 	AVR_UART_FLAG_STDIO = (1 << 1),			// print lines on the console
+	// "turbo", a loop spinning on UCSRA while a byte is on its way skips
+	// ahead to it, rather than running or sleeping until it's there.
+	// The loop must do nothing else: a poll with a timeout count loses it
+	AVR_UART_FLAG_TURBO = (1 << 2),
+	// bytes take no time on the wire, both ways. The firmware sees a
+	// byte as soon as it's pushed, and UDRE right after a write
+	AVR_UART_FLAG_NO_DELAY = (1 << 3),
 };
 
+#define AVR_UART_FIFO_DEFAULT	64
+
 typedef struct avr_uart_t {
 	avr_io_t	io;
 	char name;
@@ -106,10 +111,16 @@ typedef struct avr_uart_t {
 	avr_int_vector_t txc;
 	avr_int_vector_t udrc;	
 
-	uart_fifo_t	input;
+	// reception fifo, see AVR_IOCTL_UART_SET_DEPTH
+	uint8_t *		input;
+	uint32_t		input_size;	// power of two
+	uint32_t		input_read, input_write;
 
 	uint32_t		flags;
 	avr_cycle_count_t usec_per_byte;
+	// last poll of UCSRA that found nothing, to tell a spinning loop
+	avr_flashaddr_t	poll_pc;
+	avr_cycle_count_t poll_cycle;
 
 	uint8_t *		stdio_out;
 	int				stdio_len;	// current size in the stdio output
@@ -118,6 +129,27 @@ typedef struct avr_uart_t {
 /* takes a uint32_t* as parameter */
 #define AVR_IOCTL_UART_SET_FLAGS(_name)	AVR_IOCTL_DEF('u','a','s',(_name))
 #define AVR_IOCTL_UART_GET_FLAGS(_name)	AVR_IOCTL_DEF('u','a','g',(_name))
+/*
+ * takes a uint32_t* as parameter, the number of bytes the reception fifo
+ * can hold, rounded up to a power of two, up to AVR_UART_MAX_DEPTH.
+ * Pending bytes are kept, if they fit
+ */
+#define AVR_IOCTL_UART_SET_DEPTH(_name)	AVR_IOCTL_DEF('u','a','d',(_name))
+#define AVR_UART_MAX_DEPTH	(1 << 24)
+
+/*
+ * Bulk version of raising UART_IRQ_INPUT for each byte, takes a
+ * avr_uart_buf_t* as parameter. As many bytes as there is room for in
+ * the fifo are queued, and 'done' is set to that count; XOFF is raised
+ * if it didn't all fit
+ */
+typedef struct avr_uart_buf_t {
+	const uint8_t *	buf;
+	uint32_t		len;
+	uint32_t		done;
+} avr_uart_buf_t;
+
+#define AVR_IOCTL_UART_PUSH_BUF(_name)	AVR_IOCTL_DEF('u','a','b',(_name))
 
 void avr_uart_init(avr_t * avr, avr_uart_t * port);
 
@@ -20,7 +20,6 @@
  */
 
 /* TODO correct reset values */
-/* TODO generate sofi every 1ms (when connected) */
 /* TODO otg support? */
 /* TODO drop bitfields? */
 /* TODO thread safe ioctls */
@@ -31,6 +30,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include "sim_time.h"
 #include "avr_usb.h"
 
 enum usb_regs
@@ -151,6 +151,10 @@ struct usb_internal_state {
 	struct _epstate ep_state[5];
 	avr_int_vector_t com_vect;
 	avr_int_vector_t gen_vect;
+	// stamped by the host side ioctls, maybe from another thread
+	volatile avr_cycle_count_t host_activity;
+	uint16_t frame;		// UDFNUM
+	avr_cycle_count_t sof_cycle;	// when that frame started
 };
 
 const uint8_t num_endpoints = 5;//sizeof (struct usb_internal_state.ep_state) / sizeof (struct usb_internal_state.ep_state[0]);
@@ -400,13 +404,23 @@ avr_usb_udaddr_write(
 	avr_core_watch_write(avr, addr, v);
 }
 
+static avr_cycle_count_t
+sof_generator(
+        struct avr_t * avr,
+        avr_cycle_count_t when,
+        void * param);
+
 static void
 avr_usb_udcon_write(struct avr_t * avr, avr_io_addr_t addr, uint8_t v, void * param)
 {
 	avr_usb_t * p = (avr_usb_t *)param;
 
-	if(avr->data[addr]&1 && !(v&1))
+	if(avr->data[addr]&1 && !(v&1)) {
 		avr_raise_irq(p->io.irq + USB_IRQ_ATTACH, !(v&1));
+		// frames run as long as we're attached, see sof_generator()
+		p->state->sof_cycle = avr->cycle;
+		avr_cycle_timer_register_usec(avr, 1000, sof_generator, p);
+	}
 	avr_core_watch_write(avr, addr, v);
 }
 
@@ -473,6 +487,8 @@ avr_usb_ep_write_ueintx(
 
 	if ((curstate->v & 0xdf) == 0)
 		avr->data[p->r_usbcon + ueint] &= 0xff ^ (1 << ep); // mark ep0 interrupt
+
+	avr_raise_irq(p->io.irq + USB_IRQ_EP_UPDATE, ep);
 }
 
 static uint8_t
@@ -534,6 +550,7 @@ avr_usb_ep_write(
 				epstate->ueintx.rxouti = 0;
 			avr_core_watch_write(avr, p->r_usbcon + uesta0x,
 			        epstate->uesta0x.v);
+			avr_raise_irq(p->io.irq + USB_IRQ_EP_UPDATE, current_ep_to_cpu(p));
 			break;
 		case uesta0x:
 			v = (epstate->uesta0x.v & 0x9f) + (v & (0x60 & epstate->uesta0x.v));
@@ -592,7 +609,14 @@ avr_usb_pll_write(
 }
 
 
-avr_cycle_count_t
+/*
+ * Runs every 1ms while attached and a host has used the bus lately. With
+ * no host, or an idle one, it only looks every AVR_USB_IDLE_POLL_USEC, so
+ * neither the firmware nor the simulation are woken up for nothing; the
+ * frames that went by are still counted in UDFNUM. The host side only
+ * stamps host_activity, the timer is handled here, on the AVR side.
+ */
+static avr_cycle_count_t
 sof_generator(
         struct avr_t * avr,
         avr_cycle_count_t when,
@@ -602,10 +626,19 @@ sof_generator(
 	//stop sof generation if detached
 	if (avr->data[p->r_usbcon + udcon] & 1)
 		return 0;
-	else {
-		raise_usb_interrupt(p, sofi);
-		return when;
-	}
+
+	avr_cycle_count_t period = avr_usec_to_cycles(avr, 1000);
+	avr_cycle_count_t frames = (when - p->state->sof_cycle) / period;
+	p->state->frame = (p->state->frame + frames) & 0x7ff;
+	p->state->sof_cycle += frames * period;
+	avr->data[p->r_usbcon + udfnuml] = p->state->frame;
+	avr->data[p->r_usbcon + udfnumh] = p->state->frame >> 8;
+	// stamped by the host thread, it can be a bit ahead of us
+	avr_cycle_count_t last = p->state->host_activity;
+	if (!last || when >= last + avr_usec_to_cycles(avr, AVR_USB_IDLE_USEC))
+		return p->state->sof_cycle + period * (AVR_USB_IDLE_POLL_USEC / 1000);
+	raise_usb_interrupt(p, sofi);
+	return p->state->sof_cycle + period;
 }
 
 static int
@@ -620,6 +653,14 @@ avr_usb_ioctl(
 	int ret;
 	uint8_t ep;
 
+	switch (ctl) {
+		case AVR_IOCTL_USB_READ:
+		case AVR_IOCTL_USB_WRITE:
+		case AVR_IOCTL_USB_SETUP:
+		case AVR_IOCTL_USB_RESET:
+			p->state->host_activity = io->avr->cycle;
+			break;
+	}
 	switch (ctl) {
 		case AVR_IOCTL_USB_READ:
 			ep = d->pipe & 0x7f;
@@ -629,6 +670,9 @@ avr_usb_ioctl(
 				raise_ep_interrupt(io->avr, p, 0, stalledi);
 				return AVR_IOCTL_USB_STALL;
 			}
+			// the bank holds the setup until the firmware acks it
+			if (epstate->ueintx.rxstpi)
+				return AVR_IOCTL_USB_NAK;
 			if (ep && !epstate->uecfg0x.epdir)
 				AVR_LOG(io->avr, LOG_WARNING, "USB: Reading from IN endpoint from host??\n");
 
@@ -659,6 +703,8 @@ avr_usb_ioctl(
 				raise_ep_interrupt(io->avr, p, 0, stalledi);
 				return AVR_IOCTL_USB_STALL;
 			}
+			if (epstate->ueintx.rxstpi)
+				return AVR_IOCTL_USB_NAK;
 
 			ret = ep_fifo_usb_write(epstate, d->buf, d->sz);
 			if (ret < 0)
@@ -671,6 +717,9 @@ avr_usb_ioctl(
 			ep = d->pipe & 0x7f;
 			epstate = get_epstate(p, ep);
 
+			// not configured yet after a reset, the host has to retry
+			if (!epstate->ueconx.epen)
+				return AVR_IOCTL_USB_NAK;
 			epstate->ueconx.stallrq = 0;
 			// teensy actually depends on this (fails to ack rxouti on usb
 			// control read status stage) even if the datasheet clearly states
@@ -687,8 +736,6 @@ avr_usb_ioctl(
 			AVR_LOG(io->avr, LOG_TRACE, "USB: __USB_RESET__\n");
 			reset_endpoints(io->avr, p);
 			raise_usb_interrupt(p, eorsti);
-			if (0)
-				avr_cycle_timer_register_usec(io->avr, 1000, sof_generator, p);
 			return 0;
 		default:
 			return -1;
@@ -709,12 +756,17 @@ avr_usb_reset(
 
 	p->io.avr->data[p->r_usbcon] = 0x20;
 	p->io.avr->data[p->r_usbcon + udcon] = 1;
+	p->state->frame = 0;
+	p->state->host_activity = 0;
+	p->state->sof_cycle = 0;
+	avr_cycle_timer_cancel(p->io.avr, sof_generator, p);
 
 	AVR_LOG(io->avr, LOG_TRACE, "USB: %s\n", __FUNCTION__);
 }
 
 static const char * irq_names[USB_IRQ_COUNT] = {
 	[USB_IRQ_ATTACH] = ">attach",
+	[USB_IRQ_EP_UPDATE] = "8>ep_update",
 };
 
 static void
@@ -30,9 +30,17 @@ extern "C" {
 
 enum {
 	USB_IRQ_ATTACH = 0,
+	// raised with the endpoint number when the firmware changes its
+	// state; a NAKed host transfer on it might go through now
+	USB_IRQ_EP_UPDATE,
 	USB_IRQ_COUNT
 };
 
+// no host transfer for that long, and SOFs stop, as in a suspended bus
+#define AVR_USB_IDLE_USEC	3000
+// how often an idle bus is checked for the host coming back
+#define AVR_USB_IDLE_POLL_USEC	10000
+
 // add port number to get the real IRQ
 #define AVR_IOCTL_USB_WRITE AVR_IOCTL_DEF('u','s','b','w')
 #define AVR_IOCTL_USB_READ AVR_IOCTL_DEF('u','s','b','r')
@@ -29,6 +29,8 @@
 #include "sim_core.h"
 #include "sim_gdb.h"
 #include "sim_hex.h"
+#include "avr_eeprom.h"
+#include "avr_flash.h"
 
 #include "sim_core_decl.h"
 
@@ -39,6 +41,9 @@ void display_usage(char * app)
 		   "       -g: Listen for gdb connection on port 1234\n"
 		   "       -ff: Load next .hex file as flash\n"
 		   "       -ee: Load next .hex file as eeprom\n"
+		   "       -eefile <file>: Keep the eeprom in <file>, across runs\n"
+		   "       -eesync: msync the eeprom file on each eeprom write\n"
+		   "       -flashfile <file>: Run from the flash in <file>, save what SPM changed\n"
 		   "       -v: Raise verbosity level (can be passed more than once)\n"
 		   "   Supported AVR cores:\n");
 	for (int i = 0; avr_kind[i]; i++) {
@@ -73,6 +78,8 @@ int main(int argc, char *argv[])
 	uint32_t loadBase = AVR_SEGMENT_OFFSET_FLASH;
 	int trace_vectors[8] = {0};
 	int trace_vectors_count = 0;
+	avr_eeprom_file_t eefile = { 0 };
+	avr_flash_file_t flashfile = { .commit = 1 };
 
 	if (argc == 1)
 		display_usage(basename(argv[0]));
@@ -101,6 +108,18 @@ int main(int argc, char *argv[])
 			log++;
 		} else if (!strcmp(argv[pi], "-ee")) {
 			loadBase = AVR_SEGMENT_OFFSET_EEPROM;
+		} else if (!strcmp(argv[pi], "-eefile")) {
+			if (pi < argc-1)
+				eefile.filename = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "-eesync")) {
+			eefile.sync = AVR_EEPROM_SYNC_WRITE;
+		} else if (!strcmp(argv[pi], "-flashfile")) {
+			if (pi < argc-1)
+				flashfile.filename = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
 		} else if (!strcmp(argv[pi], "-ff")) {
 			loadBase = AVR_SEGMENT_OFFSET_FLASH;			
 		} else if (argv[pi][0] != '-') {
@@ -155,6 +174,19 @@ int main(int argc, char *argv[])
 	}
 	avr_init(avr);
 	avr_load_firmware(avr, &f);
+	// after the firmware, an existing file has precedence over its .eeprom
+	if (eefile.filename &&
+			avr_ioctl(avr, AVR_IOCTL_EEPROM_SET_FILE, &eefile) < 0) {
+		fprintf(stderr, "%s: Unable to use %s for the eeprom\n",
+				argv[0], eefile.filename);
+		exit(1);
+	}
+	if (flashfile.filename &&
+			avr_ioctl(avr, AVR_IOCTL_FLASH_SET_FILE, &flashfile) < 0) {
+		fprintf(stderr, "%s: Unable to use %s for the flash\n",
+				argv[0], flashfile.filename);
+		exit(1);
+	}
 	if (f.flashbase) {
 		printf("Attempted to load a bootloader at %04x\n", f.flashbase);
 		avr->pc = f.flashbase;
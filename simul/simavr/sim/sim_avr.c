@@ -29,6 +29,7 @@
 #include "sim_time.h"
 #include "sim_gdb.h"
 #include "avr_uart.h"
+#include "avr_eeprom.h"
 #include "sim_vcd_file.h"
 #include "avr/avr_mcu_section.h"
 
@@ -73,6 +74,10 @@ int avr_init(avr_t * avr)
 	avr->codeend = avr->flashend;
 	avr->data = malloc(avr->ramend + 1);
 	memset(avr->data, 0, avr->ramend + 1);
+	// IO table covers 0x20..ramend, but no more than MAX_IOs
+	avr->io_count = avr->ramend + 1 - 32 > MAX_IOs ?
+			MAX_IOs : avr->ramend + 1 - 32;
+	avr->io = calloc(avr->io_count, sizeof(avr->io[0]));
 #ifdef CONFIG_SIMAVR_TRACE
 	avr->trace_data = calloc(1, sizeof(struct avr_trace_data_t));
 #endif
@@ -113,6 +118,12 @@ void avr_terminate(avr_t * avr)
 
 	if (avr->flash) free(avr->flash);
 	if (avr->data) free(avr->data);
+	if (avr->io) free(avr->io);
+	avr->io = NULL;
+	avr->io_count = 0;
+	if (avr->io_shared_io) free(avr->io_shared_io);
+	avr->io_shared_io = NULL;
+	avr->io_shared_io_count = 0;
 	if (avr->io_console_buffer.buf) {
 		avr->io_console_buffer.len = 0;
 		avr->io_console_buffer.size = 0;
@@ -362,9 +373,38 @@ avr_core_allocate(
 {
 	uint8_t * b = malloc(coreLen);
 	memcpy(b, core, coreLen);
+	((avr_t *)b)->core_size = coreLen;
 	return (avr_t *)b;
 }
 
+uint32_t
+avr_instance_footprint(
+		avr_t * avr,
+		avr_footprint_t * fp)
+{
+	avr_footprint_t f = {
+		.core = avr->core_size ? avr->core_size : sizeof(avr_t),
+		.io_table = avr->io_count * sizeof(avr->io[0]) +
+				avr->io_shared_io_count * sizeof(avr->io_shared_io[0]),
+		.irq = avr_irq_pool_footprint(&avr->irq_pool),
+		.shared = avr_irq_names_footprint(),
+	};
+	if (avr->flash)
+		f.memory += avr->flashend + 1;
+	if (avr->data)
+		f.memory += avr->ramend + 1;
+	avr_eeprom_desc_t ee = { .ee = NULL, .offset = 0, .size = 0 };
+	avr_ioctl(avr, AVR_IOCTL_EEPROM_GET, &ee);
+	if (ee.ee)
+		f.memory += avr->e2end + 1;
+	if (avr->trace_data)
+		f.trace = sizeof(struct avr_trace_data_t);
+	f.total = f.core + f.io_table + f.irq + f.memory + f.trace;
+	if (fp)
+		*fp = f;
+	return f.total;
+}
+
 avr_t *
 avr_make_mcu_by_name(
 		const char *name)
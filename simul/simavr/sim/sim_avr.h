@@ -141,6 +141,7 @@ typedef void (*avr_run_t)(
  */
 typedef struct avr_t {
 	const char * mmcu;	// name of the AVR
+	uint32_t	core_size;	// size of the core declaration copied by avr_core_allocate()
 	// these are filled by sim_core_declare from constants in /usr/lib/avr/include/avr/io*.h
 	uint16_t 	ramend;
 	uint32_t	flashend;
@@ -240,13 +241,12 @@ typedef struct avr_t {
 
 	/*
 	 * callback when specific IO registers are read/written.
-	 * There is one drawback here, there is in way of knowing what is the
-	 * "beginning of useful sram" on a core, so there is no way to deduce
-	 * what is the maximum IO register for a core, and thus, we can't
-	 * allocate this table dynamically.
-	 * If you wanted to emulate the BIG AVRs, and XMegas, this would need
-	 * work.
+	 * There is no way of knowing what is the "beginning of useful sram" on
+	 * a core, so the table is allocated by avr_init() to cover everything
+	 * from 0x20 up to ramend, capped at MAX_IOs. Small cores (tiny13 has
+	 * 128 bytes of data space) thus don't pay for the full MAX_IOs table.
 	 */
+	uint16_t	io_count;	// number of entries in io[]
 	struct {
 		struct avr_irq_t * irq;	// optional, used only if asked for with avr_iomem_getirq()
 		struct {
@@ -257,7 +257,7 @@ typedef struct avr_t {
 			void * param;
 			avr_io_write_t c;
 		} w;
-	} io[MAX_IOs];
+	} * io;
 
 	/*
 	 * This block allows sharing of the IO write/read on addresses between
@@ -267,6 +267,7 @@ typedef struct avr_t {
 	 * If this case is detected, a special "dispatch" callback is installed that
 	 * will handle this particular case, without impacting the performance of the
 	 * other, normal cases...
+	 * The table is grown as registers get shared, most cores need none.
 	 */
 	int	io_shared_io_count;
 	struct {
@@ -275,7 +276,7 @@ typedef struct avr_t {
 			void * param;
 			void * c;
 		} io[4];
-	} io_shared_io[4];
+	} * io_shared_io;
 
 	// flash memory (initialized to 0xff, and code loaded into it)
 	uint8_t *	flash;
@@ -347,6 +348,26 @@ avr_core_allocate(
 		const avr_t * core,
 		uint32_t coreLen);
 
+/*
+ * Memory used by one AVR instance, in bytes. This is what it costs to keep
+ * an instance resident, for example when running lots of them in parallel.
+ */
+typedef struct avr_footprint_t {
+	uint32_t	core;		// copy of the core declaration (avr_t + IO modules)
+	uint32_t	io_table;	// IO register callbacks table
+	uint32_t	irq;		// allocated IRQs, their hooks and the IRQ pool
+	uint32_t	memory;		// flash, sram and eeprom
+	uint32_t	trace;		// trace data, only with CONFIG_SIMAVR_TRACE
+	uint32_t	total;		// sum of all the above
+	uint32_t	shared;		// interned IRQ names, shared by ALL instances
+} avr_footprint_t;
+
+// fills 'fp' (optional) with the memory used by 'avr', returns the total
+uint32_t
+avr_instance_footprint(
+		avr_t * avr,
+		avr_footprint_t * fp);
+
 // resets the AVR, and the IO modules
 void
 avr_reset(
@@ -233,7 +233,7 @@ inline void _avr_sp_set(avr_t * avr, uint16_t sp)
  */
 static inline void _avr_set_ram(avr_t * avr, uint16_t addr, uint8_t v)
 {
-	if (addr < MAX_IOs + 31)
+	if (addr < avr->io_count + 32)
 		_avr_set_r(avr, addr, v);
 	else
 		avr_core_watch_write(avr, addr, v);
@@ -251,7 +251,7 @@ static inline uint8_t _avr_get_ram(avr_t * avr, uint16_t addr)
 		 */
 		READ_SREG_INTO(avr, avr->data[R_SREG]);
 		
-	} else if (addr > 31 && addr < 31 + MAX_IOs) {
+	} else if (addr > 31 && addr < 32 + avr->io_count) {
 		avr_io_addr_t io = AVR_DATA_TO_IO(addr);
 		
 		if (avr->io[io].r.c)
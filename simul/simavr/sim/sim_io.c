@@ -61,6 +61,13 @@ avr_register_io_read(
 		void * param)
 {
 	avr_io_addr_t a = AVR_DATA_TO_IO(addr);
+
+	if (a >= avr->io_count) {
+		AVR_LOG(avr, LOG_ERROR,
+				"IO: %s(): IO address 0x%04x out of range (max 0x%04x).\n",
+				__func__, a, avr->io_count);
+		abort();
+	}
 	if (avr->io[a].r.param || avr->io[a].r.c) {
 		if (avr->io[a].r.param != param || avr->io[a].r.c != readp) {
 			AVR_LOG(avr, LOG_ERROR,
@@ -101,10 +108,10 @@ avr_register_io_write(
 {
 	avr_io_addr_t a = AVR_DATA_TO_IO(addr);
 
-	if (a >= MAX_IOs) {
+	if (a >= avr->io_count) {
 		AVR_LOG(avr, LOG_ERROR,
 				"IO: %s(): IO address 0x%04x out of range (max 0x%04x).\n",
-				__func__, a, MAX_IOs);
+				__func__, a, avr->io_count);
 		abort();
 	}
 	/*
@@ -117,11 +124,9 @@ avr_register_io_write(
 			// if the muxer not already installed, allocate a new slot
 			if (avr->io[a].w.c != _avr_io_mux_write) {
 				int no = avr->io_shared_io_count++;
-				if (avr->io_shared_io_count > ARRAY_SIZE(avr->io_shared_io)) {
-					AVR_LOG(avr, LOG_ERROR,
-							"IO: %s(): Too many shared IO registers.\n", __func__);
-					abort();
-				}
+				avr->io_shared_io = realloc(avr->io_shared_io,
+						avr->io_shared_io_count * sizeof(avr->io_shared_io[0]));
+				memset(&avr->io_shared_io[no], 0, sizeof(avr->io_shared_io[0]));
 				AVR_LOG(avr, LOG_TRACE,
 						"IO: %s(%04x): Installing muxer on register.\n",
 						__func__, addr);
@@ -175,6 +180,8 @@ avr_iomem_getirq(
 	if (index > 8)
 		return NULL;
 	avr_io_addr_t a = AVR_DATA_TO_IO(addr);
+	if (a >= avr->io_count)
+		return NULL;
 	if (avr->io[a].irq == NULL) {
 		/*
 		 * Prepare an array of names for the io IRQs. Ideally we'd love to have
@@ -201,8 +208,8 @@ avr_iomem_getirq(
 		int l = strlen(name);
 		char n[l + 10];
 		sprintf(n, "avr.io.%s", name);
-		free((void*)avr->io[a].irq[index].name);
-		avr->io[a].irq[index].name = strdup(n);
+		avr_irq_name_release(avr->io[a].irq[index].name);
+		avr->io[a].irq[index].name = avr_irq_name_intern(n);
 	}
 	return avr->io[a].irq + index;
 }
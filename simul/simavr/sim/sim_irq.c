@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include "sim_irq.h"
 
 // internal structure for a hook, never seen by the notify procs
@@ -34,6 +35,114 @@ typedef struct avr_irq_hook_t {
 	void * param;				// "notify" parameter
 } avr_irq_hook_t;
 
+/*
+ * IRQ names are interned: every instance of a given core ends up with the
+ * exact same set of names, so they are shared and reference counted instead
+ * of being strdup()ed for each and every IRQ.
+ * The table can be hit by several threads each making their own instance,
+ * so it is protected by a (rarely contended) spinlock.
+ */
+typedef struct avr_irq_name_t {
+	struct avr_irq_name_t * next;
+	uint32_t	hash;
+	uint32_t	refcount;
+	char		name[0];
+} avr_irq_name_t;
+
+#define IRQ_NAME_HASH_SIZE	256
+
+static avr_irq_name_t * _avr_irq_names[IRQ_NAME_HASH_SIZE];
+static uint32_t _avr_irq_names_size;
+static volatile int _avr_irq_names_lock;
+
+#define IRQ_NAMES_LOCK() \
+	while (__sync_lock_test_and_set(&_avr_irq_names_lock, 1)) ;
+#define IRQ_NAMES_UNLOCK() \
+	__sync_lock_release(&_avr_irq_names_lock)
+
+static uint32_t
+_avr_irq_name_hash(
+		const char * name)
+{
+	uint32_t h = 2166136261u;	// FNV-1a
+	while (*name)
+		h = (h ^ (uint8_t)*name++) * 16777619u;
+	return h;
+}
+
+const char *
+avr_irq_name_intern(
+		const char * name)
+{
+	if (!name)
+		return NULL;
+	uint32_t h = _avr_irq_name_hash(name);
+	IRQ_NAMES_LOCK();
+	avr_irq_name_t * n = _avr_irq_names[h % IRQ_NAME_HASH_SIZE];
+	while (n) {
+		if (n->hash == h && !strcmp(n->name, name))
+			break;
+		n = n->next;
+	}
+	if (!n) {
+		int l = strlen(name) + 1;
+		n = malloc(sizeof(*n) + l);
+		n->hash = h;
+		n->refcount = 0;
+		memcpy(n->name, name, l);
+		n->next = _avr_irq_names[h % IRQ_NAME_HASH_SIZE];
+		_avr_irq_names[h % IRQ_NAME_HASH_SIZE] = n;
+		_avr_irq_names_size += sizeof(*n) + l;
+	}
+	n->refcount++;
+	IRQ_NAMES_UNLOCK();
+	return n->name;
+}
+
+void
+avr_irq_name_release(
+		const char * name)
+{
+	if (!name)
+		return;
+	avr_irq_name_t * n = (avr_irq_name_t *)(name - offsetof(avr_irq_name_t, name));
+	IRQ_NAMES_LOCK();
+	if (--n->refcount == 0) {
+		avr_irq_name_t ** p = &_avr_irq_names[n->hash % IRQ_NAME_HASH_SIZE];
+		while (*p && *p != n)
+			p = &(*p)->next;
+		if (*p)
+			*p = n->next;
+		_avr_irq_names_size -= sizeof(*n) + strlen(n->name) + 1;
+		free(n);
+	}
+	IRQ_NAMES_UNLOCK();
+}
+
+uint32_t
+avr_irq_names_footprint(void)
+{
+	return _avr_irq_names_size;
+}
+
+uint32_t
+avr_irq_pool_footprint(
+		avr_irq_pool_t * pool)
+{
+	uint32_t size = ((pool->count + 15) & ~15) * sizeof(avr_irq_t *);
+
+	for (int i = 0; i < pool->count; i++) {
+		avr_irq_t * irq = pool->irq[i];
+		if (!irq)
+			continue;
+		if (irq->flags & IRQ_FLAG_ALLOC)
+			size += sizeof(avr_irq_t);
+		for (avr_irq_hook_t * hook = irq->hook; hook; hook = hook->next)
+			size += sizeof(avr_irq_hook_t);
+	}
+	return size;
+}
+
 static void
 _avr_irq_pool_add(
 		avr_irq_pool_t * pool,
@@ -75,7 +184,7 @@ avr_init_irq(
 		if (pool)
 			_avr_irq_pool_add(pool, &irq[i]);
 		if (names && names[i])
-			irq[i].name = strdup(names[i]);
+			irq[i].name = avr_irq_name_intern(names[i]);
 		else {
 			printf("WARNING %s() with NULL name for irq %d.\n", __func__, irq[i].irq);
 		}
@@ -118,8 +227,7 @@ avr_free_irq(
 		avr_irq_t * iq = irq + i;
 		if (iq->pool)
 			_avr_irq_pool_remove(iq->pool, iq);
-		if (iq->name)
-			free((char*)iq->name);
+		avr_irq_name_release(iq->name);
 		iq->name = NULL;
 		// purge hooks
 		avr_irq_hook_t *hook = iq->hook;
@@ -181,6 +289,16 @@ avr_irq_unregister_notify(
 	}
 }
 
+int
+avr_irq_hook_count(
+		avr_irq_t * irq)
+{
+	int count = 0;
+	for (avr_irq_hook_t * hook = irq->hook; hook; hook = hook->next)
+		count++;
+	return count;
+}
+
 void
 avr_raise_irq(
 		avr_irq_t * irq,
@@ -125,6 +125,29 @@ avr_irq_unregister_notify(
 		avr_irq_t * irq,
 		avr_irq_notify_t notify,
 		void * param);
+//! number of hooks on 'irq', notify ones and connected IRQs alike
+int
+avr_irq_hook_count(
+		avr_irq_t * irq);
+
+/*
+ * IRQ names are interned, and shared between all the IRQs (and all the AVR
+ * instances) using the same name. Use these if you need to change irq->name
+ */
+const char *
+avr_irq_name_intern(
+		const char * name);
+void
+avr_irq_name_release(
+		const char * name);
+
+//! bytes used by the interned IRQ names, shared by all the pools
+uint32_t
+avr_irq_names_footprint(void);
+//! bytes allocated for the IRQs living in 'pool', including their hooks
+uint32_t
+avr_irq_pool_footprint(
+		avr_irq_pool_t * pool);
 
 #ifdef __cplusplus
 };
@@ -0,0 +1,348 @@
+/*
+	sim_logic.c
+
+	Copyright 2016, Fernando Vicente <fvicente@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "sim_avr.h"
+#include "sim_logic.h"
+
+static void
+_avr_logic_notify(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_logic_signal_t * s = (avr_logic_signal_t *)param;
+	uint32_t last = s->count ? s->value[s->count - 1] : s->initial;
+
+	if (value == last)
+		return;
+	if (s->count == s->size) {
+		s->size = s->size ? s->size * 2 : 1024;
+		s->when = realloc(s->when, s->size * sizeof(s->when[0]));
+		s->value = realloc(s->value, s->size * sizeof(s->value[0]));
+	}
+	s->when[s->count] = s->logic->avr->cycle;
+	s->value[s->count++] = value;
+}
+
+void
+avr_logic_init(
+		struct avr_t * avr,
+		avr_logic_t * logic)
+{
+	memset(logic, 0, sizeof(*logic));
+	logic->avr = avr;
+	logic->start = avr->cycle;
+}
+
+avr_logic_signal_t *
+avr_logic_add_signal(
+		avr_logic_t * logic,
+		avr_irq_t * source,
+		const char * name)
+{
+	if (logic->signal_count == AVR_LOGIC_MAX_SIGNALS)
+		return NULL;
+	int index = logic->signal_count++;
+	avr_logic_signal_t * s = &logic->signal[index];
+	memset(s, 0, sizeof(*s));
+	s->logic = logic;
+	s->source = source;
+	s->initial = source->value;
+	strncpy(s->name, name, sizeof(s->name) - 1);
+
+	char iname[10 + strlen(name) + 1];
+	sprintf(iname, ">logic.%s", name);
+	const char * names[1] = { iname };
+	avr_init_irq(&logic->avr->irq_pool, &s->irq, index, 1, names);
+	avr_irq_register_notify(&s->irq, _avr_logic_notify, s);
+	avr_connect_irq(source, &s->irq);
+	return s;
+}
+
+void
+avr_logic_reset(
+		avr_logic_t * logic)
+{
+	for (int i = 0; i < logic->signal_count; i++) {
+		avr_logic_signal_t * s = &logic->signal[i];
+		if (s->count)
+			s->initial = s->value[s->count - 1];
+		s->count = 0;
+	}
+	logic->start = logic->avr->cycle;
+}
+
+void
+avr_logic_dispose(
+		avr_logic_t * logic)
+{
+	for (int i = 0; i < logic->signal_count; i++) {
+		avr_logic_signal_t * s = &logic->signal[i];
+		avr_unconnect_irq(s->source, &s->irq);
+		avr_free_irq(&s->irq, 1);
+		free(s->when);
+		free(s->value);
+	}
+	logic->signal_count = 0;
+}
+
+// index of the first change at 'cycle' or after
+static uint32_t
+_avr_logic_find(
+		const avr_logic_signal_t * s,
+		avr_cycle_count_t cycle)
+{
+	uint32_t lo = 0, hi = s->count;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (s->when[mid] < cycle)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static inline uint32_t
+_avr_logic_before(
+		const avr_logic_signal_t * s,
+		uint32_t i)
+{
+	return i ? s->value[i - 1] : s->initial;
+}
+
+static inline int
+_avr_logic_edge(
+		uint32_t prev,
+		uint32_t value,
+		uint32_t mask)
+{
+	int p = (prev & mask) != 0, v = (value & mask) != 0;
+	return (v & ~p) * AVR_LOGIC_RISING + (p & ~v) * AVR_LOGIC_FALLING;
+}
+
+/*
+ * Changes in the window are [*lo, *hi), 'to' is clamped to now,
+ * returns the value at 'from', before them
+ */
+static uint32_t
+_avr_logic_window(
+		const avr_logic_signal_t * s,
+		avr_cycle_count_t from,
+		avr_cycle_count_t * to,
+		uint32_t * lo,
+		uint32_t * hi)
+{
+	if (*to > s->logic->avr->cycle)
+		*to = s->logic->avr->cycle;
+	*lo = _avr_logic_find(s, from);
+	*hi = *to > from ? _avr_logic_find(s, *to) : *lo;
+	return _avr_logic_before(s, *lo);
+}
+
+static uint32_t
+_avr_logic_next_edge(
+		const avr_logic_signal_t * s,
+		uint32_t mask,
+		int edge,
+		uint32_t i,
+		uint32_t hi)
+{
+	for (; i < hi; i++)
+		if (_avr_logic_edge(_avr_logic_before(s, i), s->value[i], mask) & edge)
+			break;
+	return i;
+}
+
+static void
+_avr_logic_stats_add(
+		avr_logic_stats_t * stats,
+		avr_cycle_count_t d)
+{
+	if (!stats->count || d < stats->min)
+		stats->min = d;
+	if (d > stats->max)
+		stats->max = d;
+	stats->total += d;
+	stats->count++;
+}
+
+uint32_t
+avr_logic_value_at(
+		const avr_logic_signal_t * s,
+		avr_cycle_count_t cycle)
+{
+	// the last change at 'cycle' or before
+	return _avr_logic_before(s, _avr_logic_find(s, cycle + 1));
+}
+
+uint32_t
+avr_logic_edges(
+		const avr_logic_signal_t * s,
+		uint32_t mask,
+		int edge,
+		avr_cycle_count_t from,
+		avr_cycle_count_t to)
+{
+	uint32_t lo, hi;
+	uint32_t prev = _avr_logic_window(s, from, &to, &lo, &hi);
+	uint32_t rising = 0, falling = 0;
+
+	if (lo == hi)
+		return 0;
+	int e = _avr_logic_edge(prev, s->value[lo], mask);
+	rising += e & AVR_LOGIC_RISING;
+	falling += (e & AVR_LOGIC_FALLING) >> 1;
+	// no branches, so it's vectorized
+	for (uint32_t i = lo + 1; i < hi; i++) {
+		uint32_t p = (s->value[i - 1] & mask) != 0;
+		uint32_t v = (s->value[i] & mask) != 0;
+		rising += v & ~p;
+		falling += p & ~v;
+	}
+	return (edge & AVR_LOGIC_RISING ? rising : 0) +
+			(edge & AVR_LOGIC_FALLING ? falling : 0);
+}
+
+avr_cycle_count_t
+avr_logic_high_time(
+		const avr_logic_signal_t * s,
+		uint32_t mask,
+		avr_cycle_count_t from,
+		avr_cycle_count_t to)
+{
+	uint32_t lo, hi;
+	uint32_t prev = _avr_logic_window(s, from, &to, &lo, &hi);
+	avr_cycle_count_t high = 0, t = from;
+	int level = (prev & mask) != 0;
+
+	if (to <= from)
+		return 0;
+	for (uint32_t i = lo; i < hi; i++) {
+		if (level)
+			high += s->when[i] - t;
+		t = s->when[i];
+		level = (s->value[i] & mask) != 0;
+	}
+	if (level)
+		high += to - t;
+	return high;
+}
+
+double
+avr_logic_duty(
+		const avr_logic_signal_t * s,
+		uint32_t mask,
+		avr_cycle_count_t from,
+		avr_cycle_count_t to)
+{
+	if (to > s->logic->avr->cycle)
+		to = s->logic->avr->cycle;
+	if (to <= from)
+		return 0;
+	return (double)avr_logic_high_time(s, mask, from, to) / (to - from);
+}
+
+uint32_t
+avr_logic_pulses(
+		const avr_logic_signal_t * s,
+		uint32_t mask,
+		int level,
+		avr_cycle_count_t from,
+		avr_cycle_count_t to,
+		avr_logic_stats_t * stats)
+{
+	uint32_t lo, hi;
+	int start = level ? AVR_LOGIC_RISING : AVR_LOGIC_FALLING;
+	int end = level ? AVR_LOGIC_FALLING : AVR_LOGIC_RISING;
+
+	memset(stats, 0, sizeof(*stats));
+	_avr_logic_window(s, from, &to, &lo, &hi);
+	uint32_t i = _avr_logic_next_edge(s, mask, start, lo, hi);
+	while (i < hi) {
+		uint32_t j = _avr_logic_next_edge(s, mask, end, i + 1, hi);
+		if (j == hi)
+			break;
+		_avr_logic_stats_add(stats, s->when[j] - s->when[i]);
+		i = _avr_logic_next_edge(s, mask, start, j + 1, hi);
+	}
+	return stats->count;
+}
+
+uint32_t
+avr_logic_period(
+		const avr_logic_signal_t * s,
+		uint32_t mask,
+		avr_cycle_count_t from,
+		avr_cycle_count_t to,
+		avr_logic_stats_t * stats)
+{
+	uint32_t lo, hi;
+
+	memset(stats, 0, sizeof(*stats));
+	_avr_logic_window(s, from, &to, &lo, &hi);
+	uint32_t i = _avr_logic_next_edge(s, mask, AVR_LOGIC_RISING, lo, hi);
+	while (i < hi) {
+		uint32_t j = _avr_logic_next_edge(s, mask, AVR_LOGIC_RISING, i + 1, hi);
+		if (j == hi)
+			break;
+		_avr_logic_stats_add(stats, s->when[j] - s->when[i]);
+		i = j;
+	}
+	return stats->count;
+}
+
+uint32_t
+avr_logic_delay(
+		const avr_logic_signal_t * a,
+		uint32_t a_mask,
+		int a_edge,
+		const avr_logic_signal_t * b,
+		uint32_t b_mask,
+		int b_edge,
+		avr_cycle_count_t from,
+		avr_cycle_count_t to,
+		avr_logic_stats_t * stats)
+{
+	uint32_t alo, ahi, blo, bhi;
+
+	memset(stats, 0, sizeof(*stats));
+	_avr_logic_window(a, from, &to, &alo, &ahi);
+	_avr_logic_window(b, from, &to, &blo, &bhi);
+	/*
+	 * Both move forward only: the changes of 'b' skipped for an edge of
+	 * 'a' were either before it, or not the edge looked for
+	 */
+	uint32_t k = blo;
+	for (uint32_t i = _avr_logic_next_edge(a, a_mask, a_edge, alo, ahi); i < ahi;
+			i = _avr_logic_next_edge(a, a_mask, a_edge, i + 1, ahi)) {
+		while (k < bhi && b->when[k] < a->when[i])
+			k++;
+		k = _avr_logic_next_edge(b, b_mask, b_edge, k, bhi);
+		if (k == bhi)
+			break;
+		_avr_logic_stats_add(stats, b->when[k] - a->when[i]);
+	}
+	return stats->count;
+}
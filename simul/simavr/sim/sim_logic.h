@@ -0,0 +1,179 @@
+/*
+	sim_logic.h
+
+	Copyright 2016, Fernando Vicente <fvicente@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_LOGIC_H__
+#define __SIM_LOGIC_H__
+
+#include "sim_irq.h"
+#include "sim_avr_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * In memory logic analyzer.
+ *
+ * Signals are hooked like avr_vcd_add_signal() does, but their changes
+ * are kept in memory, one pair of sorted arrays per signal (cycles, and
+ * values), so that firmware tests can check timings directly, without
+ * writing a VCD file and parsing it afterward:
+ *
+ *	avr_logic_signal_t * ampm = avr_logic_add_signal(&logic, pb5, "ampm");
+ *	...run...
+ *	avr_logic_stats_t p;
+ *	avr_logic_period(ampm, 1, from, avr->cycle, &p);
+ *	if (avr_cycles_to_usec(avr, p.max) > 1000000 / 60) ...failed
+ *
+ * Only actual changes are kept. The queries take a window of cycles,
+ * 'from' included, 'to' excluded and clamped to the current cycle.
+ * A 'mask' selects the bits of the value that make the level: it's
+ * high if any of them is set.
+ */
+
+#define AVR_LOGIC_MAX_SIGNALS	32
+
+enum {
+	AVR_LOGIC_RISING	= (1 << 0),
+	AVR_LOGIC_FALLING	= (1 << 1),
+	AVR_LOGIC_BOTH		= AVR_LOGIC_RISING | AVR_LOGIC_FALLING,
+};
+
+typedef struct avr_logic_signal_t {
+	avr_irq_t	irq;		// receiving IRQ
+	avr_irq_t *	source;
+	struct avr_logic_t * logic;
+	char		name[32];
+	uint32_t	initial;	// value before the first change kept
+	uint32_t	count;
+	uint32_t	size;		// allocated
+	avr_cycle_count_t * when;
+	uint32_t *	value;
+} avr_logic_signal_t;
+
+typedef struct avr_logic_t {
+	struct avr_t *	avr;
+	avr_cycle_count_t	start;	// cycle the history starts at
+	int			signal_count;
+	avr_logic_signal_t	signal[AVR_LOGIC_MAX_SIGNALS];
+} avr_logic_t;
+
+// durations in cycles; the mean is total / count
+typedef struct avr_logic_stats_t {
+	uint32_t	count;
+	avr_cycle_count_t	min, max, total;
+} avr_logic_stats_t;
+
+void
+avr_logic_init(
+		struct avr_t * avr,
+		avr_logic_t * logic);
+
+// starts recording the changes of 'source', NULL if full
+avr_logic_signal_t *
+avr_logic_add_signal(
+		avr_logic_t * logic,
+		avr_irq_t * source,
+		const char * name);
+
+// forgets the changes so far, the history starts again now
+void
+avr_logic_reset(
+		avr_logic_t * logic);
+
+void
+avr_logic_dispose(
+		avr_logic_t * logic);
+
+// value of the signal at 'cycle', after any change at that cycle
+uint32_t
+avr_logic_value_at(
+		const avr_logic_signal_t * s,
+		avr_cycle_count_t cycle);
+
+// number of 'edge' (AVR_LOGIC_RISING etc) in the window
+uint32_t
+avr_logic_edges(
+		const avr_logic_signal_t * s,
+		uint32_t mask,
+		int edge,
+		avr_cycle_count_t from,
+		avr_cycle_count_t to);
+
+// cycles the level was high in the window
+avr_cycle_count_t
+avr_logic_high_time(
+		const avr_logic_signal_t * s,
+		uint32_t mask,
+		avr_cycle_count_t from,
+		avr_cycle_count_t to);
+
+// high time over the window, 0 to 1
+double
+avr_logic_duty(
+		const avr_logic_signal_t * s,
+		uint32_t mask,
+		avr_cycle_count_t from,
+		avr_cycle_count_t to);
+
+/*
+ * Widths of the pulses at 'level' (0 or 1) that start and end in the
+ * window. Return the number of pulses, also in 'stats'
+ */
+uint32_t
+avr_logic_pulses(
+		const avr_logic_signal_t * s,
+		uint32_t mask,
+		int level,
+		avr_cycle_count_t from,
+		avr_cycle_count_t to,
+		avr_logic_stats_t * stats);
+
+// time between successive rising edges in the window
+uint32_t
+avr_logic_period(
+		const avr_logic_signal_t * s,
+		uint32_t mask,
+		avr_cycle_count_t from,
+		avr_cycle_count_t to,
+		avr_logic_stats_t * stats);
+
+/*
+ * Delays from each 'a_edge' of 'a' in the window, to the next 'b_edge'
+ * of 'b', at the same cycle or after, and before 'to'
+ */
+uint32_t
+avr_logic_delay(
+		const avr_logic_signal_t * a,
+		uint32_t a_mask,
+		int a_edge,
+		const avr_logic_signal_t * b,
+		uint32_t b_mask,
+		int b_edge,
+		avr_cycle_count_t from,
+		avr_cycle_count_t to,
+		avr_logic_stats_t * stats);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_LOGIC_H__ */
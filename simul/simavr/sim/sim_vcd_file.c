@@ -25,12 +25,25 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include<inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <zlib.h>
+#ifndef __MINGW32__
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 #include "sim_vcd_file.h"
 #include "sim_avr.h"
 #include "sim_time.h"
 
 void _avr_vcd_notify(struct avr_irq_t * irq, uint32_t value, void * param);
+static int avr_vcd_swap(avr_vcd_t * vcd, int wait);
+static void _avr_vcd_capture_log(avr_vcd_t * vcd, avr_vcd_signal_t * s, uint32_t value);
 
 int avr_vcd_init(struct avr_t * avr, const char * filename, avr_vcd_t * vcd, uint32_t period)
 {
@@ -53,30 +66,27 @@ void avr_vcd_close(avr_vcd_t * vcd)
 void _avr_vcd_notify(struct avr_irq_t * irq, uint32_t value, void * param)
 {
 	avr_vcd_t * vcd = (avr_vcd_t *)param;
+	avr_vcd_signal_t * s = (avr_vcd_signal_t*)irq;
+
+	if (vcd->capture.state) {
+		_avr_vcd_capture_log(vcd, s, value);
+		return;
+	}
 	if (!vcd->output)
 		return;
 
 	/*
-	 * buffer starts empty, the first trace will resize it to AVR_VCD_LOG_CHUNK_SIZE,
-	 * further growth will resize it accordingly. There's a bit of
+	 * A full buffer is handed to the writer before the period is over,
+	 * that only waits if the writer hasn't finished with the other one.
+	 * A live reader is never waited for, the change is summarised
 	 */
-	if (vcd->logindex >= vcd->logsize) {
-		vcd->logsize += AVR_VCD_LOG_CHUNK_SIZE;
-		vcd->log = (avr_vcd_log_p)realloc(vcd->log, vcd->logsize * sizeof(vcd->log[0]));
-		AVR_LOG(vcd->avr, LOG_TRACE, "%s trace buffer resized to %d\n",
-				__func__, (int)vcd->logsize);
-		if ((vcd->logsize / AVR_VCD_LOG_CHUNK_SIZE) == 5) {
-			AVR_LOG(vcd->avr, LOG_WARNING, "%s log size runnaway (%d) flush problem?\n",
-					__func__, (int)vcd->logsize);
-		}
-		if (!vcd->log) {
-			AVR_LOG(vcd->avr, LOG_ERROR, "%s log resizing, out of memory (%d)!\n",
-					__func__, (int)vcd->logsize);
-			vcd->logsize = 0;
-			return;
-		}
+	if (vcd->logindex >= AVR_VCD_LOG_SIZE &&
+			avr_vcd_swap(vcd, !vcd->backend->live)) {
+		vcd->dropped.count++;
+		vcd->dropped.mask |= 1ULL << s->irq.irq;
+		vcd->dropped.value[s->irq.irq] = value;
+		return;
 	}
-	avr_vcd_signal_t * s = (avr_vcd_signal_t*)irq;
 	avr_vcd_log_t *l = &vcd->log[vcd->logindex++];
 	l->signal = s;
 	l->when = vcd->avr->cycle;
@@ -100,23 +110,579 @@ static char * _avr_vcd_get_float_signal_text(avr_vcd_signal_t * s, char * out)
 	return out;
 }
 
-static char * _avr_vcd_get_signal_text(avr_vcd_signal_t * s, char * out, uint32_t value)
+static char * _avr_vcd_put_signal(avr_vcd_signal_t * s, char * dst, uint32_t value)
 {
-	char * dst = out;
-
 	if (s->size > 1)
 		*dst++ = 'b';
 
 	for (int i = s->size; i > 0; i--)
-		*dst++ = value & (1 << (i-1)) ? '1' : '0';
+		*dst++ = value & (1u << (i-1)) ? '1' : '0';
 	if (s->size > 1)
 		*dst++ = ' ';
 	*dst++ = s->alias;
-	*dst = 0;
-	return out;
+	return dst;
+}
+
+static char * _avr_vcd_put_u64(char * dst, uint64_t v)
+{
+	char tmp[20];
+	int n = 0;
+
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	while (n)
+		*dst++ = tmp[--n];
+	return dst;
+}
+
+static void _avr_vcd_write(avr_vcd_t * vcd, const char * buf, size_t len)
+{
+	int fd = fileno(vcd->output);
+
+	while (len && !vcd->writer.dead) {
+		ssize_t w = write(fd, buf, len);
+		if (w < 0 && errno == EINTR)
+			continue;
+#ifndef __MINGW32__
+		/*
+		 * Only live outputs are non blocking. Their reader may stall for
+		 * a while, the simulation summarises meanwhile; it's only given
+		 * up on when stopping, so avr_vcd_stop() doesn't hang on it
+		 */
+		if (w < 0 && errno == EAGAIN) {
+			struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+			int r = poll(&pfd, 1, AVR_VCD_LIVE_TIMEOUT);
+			if (r > 0 || (r < 0 && errno == EINTR))
+				continue;
+			if (!vcd->writer.closing)
+				continue;
+			fprintf(stderr, "%s: the reader stalled, giving up\n", vcd->filename);
+			vcd->writer.dead = 1;
+			return;
+		}
+#endif
+		if (w <= 0) {
+			// a live reader went away, or the disk is full
+			perror(vcd->filename);
+			vcd->writer.dead = 1;
+			return;
+		}
+		buf += w;
+		len -= w;
+	}
+}
+
+static int _avr_vcd_file_open(avr_vcd_t * vcd)
+{
+	vcd->output = fopen(vcd->filename, "w");
+	if (vcd->output == NULL) {
+		perror(vcd->filename);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * gzip backend. A full flush lets inflating start there with no history,
+ * the index gives where they are. It costs the compression its history
+ * too, so it's only done at the start of a block once there was
+ * AVR_VCD_GZ_FLUSH_SIZE of text since the last one.
+ */
+typedef struct avr_vcd_gz_t {
+	z_stream	z;
+	FILE *		index;
+	size_t		since;	// text since the last full flush
+	char		out[64 * 1024];
+} avr_vcd_gz_t;
+
+static void _avr_vcd_gz_deflate(avr_vcd_t * vcd, int flush)
+{
+	avr_vcd_gz_t * gz = vcd->priv;
+	do {
+		gz->z.next_out = (Bytef *)gz->out;
+		gz->z.avail_out = sizeof(gz->out);
+		deflate(&gz->z, flush);
+		_avr_vcd_write(vcd, gz->out, sizeof(gz->out) - gz->z.avail_out);
+	} while (gz->z.avail_out == 0);
+}
+
+static int _avr_vcd_gz_match(const char * filename)
+{
+	size_t l = strlen(filename);
+	return l > 3 && !strcmp(filename + l - 3, ".gz");
+}
+
+static int _avr_vcd_gz_open(avr_vcd_t * vcd)
+{
+	if (_avr_vcd_file_open(vcd))
+		return -1;
+	avr_vcd_gz_t * gz = calloc(1, sizeof(*gz));
+	// 16 + max window bits, for a gzip wrapper
+	if (deflateInit2(&gz->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+			16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		free(gz);
+		fclose(vcd->output);
+		vcd->output = NULL;
+		return -1;
+	}
+	char name[sizeof(vcd->filename) + 4];
+	snprintf(name, sizeof(name), "%s.idx", vcd->filename);
+	gz->index = fopen(name, "w");
+	if (gz->index)
+		fprintf(gz->index, "# timestamp offset\n");
+	vcd->priv = gz;
+	return 0;
+}
+
+static void _avr_vcd_gz_block(avr_vcd_t * vcd, uint64_t base)
+{
+	avr_vcd_gz_t * gz = vcd->priv;
+	if (gz->since < AVR_VCD_GZ_FLUSH_SIZE)
+		return;
+	gz->since = 0;
+	_avr_vcd_gz_deflate(vcd, Z_FULL_FLUSH);
+	if (gz->index)
+		fprintf(gz->index, "%llu %lu\n", (unsigned long long)base,
+				(unsigned long)gz->z.total_out);
+}
+
+static void _avr_vcd_gz_write(avr_vcd_t * vcd, const char * buf, size_t len)
+{
+	avr_vcd_gz_t * gz = vcd->priv;
+	gz->z.next_in = (Bytef *)buf;
+	gz->z.avail_in = len;
+	gz->since += len;
+	_avr_vcd_gz_deflate(vcd, Z_NO_FLUSH);
+}
+
+static void _avr_vcd_gz_close(avr_vcd_t * vcd)
+{
+	avr_vcd_gz_t * gz = vcd->priv;
+	_avr_vcd_gz_deflate(vcd, Z_FINISH);
+	deflateEnd(&gz->z);
+	if (gz->index)
+		fclose(gz->index);
+	free(gz);
+	vcd->priv = NULL;
+}
+
+/*
+ * FST backend, gtkwave's binary format. Each buffer of changes is a
+ * value change block: the values at its start, then each signal's
+ * changes as deltas in the block's table of timestamps, all zlib
+ * compressed; gtkwave seeks by block, with their first and last
+ * timestamps. The signal sizes and the scope come after the last one,
+ * and the header is rewritten then with the totals.
+ */
+#define FST_BL_HDR			0
+#define FST_BL_GEOM			3
+#define FST_BL_HIER			4
+#define FST_BL_VCDATA_DYN_ALIAS2	8
+#define FST_HDR_SIZE		329
+#define FST_ST_VCD_MODULE	0
+#define FST_ST_VCD_SCOPE	254
+#define FST_ST_VCD_UPSCOPE	255
+#define FST_VT_VCD_WIRE		16
+
+typedef struct avr_vcd_fst_buf_t {
+	uint8_t *	b;
+	size_t		len, size;
+} avr_vcd_fst_buf_t;
+
+typedef struct avr_vcd_fst_t {
+	uint64_t	start, end;		// first and last timestamp written
+	uint64_t	blocks;
+	uint64_t	known;			// signals with a value, the others are 'x'
+	uint32_t	value[AVR_VCD_MAX_SIGNALS];
+	char		date[119];
+	// the block being made
+	avr_vcd_fst_buf_t	chg[AVR_VCD_MAX_SIGNALS];
+	uint32_t	last[AVR_VCD_MAX_SIGNALS];	// time index of their last change
+	avr_vcd_fst_buf_t	frame, times, block, z;
+} avr_vcd_fst_t;
+
+static uint8_t * _avr_vcd_fst_room(avr_vcd_fst_buf_t * b, size_t len)
+{
+	if (b->len + len > b->size) {
+		b->size = (b->len + len) * 2;
+		b->b = realloc(b->b, b->size);
+	}
+	b->len += len;
+	return b->b + b->len - len;
+}
+
+static void _avr_vcd_fst_put(avr_vcd_fst_buf_t * b, const void * data, size_t len)
+{
+	memcpy(_avr_vcd_fst_room(b, len), data, len);
+}
+
+static void _avr_vcd_fst_be64(uint8_t * d, uint64_t v)
+{
+	for (int i = 7; i >= 0; i--, v >>= 8)
+		d[i] = v;
+}
+
+static void _avr_vcd_fst_u64(avr_vcd_fst_buf_t * b, uint64_t v)
+{
+	_avr_vcd_fst_be64(_avr_vcd_fst_room(b, 8), v);
+}
+
+static void _avr_vcd_fst_varint(avr_vcd_fst_buf_t * b, uint64_t v)
+{
+	for (; v > 0x7f; v >>= 7)
+		*_avr_vcd_fst_room(b, 1) = (v & 0x7f) | 0x80;
+	*_avr_vcd_fst_room(b, 1) = v;
+}
+
+static void _avr_vcd_fst_svarint(avr_vcd_fst_buf_t * b, int64_t v)
+{
+	for (;;) {
+		uint8_t byte = v & 0x7f;
+		v >>= 7;
+		// done once what's left is the sign of the last byte
+		if ((!v && !(byte & 0x40)) || (v == -1 && (byte & 0x40))) {
+			*_avr_vcd_fst_room(b, 1) = byte;
+			return;
+		}
+		*_avr_vcd_fst_room(b, 1) = byte | 0x80;
+	}
+}
+
+/*
+ * Adds 'src' zlib compressed into 'fst->z', if that's any smaller, and
+ * returns the compressed length, or 'len' when it's left as is
+ */
+static size_t _avr_vcd_fst_deflate(avr_vcd_fst_t * fst, const uint8_t * src, size_t len)
+{
+	uLongf zlen = compressBound(len);
+	fst->z.len = 0;
+	uint8_t * d = _avr_vcd_fst_room(&fst->z, zlen);
+	if (compress2(d, &zlen, src, len, 4) != Z_OK || zlen >= len) {
+		fst->z.len = 0;
+		_avr_vcd_fst_put(&fst->z, src, len);
+		return len;
+	}
+	fst->z.len = zlen;
+	return zlen;
+}
+
+static void _avr_vcd_fst_header_block(avr_vcd_t * vcd, avr_vcd_fst_buf_t * b)
+{
+	avr_vcd_fst_t * fst = vcd->priv;
+	double endian = 2.7182818284590452354;	// e, as the reader expects it
+	char version[128] = "simavr";
+
+	*_avr_vcd_fst_room(b, 1) = FST_BL_HDR;
+	_avr_vcd_fst_u64(b, FST_HDR_SIZE);
+	_avr_vcd_fst_u64(b, fst->start);
+	_avr_vcd_fst_u64(b, fst->end);
+	_avr_vcd_fst_put(b, &endian, sizeof(endian));
+	_avr_vcd_fst_u64(b, AVR_VCD_LOG_SIZE * sizeof(avr_vcd_log_t));	// writer memory
+	_avr_vcd_fst_u64(b, 1);	// scopes
+	_avr_vcd_fst_u64(b, vcd->signal_count);	// variables
+	_avr_vcd_fst_u64(b, vcd->signal_count);	// handles, no aliases
+	_avr_vcd_fst_u64(b, fst->blocks);
+	*_avr_vcd_fst_room(b, 1) = (uint8_t)-9;	// 1ns base
+	_avr_vcd_fst_put(b, version, sizeof(version));
+	_avr_vcd_fst_put(b, fst->date, sizeof(fst->date));
+	*_avr_vcd_fst_room(b, 1) = 0;	// verilog
+	_avr_vcd_fst_u64(b, 0);	// time zero
+}
+
+static int _avr_vcd_fst_match(const char * filename)
+{
+	size_t l = strlen(filename);
+	return l > 4 && !strcmp(filename + l - 4, ".fst");
 }
 
-static void avr_vcd_flush_log(avr_vcd_t * vcd)
+static int _avr_vcd_fst_open(avr_vcd_t * vcd)
+{
+	if (_avr_vcd_file_open(vcd))
+		return -1;
+	avr_vcd_fst_t * fst = calloc(1, sizeof(*fst));
+	time_t now = time(NULL);
+	strncpy(fst->date, asctime(localtime(&now)), sizeof(fst->date) - 1);
+	vcd->priv = fst;
+	return 0;
+}
+
+static void _avr_vcd_fst_header(avr_vcd_t * vcd, const uint32_t * values)
+{
+	avr_vcd_fst_t * fst = vcd->priv;
+
+	if (values) {
+		fst->known = ~0ULL;
+		memcpy(fst->value, values, sizeof(fst->value));
+	}
+	// rewritten by _avr_vcd_fst_close()
+	fst->block.len = 0;
+	_avr_vcd_fst_header_block(vcd, &fst->block);
+	_avr_vcd_write(vcd, (char *)fst->block.b, fst->block.len);
+}
+
+static void _avr_vcd_fst_log(avr_vcd_t * vcd, avr_vcd_log_p log, uint32_t count)
+{
+	avr_vcd_fst_t * fst = vcd->priv;
+	avr_vcd_fst_buf_t * b = &fst->block;
+	uint64_t seen = 0;
+	uint64_t first = 0, base = fst->end;	// never goes back past the last block
+	uint32_t ntimes = 0;
+
+	fst->frame.len = 0;
+	for (int i = 0; i < vcd->signal_count; i++) {
+		avr_vcd_signal_t * s = &vcd->signal[i];
+		uint8_t * d = _avr_vcd_fst_room(&fst->frame, s->size);
+		for (int bit = s->size - 1; bit >= 0; bit--)
+			*d++ = !(fst->known & (1ULL << i)) ? 'x' :
+					fst->value[i] & (1u << bit) ? '1' : '0';
+		fst->chg[i].len = 0;
+		fst->last[i] = 0;
+	}
+	fst->times.len = 0;
+
+	for (uint32_t li = 0; li < count; li++) {
+		avr_vcd_log_t *l = &log[li];
+		if (!l->signal)	// see avr_vcd_swap(), there are no comments here
+			continue;
+		int i = l->signal->irq.irq;
+		uint64_t when = avr_cycles_to_nsec(vcd->avr, l->when - vcd->start);
+
+		// same fudge as avr_vcd_flush_log(), a pulse is at least 1ns
+		if (when < base)
+			when = base;
+		if (ntimes && when == base && (seen & (1ULL << i)))
+			when++;
+		if (!ntimes || when > base) {
+			_avr_vcd_fst_varint(&fst->times, ntimes ? when - base : when);
+			if (!ntimes)
+				first = when;
+			ntimes++;
+			base = when;
+			seen = 0;
+		}
+		seen |= 1ULL << i;
+
+		// the first is indexed from the start of the block
+		uint32_t delta = ntimes - 1 - fst->last[i];
+		fst->last[i] = ntimes - 1;
+		int size = l->signal->size;
+		if (size == 1)
+			_avr_vcd_fst_varint(&fst->chg[i], (delta << 2) | ((l->value & 1) << 1));
+		else {
+			_avr_vcd_fst_varint(&fst->chg[i], delta << 1);
+			uint8_t * d = _avr_vcd_fst_room(&fst->chg[i], (size + 7) / 8);
+			memset(d, 0, (size + 7) / 8);
+			for (int bit = 0; bit < size; bit++)	// msb first
+				if (l->value & (1u << (size - 1 - bit)))
+					d[bit / 8] |= 0x80 >> (bit & 7);
+		}
+		fst->value[i] = l->value;
+		fst->known |= 1ULL << i;
+	}
+	if (!ntimes)
+		return;
+
+	b->len = 0;
+	*_avr_vcd_fst_room(b, 1) = FST_BL_VCDATA_DYN_ALIAS2;
+	_avr_vcd_fst_u64(b, 0);	// length, see below
+	_avr_vcd_fst_u64(b, first);
+	_avr_vcd_fst_u64(b, base);
+	_avr_vcd_fst_u64(b, 0);	// memory the reader needs, see below
+
+	size_t len = _avr_vcd_fst_deflate(fst, fst->frame.b, fst->frame.len);
+	_avr_vcd_fst_varint(b, fst->frame.len);
+	_avr_vcd_fst_varint(b, len);
+	_avr_vcd_fst_varint(b, vcd->signal_count);
+	_avr_vcd_fst_put(b, fst->z.b, len);
+
+	// the changes, their offsets are from the pack type
+	uint64_t offset[AVR_VCD_MAX_SIGNALS];
+	uint64_t memory = 0;
+	_avr_vcd_fst_varint(b, vcd->signal_count);
+	size_t vc = b->len;
+	*_avr_vcd_fst_room(b, 1) = 'Z';
+	for (int i = 0; i < vcd->signal_count; i++) {
+		if (!fst->chg[i].len)
+			continue;
+		offset[i] = b->len - vc;
+		memory += fst->chg[i].len;
+		len = _avr_vcd_fst_deflate(fst, fst->chg[i].b, fst->chg[i].len);
+		_avr_vcd_fst_varint(b, len == fst->chg[i].len ? 0 : fst->chg[i].len);
+		_avr_vcd_fst_put(b, fst->z.b, len);
+	}
+	/*
+	 * Where each signal's changes are: a delta to the previous offset,
+	 * shifted with the low bit set, or a count of signals that didn't
+	 * change, shifted with it clear
+	 */
+	size_t chain = b->len;
+	uint64_t prev = 0;
+	uint32_t none = 0;
+	for (int i = 0; i < vcd->signal_count; i++) {
+		if (!fst->chg[i].len) {
+			none++;
+			continue;
+		}
+		if (none)
+			_avr_vcd_fst_varint(b, none << 1);
+		none = 0;
+		_avr_vcd_fst_svarint(b, ((offset[i] - prev) << 1) | 1);
+		prev = offset[i];
+	}
+	if (none)
+		_avr_vcd_fst_varint(b, none << 1);
+	_avr_vcd_fst_u64(b, b->len - chain);
+
+	len = _avr_vcd_fst_deflate(fst, fst->times.b, fst->times.len);
+	_avr_vcd_fst_put(b, fst->z.b, len);
+	_avr_vcd_fst_u64(b, fst->times.len);
+	_avr_vcd_fst_u64(b, len);
+	_avr_vcd_fst_u64(b, ntimes);
+
+	_avr_vcd_fst_be64(b->b + 1, b->len - 1);	// not counting the type
+	_avr_vcd_fst_be64(b->b + 25, memory);
+	_avr_vcd_write(vcd, (char *)b->b, b->len);
+
+	if (!fst->blocks++)
+		fst->start = first;
+	fst->end = base;
+}
+
+static void _avr_vcd_fst_close(avr_vcd_t * vcd)
+{
+	avr_vcd_fst_t * fst = vcd->priv;
+	avr_vcd_fst_buf_t * b = &fst->block;
+	avr_vcd_fst_buf_t h = {0};
+
+	// the size of each signal
+	for (int i = 0; i < vcd->signal_count; i++)
+		_avr_vcd_fst_varint(&h, vcd->signal[i].size);
+	size_t len = _avr_vcd_fst_deflate(fst, h.b, h.len);
+	b->len = 0;
+	*_avr_vcd_fst_room(b, 1) = FST_BL_GEOM;
+	_avr_vcd_fst_u64(b, 24 + len);
+	_avr_vcd_fst_u64(b, h.len);
+	_avr_vcd_fst_u64(b, vcd->signal_count);
+	_avr_vcd_fst_put(b, fst->z.b, len);
+
+	// the scope, gzip compressed
+	h.len = 0;
+	*_avr_vcd_fst_room(&h, 1) = FST_ST_VCD_SCOPE;
+	*_avr_vcd_fst_room(&h, 1) = FST_ST_VCD_MODULE;
+	_avr_vcd_fst_put(&h, "logic\0", 7);	// and no component name
+	for (int i = 0; i < vcd->signal_count; i++) {
+		avr_vcd_signal_t * s = &vcd->signal[i];
+		*_avr_vcd_fst_room(&h, 1) = FST_VT_VCD_WIRE;
+		*_avr_vcd_fst_room(&h, 1) = 0;	// implicit direction
+		_avr_vcd_fst_put(&h, s->name, strnlen(s->name, sizeof(s->name)));
+		*_avr_vcd_fst_room(&h, 1) = 0;
+		_avr_vcd_fst_varint(&h, s->size);
+		_avr_vcd_fst_varint(&h, 0);	// not an alias
+	}
+	*_avr_vcd_fst_room(&h, 1) = FST_ST_VCD_UPSCOPE;
+
+	z_stream z = {0};
+	// 16 + max window bits, for a gzip wrapper
+	deflateInit2(&z, 4, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+	fst->z.len = 0;
+	uint8_t * d = _avr_vcd_fst_room(&fst->z, deflateBound(&z, h.len));
+	z.next_in = h.b;
+	z.avail_in = h.len;
+	z.next_out = d;
+	z.avail_out = fst->z.len;
+	deflate(&z, Z_FINISH);
+	*_avr_vcd_fst_room(b, 1) = FST_BL_HIER;
+	_avr_vcd_fst_u64(b, 16 + z.total_out);
+	_avr_vcd_fst_u64(b, h.len);
+	_avr_vcd_fst_put(b, d, z.total_out);
+	deflateEnd(&z);
+	_avr_vcd_write(vcd, (char *)b->b, b->len);
+
+	if (lseek(fileno(vcd->output), 0, SEEK_SET) == 0) {
+		b->len = 0;
+		_avr_vcd_fst_header_block(vcd, b);
+		_avr_vcd_write(vcd, (char *)b->b, b->len);
+	}
+
+	free(h.b);
+	for (int i = 0; i < AVR_VCD_MAX_SIGNALS; i++)
+		free(fst->chg[i].b);
+	free(fst->frame.b);
+	free(fst->times.b);
+	free(fst->block.b);
+	free(fst->z.b);
+	free(fst);
+	vcd->priv = NULL;
+}
+
+#ifndef __MINGW32__
+/*
+ * Live backend, a FIFO or a UNIX socket. It's non blocking, so the
+ * writer thread gives up on a stalled reader rather than hanging, see
+ * _avr_vcd_write(); avr_vcd_swap() is the simulation side
+ */
+static int _avr_vcd_live_match(const char * filename)
+{
+	struct stat st;
+	return !strncmp(filename, "unix:", 5) ||
+			(!stat(filename, &st) && S_ISFIFO(st.st_mode));
+}
+
+static int _avr_vcd_live_open(avr_vcd_t * vcd)
+{
+	int fd;
+
+	if (!strncmp(vcd->filename, "unix:", 5)) {
+		struct sockaddr_un addr = { .sun_family = AF_UNIX };
+		strncpy(addr.sun_path, vcd->filename + 5, sizeof(addr.sun_path) - 1);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd != -1 && connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+			close(fd);
+			fd = -1;
+		}
+		if (fd != -1)
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	} else	// fails rather than hangs if nobody reads it
+		fd = open(vcd->filename, O_WRONLY | O_NONBLOCK);
+	if (fd == -1 || !(vcd->output = fdopen(fd, "w"))) {
+		perror(vcd->filename);
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+static const avr_vcd_backend_t _avr_vcd_backends[] = {
+	{ .name = "fst", .match = _avr_vcd_fst_match, .open = _avr_vcd_fst_open,
+		.header = _avr_vcd_fst_header, .log = _avr_vcd_fst_log,
+		.close = _avr_vcd_fst_close },
+	{ .name = "gzip", .match = _avr_vcd_gz_match, .open = _avr_vcd_gz_open,
+		.block = _avr_vcd_gz_block, .write = _avr_vcd_gz_write,
+		.close = _avr_vcd_gz_close },
+#ifndef __MINGW32__
+	{ .name = "live", .live = 1, .match = _avr_vcd_live_match,
+		.open = _avr_vcd_live_open, .write = _avr_vcd_write },
+#endif
+	{ .name = "vcd", .open = _avr_vcd_file_open, .write = _avr_vcd_write },
+};
+
+static const avr_vcd_backend_t * _avr_vcd_get_backend(const char * filename)
+{
+	const avr_vcd_backend_t * b = _avr_vcd_backends;
+	while (b->match && !b->match(filename))
+		b++;
+	return b;
+}
+
+/*
+ * Called from the writer thread, with a buffer the simulation doesn't
+ * touch until it's done
+ */
+static void avr_vcd_flush_log(avr_vcd_t * vcd, avr_vcd_log_p log, uint32_t count)
 {
 #if AVR_VCD_MAX_SIGNALS > 32
 	uint64_t seen = 0;
@@ -124,15 +690,26 @@ static void avr_vcd_flush_log(avr_vcd_t * vcd)
 	uint32_t seen = 0;
 #endif
 	uint64_t oldbase = 0;	// make sure it's different
-	char out[48];
+	char * out = vcd->writer.out;
+	char * dst = out;
 
-	if (!vcd->logindex || !vcd->output)
+//	printf("avr_vcd_flush_log %d\n", count);
+	if (!count)
 		return;
-//	printf("avr_vcd_flush_log %d\n", vcd->logindex);
-
+	if (vcd->backend->log) {
+		vcd->backend->log(vcd, log, count);
+		return;
+	}
+	if (vcd->backend->block)
+		vcd->backend->block(vcd,
+				avr_cycles_to_nsec(vcd->avr, log[0].when - vcd->start));
 
-	for (uint32_t li = 0; li < vcd->logindex; li++) {
-		avr_vcd_log_t *l = &vcd->log[li];
+	for (uint32_t li = 0; li < count; li++) {
+		avr_vcd_log_t *l = &log[li];
+		if (!l->signal) {	// see avr_vcd_swap()
+			dst += sprintf(dst, "$comment %u changes dropped $end\n", l->value);
+			continue;
+		}
 		uint64_t base = avr_cycles_to_nsec(vcd->avr, l->when - vcd->start);	// 1ns base
 
 		// if that trace was seen in this nsec already, we fudge the base time
@@ -140,24 +717,108 @@ static void avr_vcd_flush_log(avr_vcd_t * vcd)
 		// at least a small pulse on the waveform
 		// This is a bit of a fudge, but it is the only way to represent very
 		// short"pulses" that are still visible on the waveform.
-		if (base == oldbase && seen & (1 << l->signal->irq.irq))
+		if (base == oldbase && (seen & (1ULL << l->signal->irq.irq)))
 			base++;	// this forces a new timestamp
 
 		if (base > oldbase || li == 0) {
 			seen = 0;
-			fprintf(vcd->output, "#%" PRIu64  "\n", base);
+			*dst++ = '#';
+			dst = _avr_vcd_put_u64(dst, base);
+			*dst++ = '\n';
 			oldbase = base;
 		}
-		seen |= (1 << l->signal->irq.irq);	// mark this trace as seen for this timestamp
-		fprintf(vcd->output, "%s\n", _avr_vcd_get_signal_text(l->signal, out, l->value));
+		seen |= (1ULL << l->signal->irq.irq);	// mark this trace as seen for this timestamp
+		dst = _avr_vcd_put_signal(l->signal, dst, l->value);
+		*dst++ = '\n';
+		// room for a timestamp and a 32 bits value
+		if (dst - out > AVR_VCD_OUT_SIZE - 128) {
+			vcd->backend->write(vcd, out, dst - out);
+			dst = out;
+		}
 	}
+	if (dst > out)
+		vcd->backend->write(vcd, out, dst - out);
+}
+
+static void * avr_vcd_writer(void * param)
+{
+	avr_vcd_t * vcd = param;
+#ifndef __MINGW32__
+	// a reader going away gives EPIPE here, rather than killing us
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+#endif
+
+	pthread_mutex_lock(&vcd->writer.lock);
+	for (;;) {
+		while (!vcd->writer.log && !vcd->writer.quit)
+			pthread_cond_wait(&vcd->writer.cond, &vcd->writer.lock);
+		if (!vcd->writer.log)
+			break;
+		avr_vcd_log_p log = vcd->writer.log;
+		uint32_t count = vcd->writer.count;
+		pthread_mutex_unlock(&vcd->writer.lock);
+
+		avr_vcd_flush_log(vcd, log, count);
+
+		pthread_mutex_lock(&vcd->writer.lock);
+		vcd->writer.log = NULL;
+		pthread_cond_broadcast(&vcd->writer.cond);
+	}
+	pthread_mutex_unlock(&vcd->writer.lock);
+	return NULL;
+}
+
+/*
+ * Hand the buffer being filled to the writer, and carry on with the
+ * other one. Without 'wait', returns -1 if the writer is still busy
+ * with the other one. The new buffer starts with what was dropped
+ * meanwhile: a marker with the count, then the last values
+ */
+static int avr_vcd_swap(avr_vcd_t * vcd, int wait)
+{
+	if (!vcd->logindex)
+		return 0;
+	pthread_mutex_lock(&vcd->writer.lock);
+	while (vcd->writer.log) {	// still busy with the other one
+		if (!wait) {
+			pthread_mutex_unlock(&vcd->writer.lock);
+			return -1;
+		}
+		pthread_cond_wait(&vcd->writer.cond, &vcd->writer.lock);
+	}
+	vcd->writer.log = vcd->log;
+	vcd->writer.count = vcd->logindex;
+	pthread_cond_broadcast(&vcd->writer.cond);
+	pthread_mutex_unlock(&vcd->writer.lock);
+
+	vcd->log = vcd->log == vcd->buffer[0] ? vcd->buffer[1] : vcd->buffer[0];
 	vcd->logindex = 0;
+
+	if (!vcd->dropped.count)
+		return 0;
+	avr_vcd_log_t * l = &vcd->log[vcd->logindex++];
+	l->signal = NULL;
+	l->when = vcd->avr->cycle;
+	l->value = vcd->dropped.count;
+	while (vcd->dropped.mask) {
+		int i = __builtin_ctzll(vcd->dropped.mask);
+		vcd->dropped.mask &= vcd->dropped.mask - 1;
+		l = &vcd->log[vcd->logindex++];
+		l->signal = &vcd->signal[i];
+		l->when = vcd->avr->cycle;
+		l->value = vcd->dropped.value[i];
+	}
+	vcd->dropped.count = 0;
+	return 0;
 }
 
 static avr_cycle_count_t _avr_vcd_timer(struct avr_t * avr, avr_cycle_count_t when, void * param)
 {
 	avr_vcd_t * vcd = param;
-	avr_vcd_flush_log(vcd);
+	avr_vcd_swap(vcd, !vcd->backend->live);
 	return when + vcd->period;
 }
 
@@ -191,50 +852,345 @@ int avr_vcd_add_signal(avr_vcd_t * vcd,
 }
 
 
-int avr_vcd_start(avr_vcd_t * vcd)
+/*
+ * The header goes through the backend too, it's small enough. The
+ * initial 'values' are unknown when NULL
+ */
+static void _avr_vcd_header(avr_vcd_t * vcd, const uint32_t * values)
 {
-	if (vcd->output)
-		avr_vcd_stop(vcd);
-	vcd->output = fopen(vcd->filename, "w");
-	if (vcd->output == NULL) {
-		perror(vcd->filename);
-		return -1;
+	if (vcd->backend->header) {
+		vcd->backend->header(vcd, values);
+		return;
 	}
-
-	fprintf(vcd->output, "$timescale 1ns $end\n");	// 1ns base
-	fprintf(vcd->output, "$scope module logic $end\n");
+	char * h = vcd->writer.out;
+	h += sprintf(h, "$timescale 1ns $end\n");	// 1ns base
+	h += sprintf(h, "$scope module logic $end\n");
 
 	for (int i = 0; i < vcd->signal_count; i++) {
-		fprintf(vcd->output, "$var wire %d %c %s $end\n",
+		h += sprintf(h, "$var wire %d %c %s $end\n",
 			vcd->signal[i].size, vcd->signal[i].alias, vcd->signal[i].name);
 	}
 
-	fprintf(vcd->output, "$upscope $end\n");
-	fprintf(vcd->output, "$enddefinitions $end\n");
+	h += sprintf(h, "$upscope $end\n");
+	h += sprintf(h, "$enddefinitions $end\n");
 
-	fprintf(vcd->output, "$dumpvars\n");
+	h += sprintf(h, "$dumpvars\n");
 	for (int i = 0; i < vcd->signal_count; i++) {
 		avr_vcd_signal_t * s = &vcd->signal[i];
 		char out[48];
-		fprintf(vcd->output, "%s\n", _avr_vcd_get_float_signal_text(s, out));
+		if (values) {
+			h = _avr_vcd_put_signal(s, h, values[i]);
+			*h++ = '\n';
+		} else
+			h += sprintf(h, "%s\n", _avr_vcd_get_float_signal_text(s, out));
+	}
+	h += sprintf(h, "$end\n");
+	vcd->backend->write(vcd, vcd->writer.out, h - vcd->writer.out);
+}
+
+int avr_vcd_start(avr_vcd_t * vcd)
+{
+	if (vcd->output || vcd->capture.state)
+		avr_vcd_stop(vcd);
+
+	vcd->backend = _avr_vcd_get_backend(vcd->filename);
+	vcd->writer.dead = 0;
+	if (vcd->backend->open(vcd)) {
+		AVR_LOG(vcd->avr, LOG_ERROR, "%s: %s: can't start the %s output\n",
+				__func__, vcd->filename, vcd->backend->name);
+		return -1;
 	}
-	fprintf(vcd->output, "$end\n");
+	memset(&vcd->dropped, 0, sizeof(vcd->dropped));
+
+	vcd->writer.out = malloc(AVR_VCD_OUT_SIZE);
+	_avr_vcd_header(vcd, NULL);
+
+	for (int i = 0; i < 2; i++)
+		vcd->buffer[i] = malloc(AVR_VCD_LOG_SIZE * sizeof(vcd->log[0]));
+	vcd->log = vcd->buffer[0];
 	vcd->logindex = 0;
+	vcd->writer.log = NULL;
+	vcd->writer.quit = 0;
+	vcd->writer.closing = 0;
+	pthread_mutex_init(&vcd->writer.lock, NULL);
+	pthread_cond_init(&vcd->writer.cond, NULL);
+	pthread_create(&vcd->writer.thread, NULL, avr_vcd_writer, vcd);
+
 	vcd->start = vcd->avr->cycle;
 	avr_cycle_timer_register(vcd->avr, vcd->period, _avr_vcd_timer, vcd);
 	return 0;
 }
 
+static void _avr_vcd_capture_disarm(avr_vcd_t * vcd);
+
 int avr_vcd_stop(avr_vcd_t * vcd)
 {
 	avr_cycle_timer_cancel(vcd->avr, _avr_vcd_timer, vcd);
+	if (vcd->capture.state) {
+		_avr_vcd_capture_disarm(vcd);
+		return 0;
+	}
 
-	avr_vcd_flush_log(vcd);
+	if (!vcd->output)
+		return 0;
+	/*
+	 * Hand over what's left, and let the writer finish. From now on it
+	 * gives a stalled live reader up after AVR_VCD_LIVE_TIMEOUT, so
+	 * this waits that long at most
+	 */
+	vcd->writer.closing = 1;
+	avr_vcd_swap(vcd, 1);
+	pthread_mutex_lock(&vcd->writer.lock);
+	vcd->writer.quit = 1;
+	pthread_cond_broadcast(&vcd->writer.cond);
+	pthread_mutex_unlock(&vcd->writer.lock);
+	pthread_join(vcd->writer.thread, NULL);
+	pthread_mutex_destroy(&vcd->writer.lock);
+	pthread_cond_destroy(&vcd->writer.cond);
+	if (vcd->backend->close)
+		vcd->backend->close(vcd);
 
-	if (vcd->output)
-		fclose(vcd->output);
+	fclose(vcd->output);
 	vcd->output = NULL;
+	for (int i = 0; i < 2; i++) {
+		free(vcd->buffer[i]);
+		vcd->buffer[i] = NULL;
+	}
+	free(vcd->writer.out);
+	vcd->writer.out = NULL;
+	vcd->log = NULL;
+	vcd->logindex = 0;
+	return 0;
+}
+
+
+
+/*
+ * Triggered capture. While armed, the changes go round a ring of 'pre'
+ * entries, and the value of what falls off the end is kept in 'base',
+ * the initial values of the capture. Once it fired, the ring is put
+ * back in order, the 'post' changes are added after it, and it's all
+ * written in one go.
+ */
+static void _avr_vcd_reverse(avr_vcd_log_p log, uint32_t count)
+{
+	for (uint32_t i = 0; i < count / 2; i++) {
+		avr_vcd_log_t t = log[i];
+		log[i] = log[count - 1 - i];
+		log[count - 1 - i] = t;
+	}
+}
+
+static void _avr_vcd_capture_write(avr_vcd_t * vcd)
+{
+	avr_t * avr = vcd->avr;
+
+	vcd->backend = _avr_vcd_get_backend(vcd->filename);
+	vcd->writer.dead = 0;
+	// written from here, a stalled reader can't be waited for
+	vcd->writer.closing = 1;
+	if (vcd->backend->open(vcd)) {
+		AVR_LOG(avr, LOG_ERROR, "%s: %s: can't start the %s output\n",
+				__func__, vcd->filename, vcd->backend->name);
+		return;
+	}
+	// the waveform starts with the oldest change kept
+	vcd->start = vcd->capture.count ?
+			vcd->capture.log[0].when : vcd->capture.when;
+	vcd->writer.out = malloc(AVR_VCD_OUT_SIZE);
+	_avr_vcd_header(vcd, vcd->capture.base);
+	if (vcd->backend->write) {
+		int l = sprintf(vcd->writer.out, "$comment trigger at #%llu, cycle %llu $end\n",
+				(unsigned long long)avr_cycles_to_nsec(avr, vcd->capture.when - vcd->start),
+				(unsigned long long)vcd->capture.when);
+		vcd->backend->write(vcd, vcd->writer.out, l);
+	}
+	avr_vcd_flush_log(vcd, vcd->capture.log,
+			vcd->capture.count + vcd->capture.posted);
+	if (vcd->backend->close)
+		vcd->backend->close(vcd);
+	fclose(vcd->output);
+	vcd->output = NULL;
+	free(vcd->writer.out);
+	vcd->writer.out = NULL;
+}
+
+static void _avr_vcd_capture_unhook(avr_vcd_t * vcd);
+
+static void _avr_vcd_capture_fire(avr_vcd_t * vcd)
+{
+	avr_vcd_log_p log = vcd->capture.log;
+	uint32_t head = vcd->capture.head;
+
+	_avr_vcd_capture_unhook(vcd);
+	vcd->capture.state = AVR_VCD_CAPTURE_TRIGGERED;
+	vcd->capture.when = vcd->avr->cycle;
+	AVR_LOG(vcd->avr, LOG_TRACE, "VCD: %s: %s triggered\n", __func__, vcd->filename);
+	// the ring wrapped, rotate the oldest to the front
+	if (vcd->capture.count == vcd->capture.pre && head) {
+		_avr_vcd_reverse(log, head);
+		_avr_vcd_reverse(log + head, vcd->capture.pre - head);
+		_avr_vcd_reverse(log, vcd->capture.pre);
+	}
+	if (!vcd->capture.post)
+		_avr_vcd_capture_disarm(vcd);
+}
+
+static void _avr_vcd_capture_log(avr_vcd_t * vcd, avr_vcd_signal_t * s, uint32_t value)
+{
+	avr_vcd_trigger_t * t = &vcd->capture.trigger;
+	uint32_t old = s->irq.value;	// still the previous value here
+
+	if (vcd->capture.state == AVR_VCD_CAPTURE_ARMED && t->signal == s->irq.irq) {
+		int fire = 0;
+		switch (t->kind) {
+			case AVR_VCD_TRIGGER_RISING:
+				fire = (value & ~old & t->mask) != 0;
+				break;
+			case AVR_VCD_TRIGGER_FALLING:
+				fire = (old & ~value & t->mask) != 0;
+				break;
+			case AVR_VCD_TRIGGER_VALUE:
+				fire = (value & t->mask) == t->value &&
+						(old & t->mask) != t->value;
+				break;
+		}
+		if (fire)
+			_avr_vcd_capture_fire(vcd);
+	}
+	avr_vcd_log_t * l;
+	if (vcd->capture.state == AVR_VCD_CAPTURE_ARMED) {
+		if (!vcd->capture.pre) {
+			vcd->capture.base[s->irq.irq] = value;
+			return;
+		}
+		l = &vcd->capture.log[vcd->capture.head];
+		if (vcd->capture.count == vcd->capture.pre)
+			vcd->capture.base[l->signal->irq.irq] = l->value;
+		else
+			vcd->capture.count++;
+		if (++vcd->capture.head == vcd->capture.pre)
+			vcd->capture.head = 0;
+	} else if (vcd->capture.state == AVR_VCD_CAPTURE_TRIGGERED)
+		l = &vcd->capture.log[vcd->capture.count + vcd->capture.posted++];
+	else
+		return;
+	l->signal = s;
+	l->when = vcd->avr->cycle;
+	l->value = value;
+	if (vcd->capture.state == AVR_VCD_CAPTURE_TRIGGERED &&
+			vcd->capture.posted == vcd->capture.post)
+		_avr_vcd_capture_disarm(vcd);
+}
+
+static avr_cycle_count_t _avr_vcd_capture_timer(struct avr_t * avr, avr_cycle_count_t when, void * param)
+{
+	avr_vcd_t * vcd = param;
+	if (vcd->capture.state == AVR_VCD_CAPTURE_ARMED)
+		_avr_vcd_capture_fire(vcd);
 	return 0;
 }
 
+/*
+ * Fired from a timer in the same cycle, the hook can't be removed
+ * while it's being called
+ */
+static void _avr_vcd_capture_vector(struct avr_irq_t * irq, uint32_t value, void * param)
+{
+	avr_vcd_t * vcd = (avr_vcd_t *)param;
+	if (value && vcd->capture.state == AVR_VCD_CAPTURE_ARMED)
+		avr_cycle_timer_register(vcd->avr, 0, _avr_vcd_capture_timer, vcd);
+}
+
+static void _avr_vcd_capture_run(avr_t * avr)
+{
+	avr_vcd_t * vcd = avr->vcd;
+	void (*run)(avr_t * avr) = vcd->capture.run;
 
+	if (avr->pc == vcd->capture.trigger.pc && avr->state == cpu_Running)
+		_avr_vcd_capture_fire(vcd);	// restores avr->run
+	run(avr);
+}
+
+// removes the PC or vector hooks, once fired or disarmed
+static void _avr_vcd_capture_unhook(avr_vcd_t * vcd)
+{
+	avr_t * avr = vcd->avr;
+
+	if (vcd->capture.run) {
+		avr->run = vcd->capture.run;
+		vcd->capture.run = NULL;
+	}
+	if (vcd->capture.state == AVR_VCD_CAPTURE_ARMED &&
+			vcd->capture.trigger.kind == AVR_VCD_TRIGGER_VECTOR)
+		avr_irq_unregister_notify(
+				avr_get_interrupt_irq(avr, vcd->capture.trigger.vector) +
+					AVR_INT_IRQ_RUNNING,
+				_avr_vcd_capture_vector, vcd);
+}
+
+static void _avr_vcd_capture_disarm(avr_vcd_t * vcd)
+{
+	if (vcd->capture.state == AVR_VCD_CAPTURE_TRIGGERED)
+		_avr_vcd_capture_write(vcd);
+	else
+		_avr_vcd_capture_unhook(vcd);
+	avr_cycle_timer_cancel(vcd->avr, _avr_vcd_capture_timer, vcd);
+	if (vcd->capture.own_vcd)
+		vcd->avr->vcd = NULL;
+	vcd->capture.state = AVR_VCD_CAPTURE_OFF;
+	free(vcd->capture.log);
+	vcd->capture.log = NULL;
+}
+
+int avr_vcd_capture(avr_vcd_t * vcd,
+	const avr_vcd_trigger_t * trigger,
+	uint32_t pre,
+	uint32_t post )
+{
+	avr_t * avr = vcd->avr;
+
+	avr_vcd_stop(vcd);
+	switch (trigger->kind) {
+		case AVR_VCD_TRIGGER_RISING:
+		case AVR_VCD_TRIGGER_FALLING:
+		case AVR_VCD_TRIGGER_VALUE:
+			if (trigger->signal >= vcd->signal_count)
+				goto invalid;
+			break;
+		case AVR_VCD_TRIGGER_VECTOR:
+			if (!trigger->vector ||
+					!avr_get_interrupt_irq(avr, trigger->vector))
+				goto invalid;
+			break;
+		case AVR_VCD_TRIGGER_PC:
+			if (avr->vcd && avr->vcd != vcd)
+				goto invalid;
+			break;
+		default:
+			goto invalid;
+	}
+	memset(&vcd->capture, 0, sizeof(vcd->capture));
+	vcd->capture.trigger = *trigger;
+	vcd->capture.pre = pre;
+	vcd->capture.post = post;
+	vcd->capture.log = malloc((pre + post + 1) * sizeof(vcd->capture.log[0]));
+	for (int i = 0; i < vcd->signal_count; i++)
+		vcd->capture.base[i] = vcd->signal[i].irq.value;
+
+	if (trigger->kind == AVR_VCD_TRIGGER_VECTOR)
+		avr_irq_register_notify(
+				avr_get_interrupt_irq(avr, trigger->vector) + AVR_INT_IRQ_RUNNING,
+				_avr_vcd_capture_vector, vcd);
+	if (trigger->kind == AVR_VCD_TRIGGER_PC) {
+		vcd->capture.own_vcd = !avr->vcd;
+		avr->vcd = vcd;
+		vcd->capture.run = avr->run;
+		avr->run = _avr_vcd_capture_run;
+	}
+	vcd->capture.state = AVR_VCD_CAPTURE_ARMED;
+	return 0;
+invalid:
+	AVR_LOG(avr, LOG_ERROR, "VCD: %s: %s: invalid trigger\n", __func__, vcd->filename);
+	return -1;
+}
@@ -26,6 +26,7 @@
 #define __SIM_VCD_FILE_H__
 
 #include <stdio.h>
+#include <pthread.h>
 #include "sim_irq.h"
 
 #ifdef __cplusplus
@@ -37,6 +38,10 @@ extern "C" {
  * 
  * This structure registers IRQ change hooks to various "source" IRQs
  * and dumps their values (if changed) at certain intervals into the VCD file
+ *
+ * The changes are logged into one of two fixed buffers; at each period,
+ * or when it is full, that buffer is handed over to a writer thread that
+ * formats it and writes it out while the simulation fills the other one.
  */
 
 #define AVR_VCD_MAX_SIGNALS 64
@@ -54,13 +59,67 @@ typedef struct avr_vcd_log_t {
 	uint32_t value;
 } avr_vcd_log_t, *avr_vcd_log_p;
 
-#define AVR_VCD_LOG_CHUNK_SIZE	(4096 / sizeof(avr_vcd_signal_t))
+/*
+ * Where the formatted text goes, picked from the file name by
+ * avr_vcd_start(). 'open' sets 'output'. 'block' is called before each
+ * buffer of changes, with its first timestamp; each starts with that
+ * timestamp. A 'live' backend has a reader at the other end that may
+ * not keep up, the simulation never waits for it. A binary backend
+ * sets 'header' and 'log' instead of 'write', it gets the initial
+ * values (NULL when unknown) then each buffer of changes as they are.
+ */
+struct avr_vcd_t;
+typedef struct avr_vcd_backend_t {
+	const char * name;
+	int live;
+	int (*match)(const char * filename);	// NULL matches all
+	int (*open)(struct avr_vcd_t * vcd);
+	void (*block)(struct avr_vcd_t * vcd, uint64_t base);
+	void (*write)(struct avr_vcd_t * vcd, const char * buf, size_t len);
+	void (*header)(struct avr_vcd_t * vcd, const uint32_t * values);
+	void (*log)(struct avr_vcd_t * vcd, avr_vcd_log_p log, uint32_t count);
+	void (*close)(struct avr_vcd_t * vcd);
+} avr_vcd_backend_t;
+
+/*
+ * What fires a triggered capture, see avr_vcd_capture(). 'signal' is the
+ * index of the signal, in the order they were added
+ */
+enum {
+	AVR_VCD_TRIGGER_RISING = 0,	// a bit of 'mask' in 'signal' goes high
+	AVR_VCD_TRIGGER_FALLING,	// a bit of 'mask' in 'signal' goes low
+	AVR_VCD_TRIGGER_VALUE,		// 'signal' & 'mask' becomes 'value'
+	AVR_VCD_TRIGGER_VECTOR,		// interrupt 'vector' is entered
+	AVR_VCD_TRIGGER_PC,			// the instruction at 'pc' is about to run
+};
+
+typedef struct avr_vcd_trigger_t {
+	int			kind;
+	int			signal;
+	uint32_t	mask;
+	uint32_t	value;
+	uint8_t		vector;
+	uint32_t	pc;			// byte address, as avr->pc
+} avr_vcd_trigger_t;
+
+enum {
+	AVR_VCD_CAPTURE_OFF = 0,
+	AVR_VCD_CAPTURE_ARMED,
+	AVR_VCD_CAPTURE_TRIGGERED,
+};
+
+#define AVR_VCD_LOG_SIZE	(64 * 1024)	// changes per buffer
+#define AVR_VCD_OUT_SIZE	(256 * 1024)	// text per write()
+#define AVR_VCD_GZ_FLUSH_SIZE	(4 * 1024 * 1024)	// text between gzip restart points
+#define AVR_VCD_LIVE_TIMEOUT	1000	// ms a live reader may stall for, when stopping
 
 typedef struct avr_vcd_t {
 	struct avr_t *	avr;	// AVR we are attaching timers to..
 	
 	char filename[74];		// output filename
 	FILE * output;
+	const avr_vcd_backend_t * backend;
+	void * priv;			// backend state
 
 	int signal_count;
 	avr_vcd_signal_t	signal[AVR_VCD_MAX_SIGNALS];
@@ -68,9 +127,44 @@ typedef struct avr_vcd_t {
 	uint64_t period;
 	uint64_t start;
 
-	size_t			logsize;
 	uint32_t		logindex;
-	avr_vcd_log_p	log;
+	avr_vcd_log_p	log;		// buffer being filled
+	avr_vcd_log_p	buffer[2];
+
+	// changes not logged while a live reader was behind, summarised
+	struct {
+		uint32_t	count;
+		uint64_t	mask;		// signals that changed
+		uint32_t	value[AVR_VCD_MAX_SIGNALS];	// their last value
+	} dropped;
+
+	// the writer thread, and the buffer it was handed, if any
+	struct {
+		pthread_t		thread;
+		pthread_mutex_t	lock;
+		pthread_cond_t	cond;
+		avr_vcd_log_p	log;
+		uint32_t		count;
+		int				quit;
+		volatile int	closing;	// stopping, give a stalled reader up
+		int				dead;	// the output failed, stop writing
+		char *			out;
+	} writer;
+
+	// triggered capture, nothing goes to the file until it fires
+	struct {
+		int				state;
+		avr_vcd_trigger_t	trigger;
+		avr_vcd_log_p	log;	// the 'pre' ring, then the 'post' changes
+		uint32_t		pre, post;
+		uint32_t		head;	// next ring entry
+		uint32_t		count;	// changes kept
+		uint32_t		posted;
+		uint32_t		base[AVR_VCD_MAX_SIGNALS];	// before the oldest kept
+		uint64_t		when;	// cycle it fired
+		int				own_vcd;	// we set avr->vcd, for a PC trigger
+		void (*run)(struct avr_t * avr);	// the core's, for a PC trigger
+	} capture;
 } avr_vcd_t;
 
 // initializes a new VCD trace file, and returns zero if all is well
@@ -86,11 +180,45 @@ int avr_vcd_add_signal(avr_vcd_t * vcd,
 	int signal_bit_size,
 	const char * name );
 
-// Starts recording the signal value into the file
+/*
+ * Starts recording the signal value into the file. A name ending in
+ * ".fst" gives gtkwave's own binary format instead of a VCD: compressed
+ * blocks of changes, one per buffer, that it seeks by timestamp.
+ *
+ * A name ending in ".gz" gives a gzip compressed VCD that gtkwave reads
+ * as is. It's fully flushed every AVR_VCD_GZ_FLUSH_SIZE of text or so,
+ * at the start of a buffer, so it can be decompressed from there; the
+ * first timestamp and file offset of these are listed in
+ * "<filename>.idx".
+ *
+ * The name of a FIFO, or "unix:<path>" to connect to a listening UNIX
+ * socket, streams the VCD live, to gtkwave through shmidcat for example.
+ * The reader must be there already. When it can't keep up, changes are
+ * summarised rather than stalling the simulation: only the last value
+ * of each signal is sent once it caught up, after a $comment saying how
+ * many were dropped. Use a short period for a short latency. When
+ * stopping, a reader that takes nothing for AVR_VCD_LIVE_TIMEOUT is given
+ * up on, rather than hanging.
+ */
 int avr_vcd_start(avr_vcd_t * vcd);
 // stops recording signal values into the file
 int avr_vcd_stop(avr_vcd_t * vcd);
 
+/*
+ * Logic analyzer mode: instead of recording everything, arms a trigger
+ * and keeps only the last 'pre' changes in memory. When it fires, the
+ * next 'post' changes are kept as well, and the lot is written to the
+ * file, which then holds a few ms around the event of a run of any
+ * length. avr_vcd_stop() writes what there is if it fired, and disarms.
+ *
+ * A PC trigger checks each instruction, and finds the trace from
+ * avr->vcd, that must be free or this one.
+ */
+int avr_vcd_capture(avr_vcd_t * vcd,
+	const avr_vcd_trigger_t * trigger,
+	uint32_t pre,
+	uint32_t post );
+
 #ifdef __cplusplus
 };
 #endif
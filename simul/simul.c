@@ -23,19 +23,20 @@
 #include "sim_vcd_file.h"
 
 #include "button.h"
+#include "charlieplex.h"
 
 button_t	button;
 int			do_button_press = 0;
 avr_t		*avr = NULL;
 avr_vcd_t	vcd_file;
-int			display_flag = 0;
-int			old_display_flag = 0;
-uint8_t		pin_state = 0;			// current port B
-uint8_t		ddr_state = 0;			// ddr port B
-uint8_t		last_cp_state = 0;		// last charlieplexing state
+charlieplex_t	display;
+uint32_t	old_windows = 0;
 
 #define		SZ_PIXSIZE		32.0
-#define		PIN_AMPM		(1 << 5)
+#define		PIN_AMPM		5
+// refresh the leds at 20 fps, and complain below flicker fusion
+#define		DISPLAY_WINDOW	50000	/* usec */
+#define		FLICKER_HZ		60
 
 const float	SZ_GRID = SZ_PIXSIZE;
 const float	SZ_LED = SZ_PIXSIZE * 0.8;
@@ -83,58 +84,44 @@ float		leds[14][8] = {
 	{VERTEX(0, 6)}
 };
 
-// charlieplexing map for leds 1 to 12 (first element not used)
+// charlieplexing map for leds 1 to 12
 // xxxxyyyy where x == 1 output, x == 0 input, y == 1 on, y == 0 off
-unsigned char cp[] = {0x00, 0x31, 0x51, 0x91, 0xA2, 0x62, 0x32, 0x64, 0xC4, 0x54, 0xA8, 0xC8, 0x98};
-// delays to keep the leds on for a while, to simulate persistence of vision
-#define		POV		1
-// first element is not used
-int delays[] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+unsigned char cp[] = {0x31, 0x51, 0x91, 0xA2, 0x62, 0x32, 0x64, 0xC4, 0x54, 0xA8, 0xC8, 0x98};
+// pins used by the display
+const uint8_t cp_pins[] = {0, 1, 2, 3, PIN_AMPM};
 
-static void set_pov()
+static void display_init()
 {
-	uint8_t	cp_state;
-
-	// note: filter only pins configured as input by and'íng ddr_state
-	cp_state = ((pin_state & ddr_state) & 0x0F) | ((ddr_state << 4) & 0xF0);
-
-	// led 13 = AM, led 14 = PM
-	if (ddr_state & PIN_AMPM) {
-		// output
-		delays[13] = (pin_state & PIN_AMPM) ? 0 : POV;
-		delays[14] = (pin_state & PIN_AMPM) ? POV : 0;
-	} else {
-		delays[13] = 0;
-		delays[14] = 0;
-	}
+	charlieplex_led_t	l[14];
 
-	if (last_cp_state != cp_state) {
-		// printf("cp_state 0x%.2X\n", cp_state);
-		last_cp_state = cp_state;
-		for (int di = 1; di <= 12; di++) {
-			if (cp[di] == cp_state) {
-				delays[di] = POV;
-			}
-		}
-		display_flag++;
+	for (int di = 0; di < 12; di++) {
+		l[di].anode = __builtin_ctz(cp[di] & 0x0F);
+		l[di].cathode = __builtin_ctz((cp[di] >> 4) & ~(1 << l[di].anode));
 	}
+	// led 13 = AM, to VCC, led 14 = PM, to ground
+	l[12].anode = CHARLIEPLEX_VCC;
+	l[12].cathode = PIN_AMPM;
+	l[13].anode = PIN_AMPM;
+	l[13].cathode = CHARLIEPLEX_GND;
+
+	charlieplex_init(avr, &display, "display", cp_pins, sizeof(cp_pins), l, 14);
+	charlieplex_connect(&display, 'B');
+	charlieplex_set_window(&display, DISPLAY_WINDOW, FLICKER_HZ);
 }
 
 /**
- * called when the AVR change any of the pins on port B
- * so lets update our buffer
+ * called by the display part when a led is dark for too long
  */
-void pin_changed_hook(struct avr_irq_t *irq, uint32_t value, void *param)
-{
-	//printf("irq: %d - value: 0x%.2X - irq->value: 0x%.2X - param: %s - ddr_state: %.2X\n", irq->irq, value, irq->value, (char *)param, ddr_state);
-	pin_state = (uint8_t)value;
-	set_pov();
-}
-
-void ddr_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+void flicker_hook(struct avr_irq_t *irq, uint32_t value, void *param)
 {
-	ddr_state = (uint8_t)value;
-	set_pov();
+	static uint32_t reported = 0;
+
+	if (reported & (1u << value))
+		return;
+	reported |= 1u << value;
+	printf("led %d flickers, refresh %.1fHz, dark for up to %.1fms\n",
+			value + 1, display.stats[value].refresh,
+			display.stats[value].max_gap * 1000.0 / avr->frequency);
 }
 
 void displayCB(void)		/* function called whenever redisplay needed */
@@ -149,20 +136,31 @@ void displayCB(void)		/* function called whenever redisplay needed */
 	glLoadIdentity(); // Start with an identity matrix
 
     glBegin(GL_QUADS);
-	glColor3f(100 / 255, 200 / 255, 255 / 255);
 
-	for (int di = 1; di <= 14; di++) {
-		if (di > 12) {
-			glColor3f(255 / 255, 100 / 255, 255 / 255);
-		}
-		if (delays[di] > 0) {
-			ledv = leds[di - 1];
-			glVertex2f(ledv[0], ledv[1]);
-			glVertex2f(ledv[2], ledv[3]);
-			glVertex2f(ledv[4], ledv[5]);
-			glVertex2f(ledv[6], ledv[7]);
-			delays[di]--;
+	// brightness from the duty cycle of the last window, relative to the
+	// brightest of the charlieplexed leds, and of the am/pm ones
+	float			max[2] = {0, 0};
+	for (int di = 0; di < 14; di++) {
+		if (display.stats[di].duty > max[di >= 12])
+			max[di >= 12] = display.stats[di].duty;
+	}
+	for (int di = 0; di < 14; di++) {
+		float		duty = display.stats[di].duty;
+		float		level;
+
+		if (duty <= 0)
+			continue;
+		level = 0.3 + 0.7 * duty / max[di >= 12];
+		if (di >= 12) {
+			glColor3f(255 / 255.0 * level, 100 / 255.0 * level, 255 / 255.0 * level);
+		} else {
+			glColor3f(100 / 255.0 * level, 200 / 255.0 * level, 255 / 255.0 * level);
 		}
+		ledv = leds[di];
+		glVertex2f(ledv[0], ledv[1]);
+		glVertex2f(ledv[2], ledv[3]);
+		glVertex2f(ledv[4], ledv[5]);
+		glVertex2f(ledv[6], ledv[7]);
 	}
 
 	glEnd();
@@ -194,13 +192,14 @@ void keyCB(unsigned char key, int x, int y)	/* called on key press */
 	}
 }
 
-// gl timer. if the pin have changed states, refresh display
+// gl timer. if the display has a new window of stats, refresh display
 void timerCB(int i)
 {
 	// restart timer
 	glutTimerFunc(1000 / 64, timerCB, 0);
 
-	if (old_display_flag != display_flag) {
+	if (old_windows != display.windows) {
+		old_windows = display.windows;
 		glutPostRedisplay();
 	}
 }
@@ -248,16 +247,13 @@ int main(int argc, char *argv[])
 		button.irq + IRQ_BUTTON_OUT,
 		avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), IOPORT_IRQ_PIN4));
 
+	// the leds, and a warning if they are not refreshed fast enough
+	display_init();
 	avr_irq_register_notify(
-		avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), IOPORT_IRQ_DIRECTION_ALL),
-		ddr_hook,
+		display.irq + IRQ_CHARLIEPLEX_FLICKER,
+		flicker_hook,
 		NULL);
 
-	avr_irq_register_notify(
-		avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), IOPORT_IRQ_PIN_ALL),
-		pin_changed_hook, 
-		"portb");
-
 	// even if not setup at startup, activate gdb if crashing
 	avr->gdb_port = 1234;
 	//if (0) {
@@ -270,15 +266,25 @@ int main(int argc, char *argv[])
 	 *	
 	 *	This will allow you to create a "wave" file and display it in gtkwave
 	 *	Pressing "r" and "s" during the demo will start and stop recording
-	 *	the pin changes
+	 *	the pin changes. The name can be given as the first argument, a FIFO
+	 *	or "unix:<path>" streams it live. It then starts right away:
+	 *		mkfifo w; shmidcat < w | gtkwave -v -I binw2.sav & ./simul w
 	 */
-	avr_vcd_init(avr, "gtkwave_output.vcd", &vcd_file, 100000 /* usec */);
+	const char * trace = "gtkwave_output.vcd";
+	if (argc > 1 && argv[1][0] != '-')
+		trace = argv[1];
+	avr_vcd_init(avr, trace, &vcd_file, 100000 /* usec */);
 	avr_vcd_add_signal(&vcd_file, 
 		avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), IOPORT_IRQ_PIN_ALL), 8 /* bits */ ,
 		"portb" );
 	avr_vcd_add_signal(&vcd_file, 
 		button.irq + IRQ_BUTTON_OUT, 1 /* bits */ ,
 		"button" );
+	avr_vcd_add_signal(&vcd_file,
+		display.irq + IRQ_CHARLIEPLEX_LIT, 14 /* bits */ ,
+		"leds" );
+	if (trace == argv[1])
+		avr_vcd_start(&vcd_file);
 
 	// 'raise' it, it's a "pullup"
 	avr_raise_irq(button.irq + IRQ_BUTTON_OUT, 0);